@@ -0,0 +1,492 @@
+/*
+ * bench.c — Library-level micro-benchmarks
+ *
+ * Drives the disk, log, inode and GC layers directly (no FUSE) on a
+ * scratch image, tmpfs-backed by default so the numbers measure the
+ * code rather than the device:
+ *
+ *   log_append       — data block append throughput (plain, with data
+ *                      checksums)
+ *   log_checkpoint   — checkpoint latency
+ *   inode_write/read — inode operation rate
+ *   gc_collect       — collection time versus live ratio
+ *   mount            — clean mount time with files and snapshots
+ *   log_recover      — mount + roll-forward time versus log length
+ *   crc32c           — checksum throughput, SSE4.2 and table
+ *
+ * Results go to stdout (or -o FILE) as one JSON object; the layers'
+ * own progress messages are discarded unless -v is given.
+ *
+ * -s picks the segment size of the scratch image, in blocks (a power
+ * of two that divides TOTAL_BLOCKS, default BLOCKS_PER_SEGMENT).
+ *
+ *   usage: lfs_bench [-i IMAGE] [-o FILE] [-s SEGMENT_BLOCKS] [-v]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include "lfs.h"
+
+#define BENCH_IMAGE      "/dev/shm/lfs-bench.img"
+#define BENCH_ROUNDS     5             /* fresh images per throughput run */
+#define BENCH_FILL       900           /* log blocks to use per image     */
+#define BENCH_INODES     100
+#define BENCH_CKPTS      500
+#define BENCH_MOUNTS     200
+#define BENCH_CRC_BYTES  (64u << 20)
+
+static struct lfs_state st;
+static const char *image = BENCH_IMAGE;
+static uint32_t seg_blocks = BLOCKS_PER_SEGMENT;
+static FILE *out;
+static int   first_result = 1;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* Percentile 'p' (0-100) of 'n' sorted samples */
+static double pct(const double *v, int n, double p)
+{
+    int i = (int)(p / 100.0 * (n - 1) + 0.5);
+    return v[i];
+}
+
+/* ------------------------------------------------------------------ */
+/*  Scratch image                                                       */
+/* ------------------------------------------------------------------ */
+
+static void die(const char *what)
+{
+    fprintf(stderr, "lfs_bench: %s failed\n", what);
+    exit(1);
+}
+
+/*
+ * Create an empty filesystem: superblock, checkpoint region A and a
+ * root directory holding only "." and "..".
+ */
+static void format_image(void)
+{
+    int fd = open(image, O_CREAT | O_RDWR | O_TRUNC, 0666);
+    if (fd < 0 || ftruncate(fd, (off_t)BLOCK_SIZE * TOTAL_BLOCKS) != 0)
+        die(image);
+    close(fd);
+    if (disk_open(image) != 0) die("disk_open");
+
+    uint8_t buf[BLOCK_SIZE];
+
+    struct lfs_superblock *sb = (struct lfs_superblock *)buf;
+    memset(buf, 0, sizeof(buf));
+    sb->magic           = LFS_MAGIC;
+    sb->block_size      = BLOCK_SIZE;
+    sb->total_blocks    = TOTAL_BLOCKS;
+    sb->inode_map_block = CKPT_BLOCK_A;
+    sb->log_start       = LOG_START_BLOCK;
+    sb->seg_blocks      = seg_blocks;
+    sb->log_tail        = LOG_START_BLOCK;
+    sb->commit_seq      = 1;
+    if (disk_write(0, buf) != 0) die("format");
+
+    struct lfs_inode *root = (struct lfs_inode *)buf;
+    memset(buf, 0, sizeof(buf));
+    root->type      = INODE_TYPE_DIR;
+    root->nlinks    = 2;
+    root->size      = 2 * sizeof(struct lfs_dirent);
+    root->direct[0] = 4;
+    if (disk_write(3, buf) != 0) die("format");
+
+    struct lfs_dirent *de = (struct lfs_dirent *)buf;
+    memset(buf, 0, sizeof(buf));
+    strcpy(de[0].name, ".");
+    strcpy(de[1].name, "..");
+    if (disk_write(4, buf) != 0) die("format");
+
+    struct lfs_checkpoint *ck = (struct lfs_checkpoint *)buf;
+    memset(buf, 0, sizeof(buf));
+    ck->ck_magic     = LFS_CKPT_MAGIC;
+    ck->ck_seq       = 1;
+    ck->log_tail     = LOG_START_BLOCK;
+    ck->inode_map[0] = 3;
+    ck->ck_csum      = crc32c(0, ck, sizeof(*ck));
+    if (disk_write(CKPT_BLOCK_A, buf) != 0) die("format");
+
+    disk_close();
+}
+
+/* The mount sequence of lfs_init, minus FUSE */
+static int mount_image(void)
+{
+    memset(&st, 0, sizeof(st));
+    st.compress  = LFS_CODEC_NONE;
+    st.sync_mode = LFS_SYNC_DEFAULT;
+
+    uint8_t buf[BLOCK_SIZE];
+    if (disk_open(image) != 0 || disk_read(0, buf) != 0) return -1;
+    memcpy(&st.sb, buf, sizeof(st.sb));
+    if (log_geometry(&st) != 0) return -1;
+    if (log_load_checkpoint(&st) != 0) return -1;
+    if (log_recover(&st) != 0) return -1;
+    return snapshot_load(&st);
+}
+
+static void fresh_image(void)
+{
+    format_image();
+    if (mount_image() != 0) die("mount");
+}
+
+static void unmount_image(void)
+{
+    dedup_free(&st);
+    disk_close();
+}
+
+/* A file inode with 'nblocks' data blocks appended for it */
+static void make_file(uint32_t ino, uint32_t nblocks, uint8_t *data)
+{
+    struct lfs_inode in;
+    memset(&in, 0, sizeof(in));
+    in.inode_no = ino;
+    in.type     = INODE_TYPE_FILE;
+    in.nlinks   = 1;
+    for (uint32_t j = 0; j < nblocks && j < MAX_DIRECT_PTRS; j++) {
+        memset(data, (int)(ino + j), BLOCK_SIZE);
+        int b = log_append_ex(&st, data, ino, j, LFS_BLK_DATA);
+        if (b < 0) die("log_append_ex");
+        in.direct[j] = (uint32_t)b;
+        in.size += BLOCK_SIZE;
+    }
+    if (inode_write(&st, &in) != 0) die("inode_write");
+}
+
+/* ------------------------------------------------------------------ */
+/*  JSON output                                                         */
+/* ------------------------------------------------------------------ */
+
+/* Start a result object; finish it with end_result() */
+static void begin_result(const char *name)
+{
+    fprintf(out, "%s\n    {\"name\": \"%s\"", first_result ? "" : ",", name);
+    first_result = 0;
+}
+
+static void field(const char *key, double v)
+{
+    fprintf(out, ", \"%s\": %.10g", key, v);
+}
+
+static void end_result(void)
+{
+    fprintf(out, "}");
+}
+
+/* ------------------------------------------------------------------ */
+/*  Benchmarks                                                          */
+/* ------------------------------------------------------------------ */
+
+static void bench_append(const char *name, int data_csum)
+{
+    uint8_t *data = disk_alloc(BLOCK_SIZE);
+    if (!data) die("disk_alloc");
+
+    double secs = 0;
+    uint64_t blocks = 0;
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+        fresh_image();
+        st.data_csum = data_csum;
+        double t0 = now();
+        for (uint32_t i = 0; i < BENCH_FILL; i++) {
+            memset(data, (int)i, BLOCK_SIZE);
+            if (log_append_ex(&st, data, 1, i, LFS_BLK_DATA) < 0)
+                die("log_append_ex");
+        }
+        secs   += now() - t0;
+        blocks += BENCH_FILL;
+        unmount_image();
+    }
+    free(data);
+
+    begin_result(name);
+    field("blocks", (double)blocks);
+    field("seconds", secs);
+    field("blocks_per_s", (double)blocks / secs);
+    field("mb_per_s", (double)blocks * BLOCK_SIZE / secs / 1e6);
+    end_result();
+}
+
+static void bench_checkpoint(void)
+{
+    double lat[BENCH_CKPTS];
+
+    fresh_image();
+    for (int i = 0; i < BENCH_CKPTS; i++) {
+        double t0 = now();
+        if (log_checkpoint(&st) != 0) die("log_checkpoint");
+        lat[i] = (now() - t0) * 1e6;
+    }
+    unmount_image();
+
+    double sum = 0;
+    for (int i = 0; i < BENCH_CKPTS; i++) sum += lat[i];
+    qsort(lat, BENCH_CKPTS, sizeof(double), cmp_double);
+
+    begin_result("log_checkpoint");
+    field("ops", BENCH_CKPTS);
+    field("sync_mode", LFS_SYNC_DEFAULT);
+    field("mean_us", sum / BENCH_CKPTS);
+    field("p50_us", pct(lat, BENCH_CKPTS, 50));
+    field("p99_us", pct(lat, BENCH_CKPTS, 99));
+    end_result();
+}
+
+static void bench_inode(void)
+{
+    struct lfs_inode in;
+    memset(&in, 0, sizeof(in));
+    in.type   = INODE_TYPE_FILE;
+    in.nlinks = 1;
+
+    fresh_image();
+    uint32_t nwrite = BENCH_FILL;
+    double t0 = now();
+    for (uint32_t i = 0; i < nwrite; i++) {
+        in.inode_no = 1 + i % BENCH_INODES;
+        in.size     = i;
+        if (inode_write(&st, &in) != 0) die("inode_write");
+    }
+    double wsecs = now() - t0;
+
+    uint32_t nread = 50000;
+    t0 = now();
+    for (uint32_t i = 0; i < nread; i++) {
+        uint32_t ino = 1 + (i * 37) % BENCH_INODES;
+        if (inode_read(&st, ino, &in) != 0) die("inode_read");
+    }
+    double rsecs = now() - t0;
+    unmount_image();
+
+    begin_result("inode_write");
+    field("ops", nwrite);
+    field("seconds", wsecs);
+    field("ops_per_s", nwrite / wsecs);
+    end_result();
+
+    begin_result("inode_read");
+    field("ops", nread);
+    field("seconds", rsecs);
+    field("ops_per_s", nread / rsecs);
+    end_result();
+}
+
+/*
+ * Fill the log with BENCH_INODES files, delete all but 'live' of them
+ * (spread evenly over the log) and time one collection.
+ */
+static void bench_gc(double live)
+{
+    uint8_t *data = disk_alloc(BLOCK_SIZE);
+    if (!data) die("disk_alloc");
+
+    fresh_image();
+    uint32_t per_file = (BENCH_FILL / BENCH_INODES) - 1;
+    for (uint32_t i = 1; i <= BENCH_INODES; i++)
+        make_file(i, per_file, data);
+    free(data);
+
+    uint32_t kept = 0;
+    for (uint32_t i = 1; i <= BENCH_INODES; i++) {
+        if ((uint32_t)(i * live) != (uint32_t)((i - 1) * live)) kept++;
+        else st.inode_map[i] = 0;
+    }
+    if (log_checkpoint(&st) != 0) die("log_checkpoint");
+
+    uint32_t tail0 = st.log_tail;
+    double t0 = now();
+    if (gc_collect(&st) != 0) die("gc_collect");
+    double secs = now() - t0;
+    uint32_t tail1 = st.log_tail;
+    unmount_image();
+
+    char name[32];
+    snprintf(name, sizeof(name), "gc_collect_live_%02d", (int)(live * 100));
+    begin_result(name);
+    field("live_ratio", live);
+    field("live_files", kept);
+    field("log_blocks", tail0 - LOG_START_BLOCK);
+    field("reclaimed_blocks", tail0 - tail1);
+    field("ms", secs * 1e3);
+    end_result();
+}
+
+/* Mount a cleanly unmounted image holding files and every snapshot */
+static void bench_mount(void)
+{
+    uint8_t *data = disk_alloc(BLOCK_SIZE);
+    if (!data) die("disk_alloc");
+
+    fresh_image();
+    for (uint32_t ino = 1; ino <= BENCH_INODES; ino++)
+        make_file(ino, 2, data);
+    for (int s = 0; s < LFS_MAX_SNAPSHOTS; s++) {
+        char name[16];
+        snprintf(name, sizeof(name), "snap%d", s);
+        if (snapshot_create(&st, name) < 0) die("snapshot_create");
+    }
+    if (log_checkpoint(&st) != 0 || disk_sync(1) != 0) die("log_checkpoint");
+    unmount_image();
+    free(data);
+
+    double lat[BENCH_MOUNTS], sum = 0;
+    for (int i = 0; i < BENCH_MOUNTS; i++) {
+        double t0 = now();
+        if (mount_image() != 0) die("mount");
+        lat[i] = (now() - t0) * 1e6;
+        sum += lat[i];
+        unmount_image();
+    }
+    qsort(lat, BENCH_MOUNTS, sizeof(double), cmp_double);
+
+    begin_result("mount");
+    field("mounts", BENCH_MOUNTS);
+    field("snapshots", LFS_MAX_SNAPSHOTS);
+    field("mean_us", sum / BENCH_MOUNTS);
+    field("p50_us", pct(lat, BENCH_MOUNTS, 50));
+    field("p99_us", pct(lat, BENCH_MOUNTS, 99));
+    end_result();
+}
+
+/*
+ * Append 'len' inode blocks after the last checkpoint, drop the state
+ * as a crash would, and time the mount that rolls them forward.
+ */
+static void bench_recover(uint32_t len)
+{
+    struct lfs_inode in;
+    memset(&in, 0, sizeof(in));
+    in.type   = INODE_TYPE_FILE;
+    in.nlinks = 1;
+
+    fresh_image();
+    if (log_checkpoint(&st) != 0) die("log_checkpoint");
+    for (uint32_t i = 0; i < len; i++) {
+        in.inode_no = 1 + i % BENCH_INODES;
+        in.size     = i;
+        if (inode_write(&st, &in) != 0) die("inode_write");
+    }
+    if (disk_sync(1) != 0) die("disk_sync");
+    uint32_t map[INODE_MAP_SIZE], tail = st.log_tail;
+    memcpy(map, st.inode_map, sizeof(map));
+    unmount_image();
+
+    double t0 = now();
+    if (mount_image() != 0) die("mount");
+    double secs = now() - t0;
+
+    /* Everything past segment 0 (which has no summary) is replayed */
+    if (tail > st.seg_blocks && st.log_tail != tail)
+        die("log_recover (log tail)");
+    for (uint32_t i = 0; i < INODE_MAP_SIZE; i++)
+        if (map[i] >= st.seg_blocks && st.inode_map[i] != map[i])
+            die("log_recover (inode map)");
+    unmount_image();
+
+    char name[32];
+    snprintf(name, sizeof(name), "log_recover_%u", len);
+    begin_result(name);
+    field("log_blocks", len);
+    field("ms", secs * 1e3);
+    end_result();
+}
+
+static void bench_crc(const char *name, uint32_t (*fn)(uint32_t,
+                                                        const void *,
+                                                        size_t))
+{
+    static uint8_t buf[BLOCK_SIZE];
+    for (size_t i = 0; i < sizeof(buf); i++) buf[i] = (uint8_t)(i * 7);
+
+    volatile uint32_t crc = 0;        /* keeps the loop from folding */
+    double t0 = now();
+    for (uint32_t done = 0; done < BENCH_CRC_BYTES; done += BLOCK_SIZE)
+        crc = fn(crc, buf, BLOCK_SIZE);
+    double secs = now() - t0;
+
+    begin_result(name);
+    field("bytes", BENCH_CRC_BYTES);
+    field("gb_per_s", BENCH_CRC_BYTES / secs / 1e9);
+    field("ns_per_block", secs * 1e9 / (BENCH_CRC_BYTES / BLOCK_SIZE));
+    end_result();
+}
+
+/* ------------------------------------------------------------------ */
+
+int main(int argc, char *argv[])
+{
+    const char *out_path = NULL;
+    int verbose = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-i") == 0 && i + 1 < argc) image = argv[++i];
+        else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) out_path = argv[++i];
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+            seg_blocks = (uint32_t)strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "-v") == 0) verbose = 1;
+        else {
+            fprintf(stderr, "usage: %s [-i IMAGE] [-o FILE] "
+                            "[-s SEGMENT_BLOCKS] [-v]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (seg_blocks < LFS_SEG_MIN_BLOCKS || (seg_blocks & (seg_blocks - 1)) ||
+        seg_blocks > TOTAL_BLOCKS / 2) {
+        fprintf(stderr, "lfs_bench: -s must be a power of two from %d "
+                        "to %d\n", LFS_SEG_MIN_BLOCKS, TOTAL_BLOCKS / 2);
+        return 2;
+    }
+
+    /* Keep JSON on the real stdout; the layers' printf chatter goes away */
+    out = out_path ? fopen(out_path, "w") : fdopen(dup(STDOUT_FILENO), "w");
+    if (!out) die("output");
+    if (!verbose && !freopen("/dev/null", "w", stdout)) die("freopen");
+
+    fprintf(out, "{\n  \"image\": \"%s\",\n  \"block_size\": %d,\n"
+                 "  \"total_blocks\": %d,\n  \"seg_blocks\": %u,\n"
+                 "  \"crc32c_hw\": %d,\n  \"results\": [",
+            image, BLOCK_SIZE, TOTAL_BLOCKS, seg_blocks,
+            crc32c_hw_available());
+
+    bench_append("log_append", 0);
+    bench_append("log_append_data_csum", 1);
+    bench_checkpoint();
+    bench_inode();
+    bench_gc(0.10);
+    bench_gc(0.25);
+    bench_gc(0.50);
+    bench_gc(0.75);
+    bench_gc(0.90);
+    bench_mount();
+    bench_recover(0);
+    bench_recover(64);
+    bench_recover(256);
+    bench_recover(768);
+    bench_crc("crc32c", crc32c);
+    bench_crc("crc32c_sw", crc32c_sw);
+
+    fprintf(out, "\n  ]\n}\n");
+    fclose(out);
+    unlink(image);
+    return 0;
+}
@@ -0,0 +1,266 @@
+/*
+ * cache.c — Physical block cache
+ *
+ * A fixed pool of block buffers (LFS_CACHE_BLOCKS unless the mount
+ * options say otherwise), hashed by block
+ * number and evicted with the CLOCK algorithm.  disk_read() fills it,
+ * disk_write() keeps cached copies current, and the readahead worker
+ * (readahead.c) prefetches into it.
+ *
+ * A read that misses goes to disk without holding the lock, so a
+ * write could land in between and the block read would be stale.
+ * Every write bumps a generation counter; a block read is only
+ * inserted if the generation has not moved since the read started.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "lfs.h"
+
+#define NO_SLOT      (-1)
+
+struct cache_slot {
+    uint32_t block;
+    int32_t  next;             /* hash chain                         */
+    uint8_t  valid;
+    uint8_t  ref;              /* CLOCK reference bit                */
+    uint8_t  prefetched;       /* inserted by readahead, not yet hit */
+    uint8_t  verified;         /* contents passed their data checksum */
+};
+
+static pthread_mutex_t   cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint8_t          *cache_data;
+static struct cache_slot *slots;
+static int32_t           *head;         /* 2 chains per slot         */
+static uint32_t          nslots, nhash;
+static uint32_t          hand;
+static uint64_t          gen;
+
+/* Prefetched blocks found by this thread's reads (see readahead) */
+static __thread uint64_t ra_hits;
+
+static struct cache_stats stats;
+
+static uint32_t hash(uint32_t block)
+{
+    return (block * 2654435761u) % nhash;
+}
+
+/* Caller holds cache_lock */
+static int32_t find(uint32_t block)
+{
+    for (int32_t i = head[hash(block)]; i != NO_SLOT; i = slots[i].next)
+        if (slots[i].block == block) return i;
+    return NO_SLOT;
+}
+
+/* Caller holds cache_lock */
+static void unlink_slot(int32_t s)
+{
+    int32_t *pp = &head[hash(slots[s].block)];
+    while (*pp != NO_SLOT && *pp != s) pp = &slots[*pp].next;
+    if (*pp == s) *pp = slots[s].next;
+    slots[s].valid = 0;
+}
+
+/* Caller holds cache_lock: pick a victim with the CLOCK hand */
+static int32_t evict(void)
+{
+    for (;;) {
+        int32_t s = (int32_t)(hand++ % nslots);
+        if (!slots[s].valid) return s;
+        if (slots[s].ref) { slots[s].ref = 0; continue; }
+        unlink_slot(s);
+        stats.evictions++;
+        return s;
+    }
+}
+
+/* Set up a cache of 'nblocks' blocks (0 = no cache).  0 or -1. */
+int cache_init(uint32_t nblocks)
+{
+    if (nblocks == 0) return 0;
+
+    pthread_mutex_lock(&cache_lock);
+    if (!cache_data || nslots != nblocks) {
+        free(cache_data);
+        free(slots);
+        free(head);
+        cache_data = disk_alloc((size_t)nblocks * BLOCK_SIZE);
+        slots      = calloc(nblocks, sizeof(*slots));
+        head       = malloc((size_t)nblocks * 2 * sizeof(*head));
+        if (!cache_data || !slots || !head) {
+            free(cache_data); free(slots); free(head);
+            cache_data = NULL; slots = NULL; head = NULL;
+            pthread_mutex_unlock(&cache_lock);
+            return -1;
+        }
+        nslots = nblocks;
+        nhash  = nblocks * 2;
+    }
+    memset(slots, 0, (size_t)nslots * sizeof(*slots));
+    for (uint32_t i = 0; i < nhash; i++) head[i] = NO_SLOT;
+    hand = 0;
+    memset(&stats, 0, sizeof(stats));
+    pthread_mutex_unlock(&cache_lock);
+    return 0;
+}
+
+/*
+ * cache_lookup
+ *
+ * Copies a cached block into 'buf'.  Returns 0 on a hit, -1 on a miss.
+ */
+int cache_lookup(uint32_t block, void *buf)
+{
+    if (!cache_data) return -1;
+
+    pthread_mutex_lock(&cache_lock);
+    int32_t s = find(block);
+    if (s == NO_SLOT) {
+        stats.misses++;
+        pthread_mutex_unlock(&cache_lock);
+        return -1;
+    }
+    memcpy(buf, cache_data + (size_t)s * BLOCK_SIZE, BLOCK_SIZE);
+    slots[s].ref = 1;
+    stats.hits++;
+    if (slots[s].prefetched) {
+        slots[s].prefetched = 0;
+        stats.ra_hits++;
+        ra_hits++;
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return 0;
+}
+
+int cache_contains(uint32_t block)
+{
+    if (!cache_data) return 0;
+    pthread_mutex_lock(&cache_lock);
+    int found = find(block) != NO_SLOT;
+    pthread_mutex_unlock(&cache_lock);
+    return found;
+}
+
+/* Generation to pass to cache_insert() for a read about to start */
+uint64_t cache_gen(void)
+{
+    pthread_mutex_lock(&cache_lock);
+    uint64_t g = gen;
+    pthread_mutex_unlock(&cache_lock);
+    return g;
+}
+
+/*
+ * cache_insert
+ *
+ * Adds a block read from disk, unless any write happened since
+ * 'read_gen' (the copy might then be stale).  'prefetched' marks
+ * readahead inserts so their first hit can be credited.
+ */
+void cache_insert(uint32_t block, const void *buf, uint64_t read_gen,
+                  int prefetched)
+{
+    if (!cache_data) return;
+
+    pthread_mutex_lock(&cache_lock);
+    if (gen != read_gen || find(block) != NO_SLOT) {
+        pthread_mutex_unlock(&cache_lock);
+        return;
+    }
+    int32_t s = evict();
+    memcpy(cache_data + (size_t)s * BLOCK_SIZE, buf, BLOCK_SIZE);
+    slots[s].block      = block;
+    slots[s].valid      = 1;
+    slots[s].ref        = 0;
+    slots[s].prefetched = (uint8_t)(prefetched != 0);
+    slots[s].verified   = 0;
+    slots[s].next       = head[hash(block)];
+    head[hash(block)]   = s;
+    if (prefetched) stats.prefetched++;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/* A block was written: keep a cached copy current */
+void cache_update(uint32_t block, const void *buf)
+{
+    if (!cache_data) return;
+
+    pthread_mutex_lock(&cache_lock);
+    gen++;
+    int32_t s = find(block);
+    if (s != NO_SLOT) {
+        memcpy(cache_data + (size_t)s * BLOCK_SIZE, buf, BLOCK_SIZE);
+        slots[s].verified = 0;
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/*
+ * cache_verified / cache_set_verified
+ *
+ * Whether the cached copy of 'block' has passed its data checksum, so
+ * a hit need not compute it again.  Only log_read_data sets the flag,
+ * after checking the copy it just read; any change to the slot clears
+ * it, and readahead inserts start without it.
+ */
+int cache_verified(uint32_t block)
+{
+    if (!cache_data) return 0;
+    pthread_mutex_lock(&cache_lock);
+    int32_t s = find(block);
+    int ok = s != NO_SLOT && slots[s].verified;
+    pthread_mutex_unlock(&cache_lock);
+    return ok;
+}
+
+void cache_set_verified(uint32_t block)
+{
+    if (!cache_data) return;
+    pthread_mutex_lock(&cache_lock);
+    int32_t s = find(block);
+    if (s != NO_SLOT) slots[s].verified = 1;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/* Blocks [block, block + n) were written behind the cache's back */
+void cache_invalidate(uint32_t block, uint32_t n)
+{
+    if (!cache_data) return;
+
+    pthread_mutex_lock(&cache_lock);
+    gen++;
+    for (uint32_t i = 0; i < n; i++) {
+        int32_t s = find(block + i);
+        if (s != NO_SLOT) unlink_slot(s);
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/* Prefetched blocks hit by the calling thread so far */
+uint64_t cache_ra_hits(void)
+{
+    return ra_hits;
+}
+
+void cache_get_stats(struct cache_stats *out)
+{
+    pthread_mutex_lock(&cache_lock);
+    *out = stats;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+void cache_free(void)
+{
+    pthread_mutex_lock(&cache_lock);
+    free(cache_data);
+    free(slots);
+    free(head);
+    cache_data = NULL;
+    slots      = NULL;
+    head       = NULL;
+    nslots     = 0;
+    pthread_mutex_unlock(&cache_lock);
+}
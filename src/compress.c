@@ -0,0 +1,266 @@
+/*
+ * compress.c — Block codecs for transparent compression
+ *
+ *   lfs_compress()        — compress one BLOCK_SIZE block
+ *   lfs_decompress()      — expand a record back to BLOCK_SIZE bytes
+ *   lfs_codec_available() — is this codec built in?
+ *
+ * LFS_CODEC_LZ4 is a self-contained implementation of the LZ4 block
+ * format, so the fast codec needs no external library.  LFS_CODEC_ZSTD
+ * is only available when built with LFS_HAVE_ZSTD (see Makefile).
+ */
+
+#include <string.h>
+#include <stdio.h>
+#include "lfs.h"
+
+#ifdef LFS_HAVE_ZSTD
+#include <zstd.h>
+#define LFS_ZSTD_LEVEL  3
+#endif
+
+/* ------------------------------------------------------------------ */
+/*  LZ4 block format                                                    */
+/* ------------------------------------------------------------------ */
+
+#define LZ4_MINMATCH      4
+#define LZ4_HASH_LOG      12
+#define LZ4_LASTLITERALS  5     /* last 5 bytes are always literals  */
+#define LZ4_MFLIMIT       12    /* no match may start after this     */
+#define LZ4_MAX_OFFSET    65535
+
+static uint32_t lz4_read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t lz4_hash(uint32_t v)
+{
+    return (v * 2654435761u) >> (32 - LZ4_HASH_LOG);
+}
+
+/* Append the 255-run extension of a length field */
+static uint8_t *lz4_put_len(uint8_t *op, const uint8_t *oend, size_t len)
+{
+    while (len >= 255) {
+        if (op >= oend) return NULL;
+        *op++ = 255;
+        len -= 255;
+    }
+    if (op >= oend) return NULL;
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+/*
+ * Emit one sequence: 'nlit' literals followed by a match of 'mlen'
+ * bytes at distance 'off'.  mlen == 0 emits the final literal run.
+ */
+static uint8_t *lz4_emit(uint8_t *op, const uint8_t *oend,
+                         const uint8_t *lit, size_t nlit,
+                         size_t off, size_t mlen)
+{
+    if (op >= oend) return NULL;
+    uint8_t *token = op++;
+    *token = (uint8_t)((nlit >= 15 ? 15 : nlit) << 4);
+    if (nlit >= 15 && !(op = lz4_put_len(op, oend, nlit - 15)))
+        return NULL;
+
+    if ((size_t)(oend - op) < nlit) return NULL;
+    memcpy(op, lit, nlit);
+    op += nlit;
+
+    if (mlen == 0) return op;
+
+    if (oend - op < 2) return NULL;
+    *op++ = (uint8_t)(off & 0xff);
+    *op++ = (uint8_t)(off >> 8);
+
+    mlen -= LZ4_MINMATCH;
+    *token |= (uint8_t)(mlen >= 15 ? 15 : mlen);
+    if (mlen >= 15 && !(op = lz4_put_len(op, oend, mlen - 15)))
+        return NULL;
+    return op;
+}
+
+static int lz4_compress(const uint8_t *src, size_t n,
+                        uint8_t *dst, size_t cap)
+{
+    uint32_t table[1 << LZ4_HASH_LOG];   /* position + 1, 0 = empty */
+    memset(table, 0, sizeof(table));
+
+    const uint8_t *ip     = src;
+    const uint8_t *anchor = src;
+    const uint8_t *iend   = src + n;
+    uint8_t       *op     = dst;
+    const uint8_t *oend   = dst + cap;
+
+    if (n > LZ4_MFLIMIT) {
+        const uint8_t *mflimit    = iend - LZ4_MFLIMIT;
+        const uint8_t *matchlimit = iend - LZ4_LASTLITERALS;
+
+        while (ip < mflimit) {
+            uint32_t h   = lz4_hash(lz4_read32(ip));
+            uint32_t ref = table[h];
+            table[h] = (uint32_t)(ip - src) + 1;
+
+            const uint8_t *match = src + ref - 1;
+            if (ref == 0 || ip - match > LZ4_MAX_OFFSET ||
+                lz4_read32(match) != lz4_read32(ip)) {
+                ip++;
+                continue;
+            }
+
+            /* Extend backwards over pending literals, then forwards */
+            while (ip > anchor && match > src && ip[-1] == match[-1]) {
+                ip--;
+                match--;
+            }
+            const uint8_t *end = ip + LZ4_MINMATCH;
+            const uint8_t *m   = match + LZ4_MINMATCH;
+            while (end < matchlimit && *end == *m) {
+                end++;
+                m++;
+            }
+
+            op = lz4_emit(op, oend, anchor, (size_t)(ip - anchor),
+                          (size_t)(ip - match), (size_t)(end - ip));
+            if (!op) return 0;
+            ip = anchor = end;
+        }
+    }
+
+    op = lz4_emit(op, oend, anchor, (size_t)(iend - anchor), 0, 0);
+    if (!op) return 0;
+    return (int)(op - dst);
+}
+
+static int lz4_decompress(const uint8_t *src, size_t n,
+                          uint8_t *dst, size_t cap)
+{
+    const uint8_t *ip   = src;
+    const uint8_t *iend = src + n;
+    uint8_t       *op   = dst;
+    uint8_t       *oend = dst + cap;
+
+    while (ip < iend) {
+        unsigned token = *ip++;
+
+        size_t nlit = token >> 4;
+        if (nlit == 15) {
+            unsigned b;
+            do {
+                if (ip >= iend) return -1;
+                b = *ip++;
+                nlit += b;
+            } while (b == 255);
+        }
+        if ((size_t)(iend - ip) < nlit || (size_t)(oend - op) < nlit)
+            return -1;
+        memcpy(op, ip, nlit);
+        op += nlit;
+        ip += nlit;
+
+        if (ip >= iend) break;            /* final literal run      */
+
+        if (iend - ip < 2) return -1;
+        size_t off = (size_t)ip[0] | ((size_t)ip[1] << 8);
+        ip += 2;
+        if (off == 0 || off > (size_t)(op - dst)) return -1;
+
+        size_t mlen = token & 15;
+        if (mlen == 15) {
+            unsigned b;
+            do {
+                if (ip >= iend) return -1;
+                b = *ip++;
+                mlen += b;
+            } while (b == 255);
+        }
+        mlen += LZ4_MINMATCH;
+        if ((size_t)(oend - op) < mlen) return -1;
+
+        /* Byte copy: source and destination may overlap */
+        const uint8_t *m = op - off;
+        while (mlen--) *op++ = *m++;
+    }
+    return (int)(op - dst);
+}
+
+/* ------------------------------------------------------------------ */
+/*  Public API                                                          */
+/* ------------------------------------------------------------------ */
+
+int lfs_codec_available(int codec)
+{
+    switch (codec) {
+    case LFS_CODEC_NONE:
+    case LFS_CODEC_LZ4:
+        return 1;
+#ifdef LFS_HAVE_ZSTD
+    case LFS_CODEC_ZSTD:
+        return 1;
+#endif
+    default:
+        return 0;
+    }
+}
+
+/*
+ * lfs_compress
+ *
+ * Compresses one BLOCK_SIZE block from 'src' into 'dst' (at most
+ * 'cap' bytes).  Returns the compressed length, or 0 if the block
+ * does not fit in 'cap' — the caller then stores it raw.
+ */
+int lfs_compress(int codec, const void *src, void *dst, size_t cap)
+{
+    switch (codec) {
+    case LFS_CODEC_LZ4:
+        return lz4_compress(src, BLOCK_SIZE, dst, cap);
+#ifdef LFS_HAVE_ZSTD
+    case LFS_CODEC_ZSTD: {
+        size_t n = ZSTD_compress(dst, cap, src, BLOCK_SIZE,
+                                 LFS_ZSTD_LEVEL);
+        return ZSTD_isError(n) ? 0 : (int)n;
+    }
+#endif
+    default:
+        return 0;
+    }
+}
+
+/*
+ * lfs_decompress
+ *
+ * Expands a 'len'-byte record into exactly BLOCK_SIZE bytes at 'dst'.
+ * Returns 0 on success, -1 on a corrupt record or unknown codec.
+ */
+int lfs_decompress(int codec, const void *src, size_t len, void *dst)
+{
+    int n = -1;
+
+    switch (codec) {
+    case LFS_CODEC_LZ4:
+        n = lz4_decompress(src, len, dst, BLOCK_SIZE);
+        break;
+#ifdef LFS_HAVE_ZSTD
+    case LFS_CODEC_ZSTD: {
+        size_t r = ZSTD_decompress(dst, BLOCK_SIZE, src, len);
+        n = ZSTD_isError(r) ? -1 : (int)r;
+        break;
+    }
+#endif
+    default:
+        break;
+    }
+
+    if (n != BLOCK_SIZE) {
+        fprintf(stderr, "lfs_decompress: bad record (codec=%d, len=%zu)\n",
+                codec, len);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,186 @@
+/*
+ * crc32c.c — CRC32C (Castagnoli) checksums
+ *
+ * Seals checkpoint regions and segment summaries, and optionally every
+ * data block (see LFS_DATA_CSUM_DEFAULT).  Uses the SSE4.2 crc32
+ * instruction when the CPU has it and a table-driven fallback
+ * otherwise; both give the standard CRC32C, e.g.
+ * crc32c(0, "123456789", 9) == 0xE3069283.
+ */
+
+#include <string.h>
+#include "lfs.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define LFS_CRC32C_X86 1
+#endif
+
+#define CRC32C_POLY  0x82F63B78u       /* reflected Castagnoli poly  */
+
+static uint32_t crc_table[256];
+static uint32_t (*crc_impl)(uint32_t, const uint8_t *, size_t);
+
+/* One byte per step through a 256-entry table */
+static uint32_t crc32c_table(uint32_t crc, const uint8_t *p, size_t len)
+{
+    while (len--)
+        crc = crc_table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(LFS_CRC32C_X86) && defined(__x86_64__)
+/*
+ * One crc32 instruction has a latency of three cycles but a throughput
+ * of one per cycle, so a single stream leaves two thirds of the unit
+ * idle.  Long inputs are split into three streams of CRC32C_LONG (or
+ * CRC32C_SHORT) bytes, computed together and then joined: the CRC of
+ * A followed by B is the CRC of A shifted over len(B) zero bytes,
+ * xored with the CRC of B.  The shift is a linear map, applied with
+ * four byte-indexed tables per stream length.
+ */
+#define CRC32C_LONG   8192
+#define CRC32C_SHORT  256
+
+static uint32_t crc_long[4][256], crc_short[4][256];
+
+/* Multiply the GF(2) matrix 'mat' (32 columns) by 'vec' */
+static uint32_t gf2_times(const uint32_t *mat, uint32_t vec)
+{
+    uint32_t sum = 0;
+    for (; vec; vec >>= 1, mat++)
+        if (vec & 1) sum ^= *mat;
+    return sum;
+}
+
+static void gf2_square(uint32_t *square, const uint32_t *mat)
+{
+    for (int n = 0; n < 32; n++)
+        square[n] = gf2_times(mat, mat[n]);
+}
+
+/* Tables applying 'len' zero bytes (a power of two) to a CRC */
+static void crc_zeros(uint32_t zeros[4][256], size_t len)
+{
+    uint32_t op[32], sq[32];
+
+    /* One zero bit, then squared up to one zero byte */
+    op[0] = CRC32C_POLY;
+    for (int n = 1; n < 32; n++) op[n] = 1u << (n - 1);
+    for (int k = 0; k < 3; k++) {
+        gf2_square(sq, op);
+        memcpy(op, sq, sizeof(op));
+    }
+    for (; len > 1; len >>= 1) {
+        gf2_square(sq, op);
+        memcpy(op, sq, sizeof(op));
+    }
+
+    for (uint32_t n = 0; n < 256; n++)
+        for (int b = 0; b < 4; b++)
+            zeros[b][n] = gf2_times(op, n << (8 * b));
+}
+
+static uint32_t crc_shift(const uint32_t zeros[4][256], uint32_t crc)
+{
+    return zeros[0][crc & 0xFF] ^ zeros[1][(crc >> 8) & 0xFF] ^
+           zeros[2][(crc >> 16) & 0xFF] ^ zeros[3][crc >> 24];
+}
+
+/* Three interleaved streams of 'n' bytes each, joined into 'c' */
+__attribute__((target("sse4.2")))
+static uint64_t crc_3way(uint64_t c, const uint8_t *p, size_t n,
+                         const uint32_t zeros[4][256])
+{
+    uint64_t c1 = 0, c2 = 0;
+    for (const uint8_t *end = p + n; p < end; p += 8) {
+        uint64_t v0, v1, v2;
+        memcpy(&v0, p, 8);
+        memcpy(&v1, p + n, 8);
+        memcpy(&v2, p + 2 * n, 8);
+        c  = _mm_crc32_u64(c, v0);
+        c1 = _mm_crc32_u64(c1, v1);
+        c2 = _mm_crc32_u64(c2, v2);
+    }
+    c = crc_shift(zeros, (uint32_t)c) ^ c1;
+    return crc_shift(zeros, (uint32_t)c) ^ c2;
+}
+#endif
+
+#ifdef LFS_CRC32C_X86
+/* Three streams while the input is long enough, then eight bytes per
+ * instruction, then the tail byte by byte */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *p, size_t len)
+{
+#ifdef __x86_64__
+    uint64_t c = crc;
+    while (len >= 3 * CRC32C_LONG) {
+        c = crc_3way(c, p, CRC32C_LONG, crc_long);
+        p   += 3 * CRC32C_LONG;
+        len -= 3 * CRC32C_LONG;
+    }
+    while (len >= 3 * CRC32C_SHORT) {
+        c = crc_3way(c, p, CRC32C_SHORT, crc_short);
+        p   += 3 * CRC32C_SHORT;
+        len -= 3 * CRC32C_SHORT;
+    }
+    while (len >= 8) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        c = _mm_crc32_u64(c, v);
+        p += 8;
+        len -= 8;
+    }
+    crc = (uint32_t)c;
+#endif
+    while (len--)
+        crc = _mm_crc32_u8(crc, *p++);
+    return crc;
+}
+#endif
+
+/* Build the table and pick an implementation before main() runs */
+__attribute__((constructor))
+static void crc32c_init(void)
+{
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++)
+            c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+        crc_table[i] = c;
+    }
+
+    crc_impl = crc32c_table;
+#ifdef LFS_CRC32C_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) {
+#ifdef __x86_64__
+        crc_zeros(crc_long, CRC32C_LONG);
+        crc_zeros(crc_short, CRC32C_SHORT);
+#endif
+        crc_impl = crc32c_sse42;
+    }
+#endif
+}
+
+/*
+ * crc32c
+ *
+ * Extends 'crc' (0 to start) over 'len' bytes of 'buf'.
+ */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+    return ~crc_impl(~crc, buf, len);
+}
+
+/* Same result through the table only — for benchmarks and tests */
+uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len)
+{
+    return ~crc32c_table(~crc, buf, len);
+}
+
+int crc32c_hw_available(void)
+{
+    return crc_impl != crc32c_table;
+}
@@ -0,0 +1,216 @@
+/*
+ * dedup.c — Content-based deduplication of data blocks
+ *
+ *   dedup_hash()     — 64-bit fingerprint of one block
+ *   dedup_lookup()   — find an existing block with identical contents
+ *   dedup_insert()   — remember where a block was written
+ *   dedup_prune()    — drop entries for blocks GC found dead
+ *   dedup_relocate() — follow blocks moved by GC
+ *   dedup_free()     — release the index
+ *
+ * The fingerprint index lives only in memory and starts empty at
+ * mount; it fills as blocks are written.  A fingerprint match is
+ * always verified with a full compare before a block is shared, so a
+ * hash collision costs one extra read but never corrupts data.
+ *
+ * Entries may point at blocks that are dead but not yet reclaimed —
+ * sharing such a block simply makes it live again.  GC must call
+ * dedup_prune() / dedup_relocate() so no entry ever points into
+ * reclaimed space.
+ */
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "lfs.h"
+
+#define DEDUP_INITIAL_CAP  4096     /* slots, power of two           */
+
+struct dedup_entry {
+    uint64_t hash;
+    uint32_t ptr;                   /* data pointer, 0 = empty slot  */
+};
+
+struct dedup_index {
+    uint32_t cap;
+    uint32_t count;
+    struct dedup_entry *slot;
+};
+
+/*
+ * dedup_hash
+ *
+ * Word-at-a-time multiply/rotate hash (xxHash64-style rounds).  Fast
+ * enough to run on every written block; strength only matters for
+ * how often the verifying compare fails.
+ */
+uint64_t dedup_hash(const void *block)
+{
+    const uint64_t P1 = 0x9E3779B185EBCA87ULL;
+    const uint64_t P2 = 0xC2B2AE3D27D4EB4FULL;
+    const uint8_t *p  = block;
+    uint64_t h = P1 ^ BLOCK_SIZE;
+
+    for (size_t i = 0; i < BLOCK_SIZE; i += sizeof(uint64_t)) {
+        uint64_t w;
+        memcpy(&w, p + i, sizeof(w));
+        h ^= w * P2;
+        h  = ((h << 31) | (h >> 33)) * P1;
+    }
+
+    h ^= h >> 33;
+    h *= P2;
+    h ^= h >> 29;
+    return h;
+}
+
+static struct dedup_index *index_new(uint32_t cap)
+{
+    struct dedup_index *idx = calloc(1, sizeof(*idx));
+    if (!idx) return NULL;
+    idx->slot = calloc(cap, sizeof(struct dedup_entry));
+    if (!idx->slot) {
+        free(idx);
+        return NULL;
+    }
+    idx->cap = cap;
+    return idx;
+}
+
+static void index_put(struct dedup_index *idx, uint64_t hash, uint32_t ptr)
+{
+    uint32_t i = (uint32_t)hash & (idx->cap - 1);
+    while (idx->slot[i].ptr != 0) {
+        if (idx->slot[i].ptr == ptr) return;       /* already known */
+        i = (i + 1) & (idx->cap - 1);
+    }
+    idx->slot[i].hash = hash;
+    idx->slot[i].ptr  = ptr;
+    idx->count++;
+}
+
+/* Rehash every entry into a table of 'cap' slots */
+static int index_resize(struct lfs_state *state, uint32_t cap)
+{
+    struct dedup_index *old = state->dedup_idx;
+    struct dedup_index *idx = index_new(cap);
+    if (!idx) return -1;
+
+    for (uint32_t i = 0; old && i < old->cap; i++)
+        if (old->slot[i].ptr != 0)
+            index_put(idx, old->slot[i].hash, old->slot[i].ptr);
+
+    dedup_free(state);
+    state->dedup_idx = idx;
+    return 0;
+}
+
+/*
+ * dedup_lookup
+ *
+ * Looks for a block whose contents equal 'block' (fingerprint 'hash').
+ * Returns 1 and stores its data pointer in *ptr_out on a verified
+ * match, 0 otherwise.
+ */
+int dedup_lookup(struct lfs_state *state, uint64_t hash,
+                 const void *block, uint32_t *ptr_out)
+{
+    struct dedup_index *idx = state->dedup_idx;
+    if (!idx) return 0;
+
+    uint8_t cand[BLOCK_SIZE];
+    uint32_t i = (uint32_t)hash & (idx->cap - 1);
+
+    for (; idx->slot[i].ptr != 0; i = (i + 1) & (idx->cap - 1)) {
+        if (idx->slot[i].hash != hash) continue;
+        if (log_read_data(state, idx->slot[i].ptr, cand) != 0) continue;
+        if (memcmp(cand, block, BLOCK_SIZE) != 0) continue;
+        *ptr_out = idx->slot[i].ptr;
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * dedup_insert
+ *
+ * Records that a block with fingerprint 'hash' now lives at 'ptr'.
+ * The table grows to keep its load factor under 3/4; if that fails
+ * the entry is simply not recorded.
+ */
+void dedup_insert(struct lfs_state *state, uint64_t hash, uint32_t ptr)
+{
+    struct dedup_index *idx = state->dedup_idx;
+
+    if (!idx || (idx->count + 1) * 4 > idx->cap * 3) {
+        uint32_t cap = idx ? idx->cap * 2 : DEDUP_INITIAL_CAP;
+        if (index_resize(state, cap) != 0) return;
+        idx = state->dedup_idx;
+    }
+    index_put(idx, hash, ptr);
+}
+
+/*
+ * Rebuild the index keeping only entries for blocks in GC's table 't',
+ * re-pointed at their new location if 'follow' is set.
+ */
+static void index_filter(struct lfs_state *state, const struct gc_table *t,
+                         int follow)
+{
+    struct dedup_index *old = state->dedup_idx;
+    if (!old) return;
+
+    struct dedup_index *idx = index_new(old->cap);
+    if (!idx) {
+        dedup_free(state);          /* dropping the cache is always safe */
+        return;
+    }
+
+    for (uint32_t i = 0; i < old->cap; i++) {
+        uint32_t ptr = old->slot[i].ptr;
+        uint32_t blk = LFS_PTR_BLOCK(ptr);
+        if (ptr == 0 || blk >= state->sb.total_blocks) continue;
+        const struct gc_block *e = gc_find(t, blk);
+        if (!e) continue;
+        if (follow && e->to != 0)
+            ptr = (ptr & ~LFS_PTR_BLOCK_MASK) | e->to;
+        index_put(idx, old->slot[i].hash, ptr);
+    }
+
+    dedup_free(state);
+    state->dedup_idx = idx;
+}
+
+/*
+ * dedup_prune
+ *
+ * Called by gc_collect once reference counts are known and before
+ * any block moves: entries for blocks nothing references are dropped,
+ * since GC is about to reuse that space.
+ */
+void dedup_prune(struct lfs_state *state, const struct gc_table *t)
+{
+    uint32_t before = state->dedup_idx ? state->dedup_idx->count : 0;
+    index_filter(state, t, 0);
+    if (state->dedup_idx)
+        printf("GC: dedup index %u -> %u entries\n",
+               before, state->dedup_idx->count);
+}
+
+/*
+ * dedup_relocate
+ *
+ * Called by gc_collect after compaction to follow moved blocks.
+ */
+void dedup_relocate(struct lfs_state *state, const struct gc_table *t)
+{
+    index_filter(state, t, 1);
+}
+
+void dedup_free(struct lfs_state *state)
+{
+    if (!state->dedup_idx) return;
+    free(state->dedup_idx->slot);
+    free(state->dedup_idx);
+    state->dedup_idx = NULL;
+}
@@ -1,21 +1,175 @@
+#define _GNU_SOURCE             /* O_DIRECT */
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "lfs.h"
 
 static int disk_fd = -1;
+static int disk_direct;         /* image opened with O_DIRECT        */
+static uint64_t disk_written;   /* blocks written since start        */
 
-int disk_open(const char *path)
+/* DISK_MMAP: the whole image, mapped shared; reads become memcpy   */
+static uint8_t *disk_map;
+static size_t   disk_map_len;
+
+/*
+ * Aligned buffer pool.
+ *
+ * O_DIRECT transfers need LFS_DISK_ALIGN-aligned memory.  The pool is
+ * one aligned slab of LFS_DISK_POOL blocks handed out one at a time;
+ * slots are claimed with an atomic test-and-set so concurrent readers
+ * never share one.  When the pool is empty a buffer is allocated and
+ * freed on return, so callers never block.
+ */
+static uint8_t *pool_slab;
+static char     pool_used[LFS_DISK_POOL];
+
+static int pool_init(void)
+{
+    if (pool_slab) return 0;
+    void *p = NULL;
+    if (posix_memalign(&p, LFS_DISK_ALIGN,
+                       (size_t)LFS_DISK_POOL * BLOCK_SIZE) != 0)
+        return -1;
+    pool_slab = p;
+    memset(pool_used, 0, sizeof(pool_used));
+    return 0;
+}
+
+/* One block-sized, LFS_DISK_ALIGN-aligned buffer (NULL if out of memory) */
+void *disk_buf_get(void)
+{
+    if (pool_slab) {
+        for (int i = 0; i < LFS_DISK_POOL; i++)
+            if (!__atomic_test_and_set(&pool_used[i], __ATOMIC_ACQUIRE))
+                return pool_slab + (size_t)i * BLOCK_SIZE;
+    }
+    return disk_alloc(BLOCK_SIZE);
+}
+
+void disk_buf_put(void *buf)
 {
+    uint8_t *p = buf;
+    if (!p) return;
+    if (pool_slab && p >= pool_slab &&
+        p < pool_slab + (size_t)LFS_DISK_POOL * BLOCK_SIZE) {
+        __atomic_clear(&pool_used[(p - pool_slab) / BLOCK_SIZE],
+                       __ATOMIC_RELEASE);
+        return;
+    }
+    free(p);
+}
+
+/* An aligned allocation of 'len' bytes for multi-block I/O; free() it */
+void *disk_alloc(size_t len)
+{
+    void *p = NULL;
+    if (posix_memalign(&p, LFS_DISK_ALIGN, len) != 0) return NULL;
+    return p;
+}
+
+static int is_aligned(const void *buf)
+{
+    return ((uintptr_t)buf % LFS_DISK_ALIGN) == 0;
+}
+
+/* Map the image for DISK_MMAP; on failure reads just use pread */
+static void map_image(void)
+{
+    struct stat st;
+    if (fstat(disk_fd, &st) != 0 || st.st_size < BLOCK_SIZE) return;
+
+    void *p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED,
+                   disk_fd, 0);
+    if (p == MAP_FAILED) {
+        perror("disk_open: mmap");
+        return;
+    }
+    disk_map     = p;
+    disk_map_len = (size_t)st.st_size;
+}
+
+/*
+ * disk_open_ex
+ *
+ * DISK_DIRECT asks for O_DIRECT, bypassing the host page cache so
+ * image blocks are not cached twice.  Filesystems that refuse
+ * O_DIRECT (e.g. tmpfs) fall back to buffered I/O with a warning.
+ *
+ * DISK_MMAP maps the image read-only for read-mostly mounts: reads
+ * are served from the mapping without a syscall, writes still go
+ * through pwrite (the mapping is shared, so it sees them at once).
+ * It is ignored together with DISK_DIRECT.
+ */
+int disk_open_ex(const char *path, int flags)
+{
+    disk_direct = 0;
+    if (flags & DISK_DIRECT) {
+        disk_fd = open(path, O_RDWR | O_DIRECT);
+        if (disk_fd >= 0 && pool_init() == 0) {
+            disk_direct = 1;
+            return 0;
+        }
+        if (disk_fd >= 0) { close(disk_fd); disk_fd = -1; }
+        fprintf(stderr, "disk_open: O_DIRECT unavailable (%s), "
+                        "using buffered I/O\n", strerror(errno));
+    }
+
     disk_fd = open(path, O_RDWR);
     if (disk_fd < 0) {
         perror("disk_open");
         return -1;
     }
+    if (flags & DISK_MMAP) map_image();
     return 0;
 }
 
+int disk_open(const char *path)
+{
+    return disk_open_ex(path, 0);
+}
+
+/*
+ * disk_map_block
+ *
+ * Pointer to 'block' inside the DISK_MMAP mapping, or NULL when the
+ * image is not mapped.  Valid until disk_close().
+ */
+const void *disk_map_block(uint32_t block)
+{
+    size_t off = (size_t)block * BLOCK_SIZE;
+    if (!disk_map || off + BLOCK_SIZE > disk_map_len) return NULL;
+    return disk_map + off;
+}
+
+/*
+ * disk_prefetch
+ *
+ * Hint that blocks [block, block + n) are about to be read in order
+ * (MADV_WILLNEED), so the kernel reads them ahead in one go.  Only
+ * meaningful for a mapped image.
+ */
+void disk_prefetch(uint32_t block, uint32_t n)
+{
+    size_t off = (size_t)block * BLOCK_SIZE;
+    if (!disk_map || n == 0 || off >= disk_map_len) return;
+
+    size_t len = (size_t)n * BLOCK_SIZE;
+    if (off + len > disk_map_len) len = disk_map_len - off;
+    madvise(disk_map + off, len, MADV_WILLNEED);
+}
+
+int disk_is_direct(void)
+{
+    return disk_direct;
+}
+
 /*
  * Use pread/pwrite instead of lseek+read/write.
  * pread/pwrite are atomic with respect to the file offset — no risk
@@ -23,15 +177,34 @@ int disk_open(const char *path)
  * short-reads caused by a prior lseek leaving the cursor in the
  * wrong place.
  */
-int disk_read(uint32_t block, void *buf)
+int disk_read_uncached(uint32_t block, void *buf)
 {
     if (disk_fd < 0) {
         fprintf(stderr, "disk_read: disk not open\n");
         return -1;
     }
 
+    /* O_DIRECT needs aligned memory: bounce through the pool */
+    if (disk_direct && !is_aligned(buf)) {
+        void *tmp = disk_buf_get();
+        if (!tmp) return -1;
+        int r = disk_read_uncached(block, tmp);
+        if (r == 0) memcpy(buf, tmp, BLOCK_SIZE);
+        disk_buf_put(tmp);
+        return r;
+    }
+
+    const void *mapped = disk_map_block(block);
+    if (mapped) {
+        memcpy(buf, mapped, BLOCK_SIZE);
+        return 0;
+    }
+
     off_t offset = (off_t)block * BLOCK_SIZE;
+    uint64_t t0 = stats_now();
     ssize_t n = pread(disk_fd, buf, BLOCK_SIZE, offset);
+    stats_record(STAT_DISK_READ, t0, n != BLOCK_SIZE);
+    TRACE_SPAN(STAT_DISK_READ, t0, 0, block, n);
 
     if (n < 0) {
         perror("disk_read: pread");
@@ -45,6 +218,62 @@ int disk_read(uint32_t block, void *buf)
     return 0;
 }
 
+/*
+ * disk_read
+ *
+ * Reads through the block cache (cache.c); a mapped image needs no
+ * cache of its own.
+ */
+int disk_read(uint32_t block, void *buf)
+{
+    if (disk_map) return disk_read_uncached(block, buf);
+
+    if (cache_lookup(block, buf) == 0) return 0;
+
+    uint64_t gen = cache_gen();
+    if (disk_read_uncached(block, buf) != 0) return -1;
+    cache_insert(block, buf, gen, 0);
+    return 0;
+}
+
+/*
+ * disk_read_range
+ *
+ * Reads blocks [block, block + n) into 'buf' with one pread, bypassing
+ * the block cache: for scans that look at each block once.  With
+ * O_DIRECT, 'buf' must come from disk_alloc().
+ */
+int disk_read_range(uint32_t block, uint32_t n, void *buf)
+{
+    if (disk_fd < 0) {
+        fprintf(stderr, "disk_read: disk not open\n");
+        return -1;
+    }
+
+    size_t len = (size_t)n * BLOCK_SIZE;
+    off_t  offset = (off_t)block * BLOCK_SIZE;
+    if (disk_map && (size_t)offset + len <= disk_map_len) {
+        memcpy(buf, disk_map + offset, len);
+        return 0;
+    }
+
+    uint64_t t0 = stats_now();
+    ssize_t got = pread(disk_fd, buf, len, offset);
+    stats_record(STAT_DISK_READ, t0, got != (ssize_t)len);
+    TRACE_SPAN(STAT_DISK_READ, t0, 0, block, got);
+
+    if (got < 0) {
+        perror("disk_read_range: pread");
+        return -1;
+    }
+    if ((size_t)got != len) {
+        fprintf(stderr, "disk_read_range: short read at block %u "
+                        "(got %zd of %zu bytes)\n", block, got, len);
+        return -1;
+    }
+    return 0;
+}
+
 int disk_write(uint32_t block, const void *buf)
 {
     if (disk_fd < 0) {
@@ -52,8 +281,20 @@ int disk_write(uint32_t block, const void *buf)
         return -1;
     }
 
+    if (disk_direct && !is_aligned(buf)) {
+        void *tmp = disk_buf_get();
+        if (!tmp) return -1;
+        memcpy(tmp, buf, BLOCK_SIZE);
+        int r = disk_write(block, tmp);
+        disk_buf_put(tmp);
+        return r;
+    }
+
     off_t offset = (off_t)block * BLOCK_SIZE;
+    uint64_t t0 = stats_now();
     ssize_t n = pwrite(disk_fd, buf, BLOCK_SIZE, offset);
+    stats_record(STAT_DISK_WRITE, t0, n != BLOCK_SIZE);
+    TRACE_SPAN(STAT_DISK_WRITE, t0, 0, block, n);
 
     if (n < 0) {
         perror("disk_write: pwrite");
@@ -64,13 +305,74 @@ int disk_write(uint32_t block, const void *buf)
                         "(wrote %zd bytes)\n", block, n);
         return -1;
     }
+    cache_update(block, buf);
+    __atomic_fetch_add(&disk_written, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/* Blocks [block, block + n) were written through disk_get_fd() */
+void disk_note_write(uint32_t block, uint32_t n)
+{
+    cache_invalidate(block, n);
+    __atomic_fetch_add(&disk_written, n, __ATOMIC_RELAXED);
+}
+
+/* Image blocks written so far: the denominator of write amplification */
+uint64_t disk_blocks_written(void)
+{
+    return __atomic_load_n(&disk_written, __ATOMIC_RELAXED);
+}
+
+/*
+ * disk_get_fd
+ *
+ * Exposes the image descriptor so the FUSE layer can describe read
+ * replies as (fd, offset, length) ranges and let libfuse splice them.
+ * Block I/O must still go through disk_read()/disk_write(); blocks
+ * written through the descriptor must be reported with
+ * disk_note_write().  Not usable for that when disk_is_direct():
+ * libfuse's transfers are not aligned.
+ */
+int disk_get_fd(void)
+{
+    return disk_fd;
+}
+
+/*
+ * disk_sync — write barrier.
+ *
+ * Returns once every block written so far is on stable storage.  The
+ * image never changes size after mkfs, so fdatasync() is enough for
+ * the log; 'datasync' = 0 asks for a full fsync() anyway.
+ */
+int disk_sync(int datasync)
+{
+    if (disk_fd < 0) {
+        fprintf(stderr, "disk_sync: disk not open\n");
+        return -1;
+    }
+
+    uint64_t t0 = stats_now();
+    int r = datasync ? fdatasync(disk_fd) : fsync(disk_fd);
+    stats_record(STAT_DISK_SYNC, t0, r != 0);
+    TRACE_SPAN(STAT_DISK_SYNC, t0, 0, 0, r);
+    if (r != 0) {
+        perror("disk_sync");
+        return -1;
+    }
     return 0;
 }
 
 void disk_close(void)
 {
+    if (disk_map) {
+        munmap(disk_map, disk_map_len);
+        disk_map     = NULL;
+        disk_map_len = 0;
+    }
     if (disk_fd >= 0) {
         close(disk_fd);
         disk_fd = -1;
+        disk_direct = 0;
     }
 }
@@ -2,205 +2,459 @@
  * gc.c — Garbage Collector for LFS
  *
  * Strategy: build relocation table, compact forward, fix all pointers.
+ *
+ * Data pointers may name a packed block of compressed records (see
+ * lfs.h); GC only ever looks at the block bits, so packed blocks are
+ * moved as opaque units and never decompressed.  Segment summary
+ * blocks are pinned in place and their entries follow moved blocks.
+ *
+ * Liveness is a reference count per block rather than a flag: with
+ * deduplication several pointers can share one physical block, and
+ * a block is only dead once nothing references it.
  */
 
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include "lfs.h"
 
-int gc_should_run(struct lfs_state *state)
+/* Blocks on the disk being collected: pointers at or past this are
+ * ignored                                                            */
+static uint32_t nblocks;
+
+/* A growable list of block numbers */
+struct blk_list {
+    uint32_t *v;
+    size_t    n, cap;
+};
+
+static int list_push(struct blk_list *l, uint32_t blk)
 {
-    if (!state) return 0;
-    return ((state->sb.total_blocks - state->log_tail) < GC_THRESHOLD) ? 1 : 0;
+    if (l->n == l->cap) {
+        size_t cap = l->cap ? l->cap * 2 : 1024;
+        uint32_t *v = realloc(l->v, cap * sizeof(*v));
+        if (!v) return -1;
+        l->v = v;
+        l->cap = cap;
+    }
+    l->v[l->n++] = blk;
+    return 0;
 }
 
-int gc_collect(struct lfs_state *state)
+static int cmp_u32(const void *a, const void *b)
 {
-    if (!state) return -1;
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
 
-    uint32_t old_tail = state->log_tail;
-    printf("GC: starting, log_tail=%u free=%u\n",
-           old_tail, state->sb.total_blocks - old_tail);
+/* Sort 'l' and drop duplicates */
+static void list_unique(struct blk_list *l)
+{
+    if (l->n == 0) return;
+    qsort(l->v, l->n, sizeof(*l->v), cmp_u32);
+    size_t k = 1;
+    for (size_t i = 1; i < l->n; i++)
+        if (l->v[i] != l->v[k - 1]) l->v[k++] = l->v[i];
+    l->n = k;
+}
 
-    /*
-     * Step 1: mark which blocks are live using a bitmap.
-     */
-    uint8_t live[TOTAL_BLOCKS];
-    memset(live, 0, sizeof(live));
+/* Add one reference to the block a pointer refers to */
+static int mark_ptr(struct blk_list *refs, uint32_t ptr)
+{
+    uint32_t blk = LFS_PTR_BLOCK(ptr);
+    if (ptr == 0 || blk >= nblocks) return 0;
+    return list_push(refs, blk);
+}
+
+/* Entry of block 'blk' in a pass's table, or NULL if unreferenced */
+struct gc_block *gc_find(const struct gc_table *t, uint32_t blk)
+{
+    size_t lo = 0, hi = t->n;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (t->b[mid].blk < blk)       lo = mid + 1;
+        else if (t->b[mid].blk > blk)  hi = mid;
+        else                           return &t->b[mid];
+    }
+    return NULL;
+}
+
+/*
+ * Return 'ptr' re-pointed at the new location of its block if that
+ * block moved, keeping the packed/slot bits.
+ */
+static uint32_t relocate_ptr(uint32_t ptr, const struct gc_table *t)
+{
+    uint32_t blk = LFS_PTR_BLOCK(ptr);
+    if (ptr == 0 || blk >= nblocks) return ptr;
+    struct gc_block *e = gc_find(t, blk);
+    if (!e || e->to == 0) return ptr;
+    return (ptr & ~LFS_PTR_BLOCK_MASK) | e->to;
+}
+
+/*
+ * GC roots: the live inode map plus the frozen map of every snapshot.
+ * Returns the number of maps stored in 'maps', or -1 if a snapshot map
+ * cannot be read (its blocks would look dead).
+ */
+static int gc_roots(struct lfs_state *state,
+                    uint32_t *maps[1 + LFS_MAX_SNAPSHOTS])
+{
+    int n = 0;
+    maps[n++] = state->inode_map;
+    for (int s = 0; s < LFS_MAX_SNAPSHOTS; s++) {
+        if (state->sb.snap[s].imap_block == 0) continue;
+        maps[n] = snapshot_map(state, s);
+        if (!maps[n++]) return -1;
+    }
+    return n;
+}
+
+/*
+ * Build the table of every referenced block with its reference count.
+ * Map entries count once per map; the pointers inside an inode or
+ * indirect block count once per distinct block, since snapshots share
+ * unchanged inode blocks.  The table grows with what the roots reach,
+ * not with the size of the disk.
+ */
+static int gc_mark(uint32_t *maps[], int nmaps,
+                   const struct lfs_superblock *sb, struct gc_table *t)
+{
+    struct blk_list refs = {0}, inodes = {0}, inds = {0};
+    uint8_t buf[BLOCK_SIZE];
+    int r = 0;
+
+    for (int m = 0; m < nmaps && r == 0; m++)
+        for (int i = 0; i < INODE_MAP_SIZE && r == 0; i++)
+            if (maps[m][i] != 0 && maps[m][i] < nblocks)
+                r = list_push(&refs, maps[m][i]) |
+                    list_push(&inodes, maps[m][i]);
 
-    for (int i = 0; i < INODE_MAP_SIZE; i++) {
-        if (state->inode_map[i] == 0) continue;
-        uint32_t iblk = state->inode_map[i];
-        if (iblk < TOTAL_BLOCKS) live[iblk] = 1;
+    /* Snapshot inode maps are log blocks too */
+    for (int sn = 0; sn < LFS_MAX_SNAPSHOTS && r == 0; sn++)
+        r = mark_ptr(&refs, sb->snap[sn].imap_block);
 
-        uint8_t buf[BLOCK_SIZE];
-        if (disk_read(iblk, buf) != 0) continue;
+    list_unique(&inodes);
+    for (size_t i = 0; i < inodes.n && r == 0; i++) {
+        if (disk_read(inodes.v[i], buf) != 0) continue;
         struct lfs_inode *inode = (struct lfs_inode *)buf;
-        for (int j = 0; j < MAX_DIRECT_PTRS; j++) {
-            if (inode->direct[j] != 0 && inode->direct[j] < TOTAL_BLOCKS)
-                live[inode->direct[j]] = 1;
-        }
-        /* Stage 9: mark indirect block and all blocks it points to */
-        if (inode->indirect != 0 && inode->indirect < TOTAL_BLOCKS) {
-            live[inode->indirect] = 1;
-            uint32_t ind_ptrs[BLOCK_SIZE / sizeof(uint32_t)];
-            memset(ind_ptrs, 0, sizeof(ind_ptrs));
-            if (disk_read(inode->indirect, ind_ptrs) == 0) {
-                for (int j = 0; j < (int)(BLOCK_SIZE / sizeof(uint32_t)); j++) {
-                    if (ind_ptrs[j] != 0 && ind_ptrs[j] < TOTAL_BLOCKS)
-                        live[ind_ptrs[j]] = 1;
-                }
-            }
+        for (int j = 0; j < MAX_DIRECT_PTRS && r == 0; j++)
+            r = mark_ptr(&refs, inode->direct[j]);
+
+        /* Stage 9: the indirect block, and below all it points to */
+        if (inode->indirect != 0 && inode->indirect < nblocks && r == 0)
+            r = list_push(&refs, inode->indirect) |
+                list_push(&inds, inode->indirect);
+    }
+
+    list_unique(&inds);
+    for (size_t i = 0; i < inds.n && r == 0; i++) {
+        uint32_t *ind_ptrs = (uint32_t *)buf;
+        if (disk_read(inds.v[i], ind_ptrs) != 0) continue;
+        for (int j = 0; j < (int)PTRS_PER_BLOCK && r == 0; j++)
+            r = mark_ptr(&refs, ind_ptrs[j]);
+    }
+    free(inodes.v);
+    free(inds.v);
+
+    /* Collapse the sorted references into one entry per block */
+    if (r == 0 && refs.n > 0) {
+        qsort(refs.v, refs.n, sizeof(*refs.v), cmp_u32);
+        t->b = calloc(refs.n, sizeof(*t->b));
+        if (!t->b) r = -1;
+    }
+    for (size_t i = 0; r == 0 && i < refs.n; i++) {
+        if (t->n > 0 && t->b[t->n - 1].blk == refs.v[i]) {
+            if (t->b[t->n - 1].refs < UINT16_MAX) t->b[t->n - 1].refs++;
+            continue;
         }
+        t->b[t->n].blk  = refs.v[i];
+        t->b[t->n].refs = 1;
+        t->n++;
+    }
+    free(refs.v);
+    return r ? -1 : 0;
+}
+
+/*
+ * Apply all relocations inside the inode block that was at 'iblk'
+ * before the pass and inside its indirect block, in one
+ * read-modify-write each.  'fixed' makes sure a block reachable from
+ * several roots is rewritten only once.
+ */
+static void fix_inode(uint32_t iblk, const struct gc_table *t)
+{
+    struct gc_block *e = gc_find(t, iblk);
+    if (!e || e->fixed) return;
+    e->fixed = 1;
+    iblk = e->to ? e->to : e->blk;
+
+    uint8_t buf[BLOCK_SIZE];
+    if (disk_read(iblk, buf) != 0) return;
+    struct lfs_inode *inode = (struct lfs_inode *)buf;
+    int dirty = 0;
+
+    /* Fix direct[] pointers */
+    for (int j = 0; j < MAX_DIRECT_PTRS; j++) {
+        uint32_t p = relocate_ptr(inode->direct[j], t);
+        if (p != inode->direct[j]) { inode->direct[j] = p; dirty = 1; }
+    }
+
+    /* Fix indirect block pointer */
+    uint32_t old_ind = inode->indirect;
+    uint32_t ind = relocate_ptr(old_ind, t);
+    if (ind != old_ind) { inode->indirect = ind; dirty = 1; }
+
+    if (dirty) disk_write(iblk, buf);
+
+    /* Fix pointers inside the indirect block itself */
+    e = old_ind ? gc_find(t, old_ind) : NULL;
+    if (!e || e->fixed) return;
+    e->fixed = 1;
+
+    uint32_t ind_ptrs[BLOCK_SIZE / sizeof(uint32_t)];
+    memset(ind_ptrs, 0, sizeof(ind_ptrs));
+    if (disk_read(ind, ind_ptrs) != 0) return;
+    int ind_dirty = 0;
+    for (int j = 0; j < (int)(BLOCK_SIZE / sizeof(uint32_t)); j++) {
+        uint32_t p = relocate_ptr(ind_ptrs[j], t);
+        if (p != ind_ptrs[j]) { ind_ptrs[j] = p; ind_dirty = 1; }
+    }
+    if (ind_dirty) disk_write(ind, ind_ptrs);
+}
+
+/*
+ * gc_threshold counts blocks at the default segment size.  GC hands
+ * back whole segments, so with larger segments the trigger grows in
+ * proportion and still leaves room for a few of them.
+ */
+int gc_should_run(struct lfs_state *state)
+{
+    if (!state) return 0;
+    uint64_t want = (uint64_t)state->gc_threshold * state->seg_blocks
+                  / BLOCKS_PER_SEGMENT;
+    return state->sb.total_blocks - state->log_tail < want;
+}
+
+/*
+ * Summary blocks of one segment, read when compaction first touches
+ * the segment and written back (dirty blocks only) when it moves on.
+ */
+struct gc_seg {
+    uint32_t seg;              /* segment held, 0 = none (no summary) */
+    struct lfs_segment_summary *sums;
+    uint8_t *dirty;
+};
+
+static void seg_flush(struct lfs_state *state, struct gc_seg *g)
+{
+    for (uint32_t k = 0; g->seg != 0 && k < state->sum_blocks; k++) {
+        if (!g->dirty[k]) continue;
+        log_seal_summary(state, &g->sums[k]);
+        disk_write(g->seg * state->seg_blocks + k, &g->sums[k]);
+        g->dirty[k] = 0;
     }
+}
+
+/* Make 'g' hold the summaries of the segment containing block 'b' */
+static void seg_load(struct lfs_state *state, struct gc_seg *g, uint32_t b)
+{
+    uint32_t seg = b / state->seg_blocks;
+    if (g->seg == seg) return;
+    seg_flush(state, g);
+    g->seg = seg;
+    if (disk_read_range(seg * state->seg_blocks, state->sum_blocks,
+                        g->sums) != 0)
+        memset(g->sums, 0, state->sum_blocks * sizeof(*g->sums));
+}
+
+static int seg_init(struct lfs_state *state, struct gc_seg *g)
+{
+    g->seg   = 0;
+    g->sums  = disk_alloc(state->sum_blocks * sizeof(*g->sums));
+    g->dirty = calloc(state->sum_blocks, 1);
+    return g->sums && g->dirty ? 0 : -1;
+}
 
-    /* Count dead blocks */
-    int dead = 0;
-    for (uint32_t b = LOG_START_BLOCK; b < old_tail; b++)
-        if (!live[b]) dead++;
-    printf("GC: %d dead blocks out of %u used\n", dead,
-           old_tail - LOG_START_BLOCK);
+static void seg_free(struct gc_seg *g)
+{
+    free(g->sums);
+    free(g->dirty);
+}
 
-    if (dead == 0) { printf("GC: nothing to collect\n"); return 0; }
+/*
+ * One collection over the table 't' of referenced blocks (gc_mark),
+ * which also records where each block moves ('to') and which inode
+ * and indirect blocks have been fixed (see fix_inode).
+ */
+static int gc_pass(struct lfs_state *state, uint32_t *maps[], int nmaps,
+                   struct gc_table *t)
+{
+    uint32_t old_tail = state->log_tail;
+    uint32_t seg      = state->seg_blocks;
 
     /*
-     * Step 2: forward compaction.
-     * dst = next free (dead) slot, scanning left to right.
-     * src = next live block, scanning left to right.
-     * Move live[src] into dst, record relocation.
+     * Step 1 (gc_mark): reference counts.  A block missing from the
+     * table is dead; refs > 1 means the block is shared.  Summary
+     * blocks are neither live nor dead.
      */
-    uint32_t relo_old[TOTAL_BLOCKS];
-    uint32_t relo_new[TOTAL_BLOCKS];
-    int nrelo = 0;
+    uint32_t live = 0, shared = 0, pinned = 0;
+    size_t first = 0;
+    while (first < t->n && t->b[first].blk < LOG_START_BLOCK) first++;
+    for (size_t i = first; i < t->n && t->b[i].blk < old_tail; i++) {
+        live++;
+        if (t->b[i].refs > 1) shared++;
+    }
+    for (uint32_t s = 1; s * seg < old_tail; s++) {
+        uint32_t end = s * seg + state->sum_blocks;
+        pinned += (end < old_tail ? end : old_tail) - s * seg;
+    }
+    uint32_t dead = old_tail - LOG_START_BLOCK - live - pinned;
+
+    /* Called on every write while space is short: stay quiet */
+    if (dead == 0) return 0;
+    printf("GC: %u dead blocks out of %u used (%u shared)\n", dead,
+           old_tail - LOG_START_BLOCK, shared);
+
+    /* Dead blocks are about to be reused: forget their fingerprints */
+    dedup_prune(state, t);
 
-    uint8_t tmp[BLOCK_SIZE];
-    uint8_t zero[BLOCK_SIZE];
+    /*
+     * Step 2: forward compaction, one victim segment at a time.
+     * src walks the live blocks in order; dst is the next free slot
+     * below it.  Every block in [dst, src) that was live has already
+     * moved, so only summary blocks have to be skipped.  The summaries
+     * of the segments src and dst are in are the only ones held.
+     */
+    struct gc_seg ssum, dsum;
+    uint8_t *tmp  = disk_buf_get();
+    uint8_t *zero = disk_buf_get();
+    int ok = seg_init(state, &ssum) == 0 && seg_init(state, &dsum) == 0;
+    if (!ok || !tmp || !zero) {
+        seg_free(&ssum); seg_free(&dsum);
+        disk_buf_put(tmp); disk_buf_put(zero);
+        return -1;
+    }
     memset(zero, 0, BLOCK_SIZE);
 
-    uint32_t dst = LOG_START_BLOCK;
-    for (uint32_t src = LOG_START_BLOCK; src < old_tail; src++) {
-        if (!live[src]) continue;      /* dead — skip */
-        /* advance dst to next dead slot */
-        while (dst < src && live[dst]) dst++;
-        if (dst >= src) { dst++; continue; } /* already compact here */
+    int nrelo = 0;
+    uint32_t dst = LOG_START_BLOCK, highest = LOG_START_BLOCK;
+    for (size_t i = first; i < t->n && t->b[i].blk < old_tail; i++) {
+        uint32_t src = t->b[i].blk;
+        while (dst < src && IS_SUMMARY_BLOCK(state, dst)) dst++;
+        if (dst >= src) { highest = src; dst = src + 1; continue; }
 
         /* move src -> dst */
         disk_read(src, tmp);
         disk_write(dst, tmp);
         disk_write(src, zero);
-        live[dst] = 1;
-        live[src] = 0;
-        relo_old[nrelo] = src;
-        relo_new[nrelo] = dst;
+        t->b[i].to = dst;
+        highest = dst;
         nrelo++;
+
+        if (dst >= seg) {
+            uint32_t k = dst % seg / LFS_SUM_ENTRIES;
+            seg_load(state, &dsum, dst);
+            if (src >= seg) {
+                /* The summaries of src's segment on disk are current
+                 * for src: dst only rewrites slots below it         */
+                struct gc_seg *from = &dsum;
+                if (src / seg != dsum.seg) {
+                    seg_load(state, &ssum, src);
+                    from = &ssum;
+                }
+                dsum.sums[k].entry[LFS_SUM_INDEX(state, dst)] =
+                    from->sums[src % seg / LFS_SUM_ENTRIES]
+                        .entry[LFS_SUM_INDEX(state, src)];
+            } else {
+                memset(&dsum.sums[k].entry[LFS_SUM_INDEX(state, dst)], 0,
+                       sizeof(dsum.sums[k].entry[0]));
+            }
+            dsum.dirty[k] = 1;
+        }
         dst++;
     }
 
+    seg_flush(state, &dsum);
+    seg_free(&ssum);
+    seg_free(&dsum);
+    disk_buf_put(tmp);
+    disk_buf_put(zero);
+
+    /* Moved blocks are durable only once the next flush completes */
+    state->gc_unsynced = 1;
+
+    /* The log's cached summaries, and any inode cached by an open
+     * file, may be stale now */
+    state->seg_sum_blk = 0;
+    state->vsum_blk    = 0;
+    state->gc_epoch++;
+
+    /* Dedup fingerprints follow moved blocks */
+    dedup_relocate(state, t);
+
     printf("GC: moved %d blocks\n", nrelo);
+    stats_add(CTR_GC_MOVED, (uint64_t)nrelo);
 
     /*
-     * Step 3: apply all relocations to inode_map and direct[] pointers.
-     * For each inode, apply ALL pending relocations in one read-modify-write.
+     * Step 3: apply all relocations to the inode maps and to the
+     * pointers inside every reachable inode and indirect block.
      */
-
-    /* First update inode_map entries (inode blocks that moved) */
-    for (int r = 0; r < nrelo; r++) {
+    for (int m = 0; m < nmaps; m++) {
         for (int i = 0; i < INODE_MAP_SIZE; i++) {
-            if (state->inode_map[i] == relo_old[r])
-                state->inode_map[i] = relo_new[r];
+            uint32_t iblk = maps[m][i];
+            if (iblk == 0 || iblk >= nblocks) continue;
+            maps[m][i] = relocate_ptr(iblk, t);
+            fix_inode(iblk, t);
         }
     }
 
-    /* Then update direct[] and indirect pointers inside each inode */
-    for (int i = 0; i < INODE_MAP_SIZE; i++) {
-        if (state->inode_map[i] == 0) continue;
-        uint8_t buf[BLOCK_SIZE];
-        if (disk_read(state->inode_map[i], buf) != 0) continue;
-        struct lfs_inode *inode = (struct lfs_inode *)buf;
-        int dirty = 0;
-
-        /* Fix direct[] pointers */
-        for (int j = 0; j < MAX_DIRECT_PTRS; j++) {
-            for (int r = 0; r < nrelo; r++) {
-                if (inode->direct[j] == relo_old[r]) {
-                    inode->direct[j] = relo_new[r];
-                    dirty = 1;
-                    break;
-                }
-            }
-        }
-
-        /* Fix indirect block pointer */
-        for (int r = 0; r < nrelo; r++) {
-            if (inode->indirect == relo_old[r]) {
-                inode->indirect = relo_new[r];
-                dirty = 1;
-                break;
-            }
-        }
-
-        if (dirty) disk_write(state->inode_map[i], buf);
-
-        /* Fix pointers inside the indirect block itself */
-        if (inode->indirect != 0) {
-            uint32_t ind_ptrs[BLOCK_SIZE / sizeof(uint32_t)];
-            memset(ind_ptrs, 0, sizeof(ind_ptrs));
-            if (disk_read(inode->indirect, ind_ptrs) != 0) continue;
-            int ind_dirty = 0;
-            for (int j = 0; j < (int)(BLOCK_SIZE / sizeof(uint32_t)); j++) {
-                for (int r = 0; r < nrelo; r++) {
-                    if (ind_ptrs[j] == relo_old[r]) {
-                        ind_ptrs[j] = relo_new[r];
-                        ind_dirty = 1;
-                        break;
-                    }
-                }
-            }
-            if (ind_dirty) disk_write(inode->indirect, ind_ptrs);
-        }
+    /* Snapshot maps may have moved and their entries changed */
+    for (int sn = 0; sn < LFS_MAX_SNAPSHOTS; sn++) {
+        if (state->sb.snap[sn].imap_block == 0) continue;
+        state->sb.snap[sn].imap_block =
+            relocate_ptr(state->sb.snap[sn].imap_block, t);
+        snapshot_write_map(state, sn);
     }
 
     /*
-     * Step 4: rewind log_tail to just after the highest live block.
+     * Step 4: rewind log_tail to just after the highest live block,
+     * which is where the last one in log order ended up.
      */
-    uint32_t highest = LOG_START_BLOCK;
-    for (uint32_t b = old_tail - 1; b >= LOG_START_BLOCK; b--) {
-        if (live[b]) { highest = b; break; }
-        if (b == LOG_START_BLOCK) break;
-    }
-    /* Find highest by scanning all inode pointers (most accurate) */
-    highest = LOG_START_BLOCK;
-    for (int i = 0; i < INODE_MAP_SIZE; i++) {
-        if (state->inode_map[i] > highest) highest = state->inode_map[i];
-        if (state->inode_map[i] == 0) continue;
-        uint8_t buf[BLOCK_SIZE];
-        if (disk_read(state->inode_map[i], buf) != 0) continue;
-        struct lfs_inode *in = (struct lfs_inode *)buf;
-        for (int j = 0; j < MAX_DIRECT_PTRS; j++)
-            if (in->direct[j] > highest) highest = in->direct[j];
-        if (in->indirect > highest) highest = in->indirect;
-        if (in->indirect != 0) {
-            uint32_t ind_ptrs[BLOCK_SIZE / sizeof(uint32_t)];
-            memset(ind_ptrs, 0, sizeof(ind_ptrs));
-            if (disk_read(in->indirect, ind_ptrs) == 0) {
-                for (int j = 0; j < (int)(BLOCK_SIZE / sizeof(uint32_t)); j++)
-                    if (ind_ptrs[j] > highest) highest = ind_ptrs[j];
-            }
-        }
-    }
-
     uint32_t new_tail = highest + 1;
-    if (new_tail % BLOCKS_PER_SEGMENT != 0)
-        new_tail = ((new_tail / BLOCKS_PER_SEGMENT) + 1) * BLOCKS_PER_SEGMENT;
+    if (new_tail % seg != 0)
+        new_tail = (new_tail / seg + 1) * seg;
     if (new_tail > old_tail) new_tail = old_tail;
 
     printf("GC: rewound log_tail %u -> %u (reclaimed %u blocks)\n",
            old_tail, new_tail, old_tail - new_tail);
     state->log_tail    = new_tail;
     state->sb.log_tail = new_tail;
+    stats_add(CTR_GC_RECLAIMED, old_tail - new_tail);
 
     log_checkpoint(state);
     printf("GC: done, log_tail=%u free=%u\n",
            state->log_tail, state->sb.total_blocks - state->log_tail);
     return 0;
 }
+
+int gc_collect(struct lfs_state *state)
+{
+    if (!state) return -1;
+
+    uint64_t t0   = stats_now();
+    uint32_t tail = state->log_tail;
+
+    nblocks = state->sb.total_blocks;
+    uint32_t *maps[1 + LFS_MAX_SNAPSHOTS];
+    struct gc_table t = {0};
+    int nmaps = gc_roots(state, maps);
+    int r = nmaps < 0 ? -1 : gc_mark(maps, nmaps, &state->sb, &t);
+    if (r == 0) r = gc_pass(state, maps, nmaps, &t);
+    free(t.b);
+
+    stats_record(STAT_GC, t0, r != 0);
+    TRACE_SPAN(STAT_GC, t0, 0, state->log_tail,
+               (int64_t)tail - state->log_tail);
+    return r;
+}
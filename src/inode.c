@@ -20,14 +20,27 @@
 int inode_read(struct lfs_state *state, uint32_t ino,
                struct lfs_inode *out)
 {
-    if (!state || !out) return -1;
+    if (!state) return -1;
+    return inode_read_map(state->inode_map, ino, out);
+}
+
+/*
+ * inode_read_map
+ *
+ * Same as inode_read, but resolves 'ino' through an arbitrary inode
+ * map — used to read inodes as they were in a snapshot.
+ */
+int inode_read_map(const uint32_t *imap, uint32_t ino,
+                   struct lfs_inode *out)
+{
+    if (!imap || !out) return -1;
 
     if (ino >= INODE_MAP_SIZE) {
         fprintf(stderr, "inode_read: ino %u out of range\n", ino);
         return -1;
     }
 
-    uint32_t block = state->inode_map[ino];
+    uint32_t block = imap[ino];
     if (block == 0) {
         fprintf(stderr, "inode_read: ino %u not allocated "
                         "(imap[%u]=0)\n", ino, ino);
@@ -65,11 +78,12 @@ int inode_write(struct lfs_state *state, const struct lfs_inode *in)
     memset(buf, 0, BLOCK_SIZE);
     memcpy(buf, in, sizeof(struct lfs_inode));
 
-    int block = log_append(state, buf);
+    int block = log_append_ex(state, buf, in->inode_no, 0, LFS_BLK_INODE);
     if (block < 0) return -1;
 
     /* Update the in-memory inode map */
     state->inode_map[in->inode_no] = (uint32_t)block;
+    state->ino_seq[in->inode_no]   = state->append_seq;
     return 0;
 }
 
@@ -88,7 +102,7 @@ int inode_alloc(struct lfs_state *state)
     if (!state) return -1;
 
     /* Start from 1 — inode 0 is root, allocated by mkfs */
-    for (int i = 1; i < INODE_MAP_SIZE; i++) {
+    for (int i = 1; i < (int)state->inode_count; i++) {
         if (state->inode_map[i] == 0)
             return i;
     }
@@ -2,38 +2,127 @@
  * lfs.c — FUSE frontend for the Log-Structured Filesystem
  *
  * Supported operations:
- *   getattr, readdir, read          (read path)
- *   create, write, truncate         (write path)
+ *   getattr, readdir, read, read_buf (read path)
+ *   create, write, write_buf, truncate (write path)
  *   unlink                          (Stage 6 — file deletion)
  *   mkdir, rmdir                    (Stage 7 — subdirectories)
  *   crash recovery on mount         (Stage 8)
+ *   read-only snapshots under /.snapshots/<name>/
+ *   copy_file_range                 (clones by sharing blocks)
+ *   fsync, fsyncdir, flush          (durability barriers)
+ *   read-only statistics and trace dumps in /.lfs
+ *
+ * Mount options (-o, see lfs --help) choose the image, I/O backend and
+ * tunables at run time.
  */
 
 #define FUSE_USE_VERSION 31
 
 #include <fuse3/fuse.h>
+#include <stddef.h>
 #include <string.h>
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
+#include <fcntl.h>
 #include "lfs.h"
 
-/* Extended log append declared in log.c */
-int log_append_ex(struct lfs_state *state, const void *buf,
-                  uint32_t inode_no, uint32_t block_idx);
-
 /* Single global state object */
 static struct lfs_state g_state;
 
+/*
+ * Mount options.  Fields start at the build-time defaults from lfs.h;
+ * main() overwrites those given with -o.  The string options are
+ * parsed into the integer fields below them.
+ */
+struct lfs_opts {
+    char    *image;
+    char    *io_name;          /* buffered, direct or mmap          */
+    char    *sync_name;        /* none, ordered or full             */
+    char    *codec_name;       /* none, lz4 or zstd                 */
+    int      disk_flags;       /* DISK_*                            */
+    int      sync_mode;
+    int      compress;
+    int      dedup;
+    int      data_csum;
+    unsigned cache_blocks;
+    unsigned ra_max;
+    unsigned wb_file_blocks;
+    unsigned wb_max_blocks;
+    unsigned ckpt_interval;
+    unsigned gc_threshold;
+    unsigned recover_threads;
+    int      help;
+};
+
+static struct lfs_opts opts = {
+    .disk_flags      = (LFS_DIRECT_IO_DEFAULT ? DISK_DIRECT : 0)
+                     | (LFS_MMAP_DEFAULT      ? DISK_MMAP   : 0),
+    .sync_mode       = LFS_SYNC_DEFAULT,
+    .compress        = LFS_COMPRESS_DEFAULT,
+    .dedup           = LFS_DEDUP_DEFAULT,
+    .data_csum       = LFS_DATA_CSUM_DEFAULT,
+    .cache_blocks    = LFS_CACHE_BLOCKS,
+    .ra_max          = LFS_RA_MAX,
+    .wb_file_blocks  = LFS_WB_FILE_BLOCKS,
+    .wb_max_blocks   = LFS_WB_MAX_BLOCKS,
+    .ckpt_interval   = LFS_CKPT_INTERVAL,
+    .gc_threshold    = GC_THRESHOLD,
+    .recover_threads = LFS_RECOVER_THREADS,
+};
+
+/* Bumped when an inode number is freed, so open handles notice reuse */
+static uint32_t ino_gen[INODE_MAP_SIZE];
+
+/*
+ * Write-back buffer of one file: dirty blocks held in memory instead of
+ * being appended on every write (see wb_write).  Reads and getattr see
+ * the buffered data and size.
+ */
+struct wb_file {
+    uint32_t  size;            /* file size including buffered data */
+    uint32_t  n;               /* blocks held                       */
+    uint32_t *idx;             /* logical block of each             */
+    uint8_t  *data;            /* n blocks, LFS_DISK_ALIGN-aligned  */
+};
+
+static struct wb_file *wb_files[INODE_MAP_SIZE];
+static uint32_t        wb_blocks;          /* held by all files     */
+
+static int wb_flush_all(void);
+
 /* ------------------------------------------------------------------ */
 /*  Internal helpers                                                    */
 /* ------------------------------------------------------------------ */
 
-static int lookup_in_dir(uint32_t dir_ino, const char *name)
+/*
+ * An operation appended to the log: checkpoint once every
+ * ckpt_interval such operations.  In between, recovery rolls forward
+ * from the last checkpoint, and LFS_SYNC_FULL flushes the log instead
+ * so the operation is still durable when it returns.  Recovery cannot
+ * replay segment 0 (it has no summary) or cleared inode map entries,
+ * so appends there, unlink and rmdir checkpoint every time.  Returns
+ * 0 or -EIO.
+ */
+static int commit_op(void)
+{
+    int r;
+    if (++g_state.ckpt_pending >= g_state.ckpt_interval ||
+        g_state.ckpt_tail < g_state.seg_blocks)
+        r = log_checkpoint(&g_state);
+    else if (g_state.sync_mode == LFS_SYNC_FULL)
+        r = log_sync(&g_state);
+    else
+        r = 0;
+    return r != 0 ? -EIO : 0;
+}
+
+static int lookup_in_dir(const uint32_t *imap, uint32_t dir_ino,
+                         const char *name)
 {
     struct lfs_inode dir;
-    if (inode_read(&g_state, dir_ino, &dir) != 0)
+    if (inode_read_map(imap, dir_ino, &dir) != 0)
         return -EIO;
     if (dir.type != INODE_TYPE_DIR)
         return -ENOTDIR;
@@ -53,7 +142,8 @@ static int lookup_in_dir(uint32_t dir_ino, const char *name)
     return -ENOENT;
 }
 
-static int path_to_inode(const char *path)
+/* Walk 'path' (absolute) through the directory tree of inode map 'imap' */
+static int path_walk(const uint32_t *imap, const char *path)
 {
     if (strcmp(path, "/") == 0)
         return 0;
@@ -67,7 +157,7 @@ static int path_to_inode(const char *path)
     char *tok = strtok_r(tmp + 1, "/", &saveptr);
 
     while (tok != NULL) {
-        int child = lookup_in_dir(cur_ino, tok);
+        int child = lookup_in_dir(imap, cur_ino, tok);
         if (child < 0) return child;
         cur_ino = (uint32_t)child;
         tok = strtok_r(NULL, "/", &saveptr);
@@ -76,6 +166,114 @@ static int path_to_inode(const char *path)
     return (int)cur_ino;
 }
 
+static int path_to_inode(const char *path)
+{
+    return path_walk(g_state.inode_map, path);
+}
+
+/*
+ * Snapshot paths:
+ *
+ *   /.snapshots              — virtual directory listing snapshots
+ *   /.snapshots/<name>       — root directory of snapshot <name>
+ *   /.snapshots/<name>/rest  — 'rest' resolved in the frozen map
+ *
+ * snap_parse classifies 'path'.  For SNAP_PATH_SNAP it copies the
+ * snapshot name into 'name' and points *rest at the remainder of the
+ * path ("/" for the snapshot root).
+ */
+#define SNAPDIR_PATH    "/" LFS_SNAPDIR_NAME
+#define SNAPDIR_INO     INODE_MAP_SIZE   /* never a real inode number */
+
+enum { SNAP_PATH_NONE, SNAP_PATH_DIR, SNAP_PATH_SNAP };
+
+static int snap_parse(const char *path, char *name, const char **rest)
+{
+    size_t n = strlen(SNAPDIR_PATH);
+    if (strncmp(path, SNAPDIR_PATH, n) != 0) return SNAP_PATH_NONE;
+    if (path[n] == '\0') return SNAP_PATH_DIR;
+    if (path[n] != '/')  return SNAP_PATH_NONE;   /* e.g. /.snapshotsX */
+
+    const char *p     = path + n + 1;
+    const char *slash = strchr(p, '/');
+    size_t len = slash ? (size_t)(slash - p) : strlen(p);
+    if (len == 0) return SNAP_PATH_DIR;
+
+    /* Over-long names can never match a snapshot */
+    if (len >= MAX_NAME_LEN) len = 0;
+    memcpy(name, p, len);
+    name[len] = '\0';
+    *rest = slash ? slash : "/";
+    return SNAP_PATH_SNAP;
+}
+
+/*
+ * Control files: /.lfs is a virtual directory of files generated when
+ * opened: /.lfs/stats (stats.c) and /.lfs/trace (trace.c).  ctl_parse
+ * returns CTLDIR_INO or the file's number, -ENOENT for other names
+ * under /.lfs, and 0 for paths outside it.
+ */
+#define CTLDIR_PATH     "/" LFS_CTLDIR_NAME
+#define CTLDIR_INO      (INODE_MAP_SIZE + 1)
+#define STATS_INO       (INODE_MAP_SIZE + 2)
+#define TRACE_INO       (INODE_MAP_SIZE + 3)
+#define IS_CTL_FILE(i)  ((i) == STATS_INO || (i) == TRACE_INO)
+
+static int ctl_parse(const char *path)
+{
+    size_t n = strlen(CTLDIR_PATH);
+    if (strncmp(path, CTLDIR_PATH, n) != 0) return 0;
+    if (path[n] == '\0') return CTLDIR_INO;
+    if (path[n] != '/')  return 0;               /* e.g. /.lfsX */
+    if (strcmp(path + n + 1, "stats") == 0) return STATS_INO;
+    if (strcmp(path + n + 1, "trace") == 0) return TRACE_INO;
+    return -ENOENT;
+}
+
+/* Generate the contents of control file 'ino' (malloc()ed) */
+static char *ctl_text(int ino, size_t *len)
+{
+    return ino == STATS_INO ? stats_text(&g_state, len) : trace_dump(len);
+}
+
+/* Anything under /.snapshots or /.lfs is read-only */
+static int is_readonly_path(const char *path)
+{
+    char name[MAX_NAME_LEN];
+    const char *rest;
+    return snap_parse(path, name, &rest) != SNAP_PATH_NONE ||
+           ctl_parse(path) != 0;
+}
+
+/*
+ * Resolve 'path' for read-only access.  *imap is set to the inode map
+ * the result belongs to: the live map, or a snapshot's frozen map.
+ * Returns the inode number, SNAPDIR_INO for /.snapshots, CTLDIR_INO or
+ * STATS_INO for control files, or -errno.
+ */
+static int path_resolve(const char *path, const uint32_t **imap)
+{
+    char name[MAX_NAME_LEN];
+    const char *rest;
+
+    *imap = g_state.inode_map;
+    int ctl = ctl_parse(path);
+    if (ctl != 0) return ctl;
+    switch (snap_parse(path, name, &rest)) {
+    case SNAP_PATH_NONE:
+        return path_walk(g_state.inode_map, path);
+    case SNAP_PATH_DIR:
+        return SNAPDIR_INO;
+    default: {
+        int slot = snapshot_find(&g_state, name);
+        if (slot < 0) return -ENOENT;
+        *imap = snapshot_map(&g_state, slot);
+        if (!*imap) return -EIO;
+        return path_walk(*imap, rest);
+    }
+    }
+}
+
 static int path_split(const char *path, char *parent_path, char *name)
 {
     if (!path || path[0] != '/') return -EINVAL;
@@ -124,7 +322,8 @@ static int dir_add_entry(uint32_t dir_ino, uint32_t child_ino,
     strncpy(entries[use_slot].name, child_name, MAX_NAME_LEN - 1);
     entries[use_slot].name[MAX_NAME_LEN - 1] = '\0';
 
-    int new_dir_block = log_append_ex(&g_state, dbuf, dir_ino, 0);
+    int new_dir_block = log_append_ex(&g_state, dbuf, dir_ino, 0,
+                                      LFS_BLK_DATA);
     if (new_dir_block < 0) return -ENOSPC;
 
     dir.direct[0] = (uint32_t)new_dir_block;
@@ -160,7 +359,8 @@ static int dir_remove_entry(uint32_t dir_ino, uint32_t child_ino,
     }
     if (!found) return -ENOENT;
 
-    int new_dir_block = log_append_ex(&g_state, dbuf, dir_ino, 0);
+    int new_dir_block = log_append_ex(&g_state, dbuf, dir_ino, 0,
+                                      LFS_BLK_DATA);
     if (new_dir_block < 0) return -ENOSPC;
 
     dir.direct[0] = (uint32_t)new_dir_block;
@@ -195,21 +395,38 @@ static int dir_is_empty(uint32_t dir_ino)
 static void *lfs_init(struct fuse_conn_info *conn,
                       struct fuse_config   *cfg)
 {
-    setvbuf(stdout, NULL, _IONBF, 0);
-    setvbuf(stderr, NULL, _IONBF, 0);
-
     (void)conn;
     cfg->kernel_cache = 0;
     cfg->auto_cache   = 0;
     cfg->direct_io    = 1;
 
     memset(&g_state, 0, sizeof(g_state));
-
-    if (disk_open("/home/kiit/lfs-fuse/lfs.img") != 0) {
-        fprintf(stderr, "lfs_init: cannot open lfs.img\n");
+    g_state.compress        = opts.compress;
+    g_state.dedup           = opts.dedup;
+    g_state.data_csum       = opts.data_csum;
+    g_state.sync_mode       = opts.sync_mode;
+    g_state.gc_threshold    = opts.gc_threshold;
+    g_state.ckpt_interval   = opts.ckpt_interval;
+    g_state.recover_threads = opts.recover_threads;
+
+    /* LFS_TRACE=1 in the environment traces from mount on */
+    const char *trace = getenv("LFS_TRACE");
+    if (trace) trace_set(atoi(trace));
+
+    const char *image = opts.image ? opts.image : LFS_IMAGE_DEFAULT;
+    if (disk_open_ex(image, opts.disk_flags) != 0) {
+        fprintf(stderr, "lfs_init: cannot open %s\n", image);
         return NULL;
     }
 
+    /* A mapped image is cached by the host; otherwise keep our own */
+    if (!disk_map_block(0) && opts.cache_blocks > 0) {
+        if (cache_init(opts.cache_blocks) != 0)
+            fprintf(stderr, "lfs_init: no memory for block cache\n");
+        else
+            ra_start(opts.ra_max);
+    }
+
     uint8_t buf[BLOCK_SIZE];
     if (disk_read(0, buf) != 0) {
         fprintf(stderr, "lfs_init: cannot read superblock\n");
@@ -223,17 +440,24 @@ static void *lfs_init(struct fuse_conn_info *conn,
         return NULL;
     }
 
-    if (disk_read(INODE_MAP_BLOCK, buf) != 0) {
-        fprintf(stderr, "lfs_init: cannot read inode map\n");
+    /* Block and segment size come from mkfs; the block size must be
+     * the one this build was made for */
+    if (log_geometry(&g_state) != 0) {
+        disk_close();
         return NULL;
     }
-    memcpy(g_state.inode_map, buf, INODE_MAP_SIZE * sizeof(uint32_t));
 
-    g_state.log_tail = g_state.sb.log_tail;
+    /* Inode map, log tail and snapshots come from the newest checkpoint */
+    if (log_load_checkpoint(&g_state) != 0) {
+        fprintf(stderr, "lfs_init: cannot load checkpoint\n");
+        disk_close();
+        return NULL;
+    }
 
     /*
      * Stage 8: run crash recovery before allowing any operations.
-     * log_recover checks the commit block and repairs state if needed.
+     * log_recover rolls forward whatever was appended after the
+     * checkpoint.
      */
     if (log_recover(&g_state) != 0) {
         fprintf(stderr, "lfs_init: recovery failed — unmounting\n");
@@ -241,15 +465,35 @@ static void *lfs_init(struct fuse_conn_info *conn,
         return NULL;
     }
 
-    printf("LFS mounted: %u blocks, log tail at block %u\n",
-           g_state.sb.total_blocks, g_state.log_tail);
+    /*
+     * Mounting reads only the superblock, the checkpoint regions and
+     * the log written since the last checkpoint.  Anything derivable
+     * (snapshot maps, cache contents, dedup fingerprints, GC usage)
+     * is built on first use, so a clean mount does not grow with the
+     * image.
+     */
+    if (snapshot_load(&g_state) != 0) {
+        fprintf(stderr, "lfs_init: cannot load snapshots — unmounting\n");
+        disk_close();
+        return NULL;
+    }
+
+    printf("LFS mounted: %u blocks of %u bytes, %u-block segments, "
+           "log tail at block %u\n", g_state.sb.total_blocks, BLOCK_SIZE,
+           g_state.seg_blocks, g_state.log_tail);
     return &g_state;
 }
 
 static void lfs_destroy(void *private_data)
 {
     (void)private_data;
+    wb_flush_all();
     log_checkpoint(&g_state);
+    log_sync(&g_state);             /* unmount is always durable */
+    dedup_free(&g_state);
+    ra_stop();
+    cache_free();
+    trace_free();
     disk_close();
     printf("LFS unmounted.\n");
 }
@@ -260,16 +504,32 @@ static int lfs_getattr(const char *path, struct stat *st,
     (void)fi;
     memset(st, 0, sizeof(*st));
 
-    int ino = path_to_inode(path);
+    const uint32_t *imap;
+    int ino = path_resolve(path, &imap);
     if (ino < 0) return ino;
 
+    if (ino == SNAPDIR_INO || ino == CTLDIR_INO) {
+        st->st_mode  = S_IFDIR | 0555;
+        st->st_nlink = 2;
+        return 0;
+    }
+    if (IS_CTL_FILE(ino)) {
+        /* Size unknown until opened; reads are direct_io */
+        st->st_mode  = S_IFREG | 0444;
+        st->st_nlink = 1;
+        return 0;
+    }
+
     struct lfs_inode inode;
-    if (inode_read(&g_state, (uint32_t)ino, &inode) != 0)
+    if (inode_read_map(imap, (uint32_t)ino, &inode) != 0)
         return -EIO;
 
     st->st_ino   = inode.inode_no;
     st->st_nlink = inode.nlinks ? inode.nlinks : 1;
     st->st_size  = inode.size;
+    if (imap == g_state.inode_map && wb_files[ino] &&
+        wb_files[ino]->size > inode.size)
+        st->st_size = wb_files[ino]->size;
 
     if (inode.type == INODE_TYPE_DIR) {
         st->st_mode  = S_IFDIR | 0755;
@@ -277,6 +537,10 @@ static int lfs_getattr(const char *path, struct stat *st,
     } else {
         st->st_mode  = S_IFREG | 0644;
     }
+
+    /* Snapshot contents are read-only */
+    if (imap != g_state.inode_map)
+        st->st_mode &= ~(mode_t)0222;
     return 0;
 }
 
@@ -287,17 +551,37 @@ static int lfs_readdir(const char *path, void *buf,
 {
     (void)off; (void)fi; (void)flags;
 
-    int ino = path_to_inode(path);
+    const uint32_t *imap;
+    int ino = path_resolve(path, &imap);
     if (ino < 0) return ino;
 
+    filler(buf, ".",  NULL, 0, 0);
+    filler(buf, "..", NULL, 0, 0);
+
+    if (ino == SNAPDIR_INO) {
+        for (int s = 0; s < LFS_MAX_SNAPSHOTS; s++) {
+            if (g_state.sb.snap[s].imap_block != 0)
+                filler(buf, g_state.sb.snap[s].name, NULL, 0, 0);
+        }
+        return 0;
+    }
+    if (ino == CTLDIR_INO) {
+        filler(buf, "stats", NULL, 0, 0);
+        filler(buf, "trace", NULL, 0, 0);
+        return 0;
+    }
+    if (IS_CTL_FILE(ino)) return -ENOTDIR;
+
     struct lfs_inode dir_inode;
-    if (inode_read(&g_state, (uint32_t)ino, &dir_inode) != 0)
+    if (inode_read_map(imap, (uint32_t)ino, &dir_inode) != 0)
         return -EIO;
     if (dir_inode.type != INODE_TYPE_DIR)
         return -ENOTDIR;
 
-    filler(buf, ".",  NULL, 0, 0);
-    filler(buf, "..", NULL, 0, 0);
+    if (strcmp(path, "/") == 0) {
+        filler(buf, LFS_SNAPDIR_NAME, NULL, 0, 0);
+        filler(buf, LFS_CTLDIR_NAME, NULL, 0, 0);
+    }
 
     uint8_t dbuf[BLOCK_SIZE];
     if (disk_read(dir_inode.direct[0], dbuf) != 0)
@@ -316,28 +600,208 @@ static int lfs_readdir(const char *path, void *buf,
     return 0;
 }
 
-static int lfs_read(const char *path, char *buf, size_t size,
-                    off_t offset, struct fuse_file_info *fi)
+/*
+ * Look up the data pointers of 'n' consecutive logical blocks of
+ * 'inode' starting at 'first'.  Holes come back as 0.
+ */
+static int file_block_ptrs(const struct lfs_inode *inode, uint32_t first,
+                           uint32_t n, uint32_t *out)
 {
-    (void)fi;
+    uint32_t indirect_ptrs[PTRS_PER_BLOCK];
+    int indirect_loaded = 0;
 
-    int ino = path_to_inode(path);
-    if (ino < 0) return ino;
+    for (uint32_t i = 0; i < n; i++) {
+        uint32_t blk = first + i;
+        out[i] = 0;
+        if (blk < MAX_DIRECT_PTRS) {
+            out[i] = inode->direct[blk];
+        } else if (blk < MAX_FILE_BLOCKS && inode->indirect != 0) {
+            if (!indirect_loaded) {
+                if (disk_read(inode->indirect, indirect_ptrs) != 0)
+                    return -EIO;
+                indirect_loaded = 1;
+            }
+            out[i] = indirect_ptrs[blk - MAX_DIRECT_PTRS];
+        }
+    }
+    return 0;
+}
 
+/* ------------------------------------------------------------------ */
+/*  Open file handles                                                   */
+/* ------------------------------------------------------------------ */
+
+/*
+ * Per-open-file state, kept in fi->fh from open/create to release.
+ *
+ * The inode and its indirect block are cached across calls.  They
+ * stay valid while the inode map still names the same inode block and
+ * no GC pass has rewritten blocks in place since (gc_epoch); anything
+ * else that changes the file appends a new inode, so a stale copy is
+ * always noticed.  Calls without a handle build one on the stack.
+ */
+struct lfs_handle {
+    uint32_t         ino;
+    const uint32_t  *imap;        /* live map or a snapshot's          */
+    uint32_t         gen;         /* ino_gen[ino] at open              */
+    uint32_t         iblk;        /* imap[ino] when cached, 0 = none   */
+    uint32_t         epoch;       /* g_state.gc_epoch when cached      */
+    int              ind_valid;
     struct lfs_inode inode;
-    if (inode_read(&g_state, (uint32_t)ino, &inode) != 0)
+    uint32_t         ind[PTRS_PER_BLOCK];
+    struct lfs_ra    ra;          /* sequential readahead stream       */
+    uint8_t         *blk;         /* aligned block buffer, may be NULL */
+    char            *ctl;         /* control file contents, or NULL    */
+    size_t           ctl_len;
+};
+
+static void handle_init(struct lfs_handle *h, const uint32_t *imap,
+                        uint32_t ino)
+{
+    h->ino       = ino;
+    h->imap      = imap;
+    h->gen       = ino_gen[ino];
+    h->iblk      = 0;
+    h->epoch     = 0;
+    h->ind_valid = 0;
+    memset(&h->ra, 0, sizeof(h->ra));
+    h->blk       = NULL;
+    h->ctl       = NULL;
+    h->ctl_len   = 0;
+}
+
+static struct lfs_handle *handle_of(struct fuse_file_info *fi)
+{
+    return fi ? (struct lfs_handle *)(uintptr_t)fi->fh : NULL;
+}
+
+/* Make h->inode current.  Returns 0 or -errno. */
+static int handle_inode(struct lfs_handle *h)
+{
+    if (h->imap == g_state.inode_map && h->gen != ino_gen[h->ino])
+        return -ENOENT;               /* unlinked, number reused    */
+    uint32_t iblk = h->imap[h->ino];
+    if (iblk == 0) return -ENOENT;
+    if (iblk == h->iblk && h->epoch == g_state.gc_epoch) return 0;
+
+    if (inode_read_map(h->imap, h->ino, &h->inode) != 0) return -EIO;
+    h->iblk      = iblk;
+    h->epoch     = g_state.gc_epoch;
+    h->ind_valid = 0;
+    return 0;
+}
+
+/* Make h->ind current (all zero without an indirect block) */
+static int handle_indirect(struct lfs_handle *h)
+{
+    if (h->ind_valid) return 0;
+    memset(h->ind, 0, sizeof(h->ind));
+    if (h->inode.indirect != 0 && disk_read(h->inode.indirect, h->ind) != 0)
         return -EIO;
-    if (inode.type != INODE_TYPE_FILE)
+    h->ind_valid = 1;
+    return 0;
+}
+
+/* Data pointer of logical block 'blk'; h->ind must be loaded past the
+ * direct range */
+static uint32_t handle_ptr(const struct lfs_handle *h, uint32_t blk)
+{
+    if (blk < MAX_DIRECT_PTRS) return h->inode.direct[blk];
+    if (blk < MAX_FILE_BLOCKS) return h->ind[blk - MAX_DIRECT_PTRS];
+    return 0;
+}
+
+/* Buffered state of the live file behind 'h', or NULL */
+static struct wb_file *wb_of(const struct lfs_handle *h)
+{
+    return h->imap == g_state.inode_map ? wb_files[h->ino] : NULL;
+}
+
+/* Slot holding logical block 'blk', or -1 */
+static int wb_find(const struct wb_file *wb, uint32_t blk)
+{
+    for (uint32_t i = 0; i < wb->n; i++)
+        if (wb->idx[i] == blk) return (int)i;
+    return -1;
+}
+
+/*
+ * Note a read of logical blocks [first, first + n) through 'h', 'hits'
+ * of them served by earlier prefetches, and queue the next window.
+ * The indirect block is queued one window before the reader crosses
+ * into the range it maps, so loading it finds it cached.
+ */
+static void file_readahead(struct lfs_handle *h, uint32_t first,
+                           uint32_t n, uint32_t hits)
+{
+    if (disk_map_block(0)) return;
+
+    uint32_t from;
+    int count = ra_window(&h->ra, first, n, hits, &from);
+
+    uint32_t nblocks = (uint32_t)((h->inode.size + BLOCK_SIZE - 1)
+                                  / BLOCK_SIZE);
+    if (count <= 0 || from >= nblocks) return;
+    if (from + (uint32_t)count > nblocks) count = (int)(nblocks - from);
+
+    uint32_t blocks[LFS_RA_MAX + 1];
+    uint32_t nb = 0;
+
+    uint32_t end = from + (uint32_t)count;
+    if (h->inode.indirect != 0 && !h->ind_valid &&
+        end + (uint32_t)count > MAX_DIRECT_PTRS) {
+        if (!cache_contains(h->inode.indirect)) {
+            blocks[nb++] = h->inode.indirect;
+            if (end > MAX_DIRECT_PTRS) {
+                /* Data behind it waits for the next window */
+                count = from < MAX_DIRECT_PTRS
+                        ? (int)(MAX_DIRECT_PTRS - from) : 0;
+                h->ra.ra_end = from + (uint32_t)count;
+            }
+        } else if (end > MAX_DIRECT_PTRS && handle_indirect(h) != 0) {
+            return;
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        uint32_t blk = LFS_PTR_BLOCK(handle_ptr(h, from + (uint32_t)i));
+        if (blk == 0 || (nb > 0 && blocks[nb - 1] == blk)) continue;
+        blocks[nb++] = blk;
+    }
+    ra_submit(blocks, nb);
+}
+
+/*
+ * Read up to 'size' bytes at 'offset' from the file behind 'h'.
+ * Returns bytes read or -errno.
+ */
+static int file_read(struct lfs_handle *h, char *buf, size_t size,
+                     off_t offset)
+{
+    int r = handle_inode(h);
+    if (r != 0) return r;
+    if (h->inode.type != INODE_TYPE_FILE)
         return -EISDIR;
 
-    if (offset >= (off_t)inode.size) return 0;
-    if (offset + (off_t)size > (off_t)inode.size)
-        size = inode.size - offset;
+    const struct wb_file *wb = wb_of(h);
+    uint32_t fsize = h->inode.size;
+    if (wb && wb->size > fsize) fsize = wb->size;
 
-    /* Cache the indirect block if we'll need it */
-    uint32_t indirect_ptrs[PTRS_PER_BLOCK];
-    int indirect_loaded = 0;
+    if (offset >= (off_t)fsize) return 0;
+    if (offset + (off_t)size > (off_t)fsize)
+        size = fsize - offset;
+
+    uint32_t first = (uint32_t)(offset / BLOCK_SIZE);
+    uint32_t last  = (uint32_t)((offset + (off_t)size - 1) / BLOCK_SIZE);
+    if (last >= MAX_DIRECT_PTRS && handle_indirect(h) != 0)
+        return -EIO;
+
+    /* Aligned, so O_DIRECT reads need no bounce copy */
+    uint8_t *data = h->blk ? h->blk : disk_buf_get();
+    if (!data) return -ENOMEM;
 
+    uint32_t prev_blk = 0;
+    uint64_t ra_hits0 = cache_ra_hits();
     size_t bytes_read = 0;
     while (bytes_read < size) {
         uint32_t block_idx = (uint32_t)((offset + bytes_read) / BLOCK_SIZE);
@@ -346,51 +810,289 @@ static int lfs_read(const char *path, char *buf, size_t size,
         size_t chunk = BLOCK_SIZE - block_off;
         if (chunk > size - bytes_read) chunk = size - bytes_read;
 
-        /* Resolve block_idx to a physical block number */
-        uint32_t phys_blk = 0;
-        if (block_idx < MAX_DIRECT_PTRS) {
-            phys_blk = inode.direct[block_idx];
-        } else {
-            /* Indirect region: index into the indirect block */
-            uint32_t ind_idx = block_idx - MAX_DIRECT_PTRS;
-            if (inode.indirect != 0) {
-                if (!indirect_loaded) {
-                    memset(indirect_ptrs, 0, sizeof(indirect_ptrs));
-                    disk_read(inode.indirect, indirect_ptrs);
-                    indirect_loaded = 1;
-                }
-                phys_blk = indirect_ptrs[ind_idx];
+        /* Buffered, not yet in the log */
+        int slot = wb ? wb_find(wb, block_idx) : -1;
+        if (slot >= 0) {
+            memcpy(buf + bytes_read,
+                   wb->data + (size_t)slot * BLOCK_SIZE + block_off, chunk);
+            bytes_read += chunk;
+            continue;
+        }
+
+        uint32_t phys_blk = handle_ptr(h, block_idx);
+
+        /*
+         * Mapped image: copy raw blocks straight out of the mapping,
+         * hinting each physically contiguous run once.
+         */
+        const uint8_t *mapped = NULL;
+        if (phys_blk != 0 && !(phys_blk & LFS_PTR_PACKED) &&
+            !g_state.data_csum)
+            mapped = disk_map_block(phys_blk);
+        if (mapped) {
+            if (phys_blk != prev_blk + 1) {
+                size_t left = block_off + (size - bytes_read);
+                disk_prefetch(phys_blk,
+                              (uint32_t)((left + BLOCK_SIZE - 1) / BLOCK_SIZE));
             }
+            prev_blk = phys_blk;
+            memcpy(buf + bytes_read, mapped + block_off, chunk);
+            bytes_read += chunk;
+            continue;
         }
 
-        uint8_t data[BLOCK_SIZE];
         memset(data, 0, BLOCK_SIZE);
-        if (phys_blk != 0)
-            disk_read(phys_blk, data);
+        if (phys_blk != 0 && log_read_data(&g_state, phys_blk, data) != 0) {
+            if (data != h->blk) disk_buf_put(data);
+            return -EIO;
+        }
 
         memcpy(buf + bytes_read, data + block_off, chunk);
         bytes_read += chunk;
     }
+    if (data != h->blk) disk_buf_put(data);
 
+    file_readahead(h, first, last - first + 1,
+                   (uint32_t)(cache_ra_hits() - ra_hits0));
     return (int)bytes_read;
 }
 
-static int lfs_open(const char *path, struct fuse_file_info *fi)
+/* Copy part of a control file's contents (see ctl_parse) */
+static int ctl_read(const char *text, size_t len, char *buf, size_t size,
+                    off_t offset)
 {
-    (void)path;
-    if (fi) fi->direct_io = 1;
+    if (offset >= (off_t)len) return 0;
+    if (size > len - (size_t)offset) size = len - (size_t)offset;
+    memcpy(buf, text + offset, size);
+    return (int)size;
+}
+
+static int lfs_read(const char *path, char *buf, size_t size,
+                    off_t offset, struct fuse_file_info *fi)
+{
+    struct lfs_handle *h = handle_of(fi);
+    if (h && h->ctl) return ctl_read(h->ctl, h->ctl_len, buf, size, offset);
+    if (h) return file_read(h, buf, size, offset);
+
+    const uint32_t *imap;
+    int ino = path_resolve(path, &imap);
+    if (ino < 0) return ino;
+    if (IS_CTL_FILE(ino)) {
+        size_t len;
+        char *text = ctl_text(ino, &len);
+        if (!text) return -ENOMEM;
+        int r = ctl_read(text, len, buf, size, offset);
+        free(text);
+        return r;
+    }
+    if (ino == SNAPDIR_INO || ino == CTLDIR_INO) return -EISDIR;
+
+    struct lfs_handle tmp;
+    handle_init(&tmp, imap, (uint32_t)ino);
+    return file_read(&tmp, buf, size, offset);
+}
+
+/* Free a reply vector built by lfs_read_buf (as libfuse would) */
+static void free_bufvec(struct fuse_bufvec *bv)
+{
+    for (size_t i = 0; i < bv->count; i++)
+        if (!(bv->buf[i].flags & FUSE_BUF_IS_FD))
+            free(bv->buf[i].mem);
+    free(bv);
+}
+
+/* A read_buf reply copied into one memory buffer by lfs_read */
+static int read_copy(const char *path, struct fuse_bufvec **bufp,
+                     size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    struct fuse_bufvec *bv = calloc(1, sizeof(*bv));
+    char *mem = malloc(size ? size : 1);
+    if (!bv || !mem) {
+        free(bv); free(mem);
+        return -ENOMEM;
+    }
+    int r = lfs_read(path, mem, size, offset, fi);
+    if (r < 0) {
+        free(bv); free(mem);
+        return r;
+    }
+    bv->count       = 1;
+    bv->buf[0].mem  = mem;
+    bv->buf[0].size = (size_t)r;
+    bv->buf[0].fd   = -1;
+    *bufp = bv;
+    return 0;
+}
+
+/*
+ * lfs_read_buf — zero-copy read.
+ *
+ * Instead of copying blocks into a reply buffer, describe the reply as
+ * (image fd, offset, length) ranges, one per physically contiguous run
+ * of raw blocks.  libfuse can then splice straight from lfs.img into
+ * /dev/fuse without the daemon touching the bytes.  Holes and
+ * compressed records still go through a memory buffer, as does every
+ * block when data checksums must be verified.  libfuse frees
+ * the vector and its memory buffers after replying.
+ */
+static int lfs_read_buf(const char *path, struct fuse_bufvec **bufp,
+                        size_t size, off_t offset,
+                        struct fuse_file_info *fi)
+{
+    struct lfs_handle tmp, *h = handle_of(fi);
+    if (h && h->ctl) return read_copy(path, bufp, size, offset, fi);
+    if (!h) {
+        const uint32_t *imap;
+        int ino = path_resolve(path, &imap);
+        if (ino < 0) return ino;
+        if (IS_CTL_FILE(ino)) return read_copy(path, bufp, size, offset, fi);
+        if (ino == SNAPDIR_INO || ino == CTLDIR_INO) return -EISDIR;
+        handle_init(&tmp, imap, (uint32_t)ino);
+        h = &tmp;
+    }
+
+    int r = handle_inode(h);
+    if (r != 0) return r;
+    if (h->inode.type != INODE_TYPE_FILE)
+        return -EISDIR;
+
+    /* Buffered writes exist only in memory: copy the reply */
+    if (wb_of(h)) return read_copy(path, bufp, size, offset, fi);
+
+    if (offset >= (off_t)h->inode.size) size = 0;
+    else if (offset + (off_t)size > (off_t)h->inode.size)
+        size = h->inode.size - offset;
+
+    uint32_t first = (uint32_t)(offset / BLOCK_SIZE);
+    uint32_t n     = size ? (uint32_t)((offset + size - 1) / BLOCK_SIZE)
+                            - first + 1 : 0;
+
+    struct fuse_bufvec *bv = calloc(1, sizeof(*bv) +
+                                       (n + 1) * sizeof(struct fuse_buf));
+    if (!bv) return -ENOMEM;
+    if (first + n > MAX_DIRECT_PTRS && handle_indirect(h) != 0) {
+        free(bv);
+        return -EIO;
+    }
+
+    int    fd   = disk_get_fd();
+    size_t done = 0;
+    uint8_t data[BLOCK_SIZE];
+    uint64_t ra_hits0 = cache_ra_hits();
+
+    for (uint32_t i = 0; i < n; i++) {
+        uint32_t boff  = (uint32_t)((offset + (off_t)done) % BLOCK_SIZE);
+        size_t   chunk = BLOCK_SIZE - boff;
+        if (chunk > size - done) chunk = size - done;
+
+        uint32_t ptr = handle_ptr(h, first + i);
+        struct fuse_buf *cur = bv->count ? &bv->buf[bv->count - 1] : NULL;
+
+        if (ptr != 0 && !(ptr & LFS_PTR_PACKED) && !g_state.data_csum &&
+            !disk_is_direct()) {
+            /* Raw block: extend the current fd range if contiguous */
+            off_t pos = (off_t)ptr * BLOCK_SIZE + boff;
+            if (cur && (cur->flags & FUSE_BUF_IS_FD) &&
+                cur->pos + (off_t)cur->size == pos) {
+                cur->size += chunk;
+            } else {
+                cur = &bv->buf[bv->count++];
+                cur->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+                cur->fd    = fd;
+                cur->pos   = pos;
+                cur->size  = chunk;
+            }
+        } else {
+            /*
+             * Hole, compressed record, a block that must be verified
+             * against its checksum, or an O_DIRECT image (libfuse's
+             * copies are not aligned): materialise in memory.
+             */
+            memset(data, 0, BLOCK_SIZE);
+            if (ptr != 0 && log_read_data(&g_state, ptr, data) != 0) {
+                free_bufvec(bv);
+                return -EIO;
+            }
+            if (!cur || (cur->flags & FUSE_BUF_IS_FD)) {
+                cur = &bv->buf[bv->count++];
+                cur->fd = -1;
+            }
+            uint8_t *mem = realloc(cur->mem, cur->size + chunk);
+            if (!mem) {
+                free_bufvec(bv);
+                return -ENOMEM;
+            }
+            memcpy(mem + cur->size, data + boff, chunk);
+            cur->mem   = mem;
+            cur->size += chunk;
+        }
+        done += chunk;
+    }
+
+    /* fd ranges are read ahead by the host; memory copies by us */
+    if (disk_is_direct() || g_state.data_csum)
+        file_readahead(h, first, n, (uint32_t)(cache_ra_hits() - ra_hits0));
+
+    if (bv->count == 0) {             /* EOF: one empty buffer */
+        bv->count  = 1;
+        bv->buf[0].fd = -1;
+    }
+    *bufp = bv;
+    return 0;
+}
+
+/* Attach a handle for inode 'ino' of 'imap' to 'fi' */
+static int handle_open(struct fuse_file_info *fi, const uint32_t *imap,
+                       uint32_t ino)
+{
+    struct lfs_handle *h = malloc(sizeof(*h));
+    if (!h) return -ENOMEM;
+    handle_init(h, imap, ino);
+    h->blk = disk_alloc(BLOCK_SIZE);  /* optional: NULL falls back */
+    fi->fh = (uint64_t)(uintptr_t)h;
+    return 0;
+}
+
+/* A control file is generated once per open, so reads are consistent */
+static int ctl_open(struct fuse_file_info *fi, int ino)
+{
+    struct lfs_handle *h = calloc(1, sizeof(*h));
+    if (!h) return -ENOMEM;
+    h->ino = (uint32_t)ino;
+    h->ctl = ctl_text(ino, &h->ctl_len);
+    if (!h->ctl) {
+        free(h);
+        return -ENOMEM;
+    }
+    fi->fh = (uint64_t)(uintptr_t)h;
     return 0;
 }
 
+static int lfs_open(const char *path, struct fuse_file_info *fi)
+{
+    if (fi && (fi->flags & O_ACCMODE) != O_RDONLY &&
+        is_readonly_path(path))
+        return -EROFS;
+    if (!fi) return 0;
+    fi->direct_io = 1;
+
+    const uint32_t *imap;
+    int ino = path_resolve(path, &imap);
+    if (ino < 0) return ino;
+    if (IS_CTL_FILE(ino)) return ctl_open(fi, ino);
+    if (ino == SNAPDIR_INO || ino == CTLDIR_INO) return -EISDIR;
+    return handle_open(fi, imap, (uint32_t)ino);
+}
+
 static int lfs_create(const char *path, mode_t mode,
                       struct fuse_file_info *fi)
 {
     (void)mode;
     if (fi) fi->direct_io = 1;
 
-    printf("lfs_create: path=%s log_tail=%u free=%u\n",
-           path, g_state.log_tail,
-           g_state.sb.total_blocks - g_state.log_tail);
+    if (strcmp(path, SNAPDIR_PATH) == 0 || ctl_parse(path) > 0)
+        return -EEXIST;
+    if (is_readonly_path(path)) return -EROFS;
 
     char parent_path[4096];
     char name[MAX_NAME_LEN];
@@ -405,11 +1107,8 @@ static int lfs_create(const char *path, mode_t mode,
     if (path_to_inode(path) != -ENOENT)
         return -EEXIST;
 
-    if (gc_should_run(&g_state)) {
-        printf("lfs_create: GC triggered! free=%u\n",
-               g_state.sb.total_blocks - g_state.log_tail);
+    if (gc_should_run(&g_state))
         gc_collect(&g_state);
-    }
 
     int ino = inode_alloc(&g_state);
     if (ino < 0) return -ENOSPC;
@@ -425,51 +1124,104 @@ static int lfs_create(const char *path, mode_t mode,
     int r = dir_add_entry((uint32_t)parent_ino, (uint32_t)ino, name);
     if (r != 0) return r;
 
-    printf("lfs_create: done ino=%d parent=%d log_tail=%u\n",
-           ino, parent_ino, g_state.log_tail);
-    return log_checkpoint(&g_state);
+    if ((r = commit_op()) != 0) return r;
+    return fi ? handle_open(fi, g_state.inode_map, (uint32_t)ino) : 0;
 }
 
-static int lfs_write(const char *path, const char *buf, size_t size,
-                     off_t offset, struct fuse_file_info *fi)
+/*
+ * Append new contents for logical blocks idx[0..n) of the file behind
+ * 'h' (block i of 'blocks' holds idx[i]), then the indirect block if it
+ * changed and the inode, which grows to 'end' bytes if it is shorter.
+ * Returns 0 or -errno.
+ */
+static int file_store(struct lfs_handle *h, const uint32_t *idx,
+                      const uint8_t *blocks, uint32_t n, uint32_t end)
 {
-    (void)fi;
-
-    printf("lfs_write: path=%s size=%zu offset=%ld log_tail=%u free=%u\n",
-           path, size, offset, g_state.log_tail,
-           g_state.sb.total_blocks - g_state.log_tail);
+    int r = handle_inode(h);
+    if (r != 0) return r;
+    struct lfs_inode *inode = &h->inode;
+    uint32_t ino = h->ino;
+
+    int indirect_dirty = 0;
+    for (uint32_t i = 0; i < n; i++)
+        if (idx[i] >= MAX_DIRECT_PTRS && handle_indirect(h) != 0)
+            return -EIO;
+
+    uint32_t *ptrs = malloc(n * sizeof(uint32_t));
+    if (!ptrs) return -ENOMEM;
+
+    r = log_append_data(&g_state, ino, idx, blocks, n, ptrs);
+    if (r == 0) {
+        for (uint32_t i = 0; i < n; i++) {
+            if (idx[i] < MAX_DIRECT_PTRS) {
+                inode->direct[idx[i]] = ptrs[i];
+            } else {
+                h->ind[idx[i] - MAX_DIRECT_PTRS] = ptrs[i];
+                indirect_dirty = 1;
+            }
+        }
+    }
+    free(ptrs);
+    if (r != 0) return -ENOSPC;
 
-    int ino = path_to_inode(path);
-    if (ino < 0) return ino;
+    /*
+     * h->inode and h->ind now run ahead of the disk; until the new
+     * inode is written they must not be trusted again.
+     */
+    h->iblk = 0;
 
-    struct lfs_inode inode;
-    if (inode_read(&g_state, (uint32_t)ino, &inode) != 0)
-        return -EIO;
-    if (inode.type != INODE_TYPE_FILE)
-        return -EISDIR;
+    /* Write back the indirect block if it was modified */
+    if (indirect_dirty) {
+        int new_ind = log_append_ex(&g_state, h->ind,
+                                    ino, MAX_DIRECT_PTRS, LFS_BLK_INDIRECT);
+        if (new_ind < 0) return -ENOSPC;
+        inode->indirect = (uint32_t)new_ind;
+    }
 
-    off_t max_size = (off_t)MAX_FILE_BLOCKS * BLOCK_SIZE;
-    if (offset >= max_size) return -EFBIG;
-    if (offset + (off_t)size > max_size)
-        size = (size_t)(max_size - offset);
+    if (end > inode->size) inode->size = end;
+
+    if (inode_write(&g_state, inode) != 0) return -EIO;
+    h->iblk = g_state.inode_map[ino];
+    return 0;
+}
+
+/*
+ * Write 'size' bytes at 'offset' into the file behind 'h' and append
+ * the updated inode.  Does not checkpoint.  Returns bytes written (may
+ * be short at the maximum file size) or -errno.
+ */
+static int file_write(struct lfs_handle *h, const char *buf, size_t size,
+                      off_t offset)
+{
+    int r = handle_inode(h);
+    if (r != 0) return r;
+    if (h->inode.type != INODE_TYPE_FILE)
+        return -EISDIR;
+
+    off_t max_size = (off_t)MAX_FILE_BLOCKS * BLOCK_SIZE;
+    if (size == 0) return 0;
+    if (offset >= max_size) return -EFBIG;
+    if (offset + (off_t)size > max_size)
+        size = (size_t)(max_size - offset);
 
     uint32_t first_blk = (uint32_t)(offset / BLOCK_SIZE);
     uint32_t last_blk  = (uint32_t)((offset + size - 1) / BLOCK_SIZE);
 
+    /* Partial blocks past the direct range need the indirect block */
+    if (last_blk >= MAX_DIRECT_PTRS && handle_indirect(h) != 0)
+        return -EIO;
+
     /*
-     * Load the indirect block once if any touched block is in
-     * the indirect region.  We'll write it back at the end if dirty.
+     * Build the new contents of every touched block first, then hand
+     * them to the log in one batch so compressed blocks can be packed
+     * together.
      */
-    uint32_t indirect_ptrs[PTRS_PER_BLOCK];
-    int indirect_loaded = 0;
-    int indirect_dirty  = 0;
-
-    if (last_blk >= MAX_DIRECT_PTRS) {
-        memset(indirect_ptrs, 0, sizeof(indirect_ptrs));
-        if (inode.indirect != 0) {
-            disk_read(inode.indirect, indirect_ptrs);
-        }
-        indirect_loaded = 1;
+    uint32_t nblk    = last_blk - first_blk + 1;
+    uint8_t  *blocks = disk_alloc((size_t)nblk * BLOCK_SIZE);
+    uint32_t *idx    = malloc(nblk * sizeof(uint32_t));
+    if (!blocks || !idx) {
+        free(blocks); free(idx);
+        return -ENOMEM;
     }
 
     for (uint32_t blk = first_blk; blk <= last_blk; blk++) {
@@ -485,61 +1237,475 @@ static int lfs_write(const char *path, const char *buf, size_t size,
         uint32_t buf_off = write_start - (uint32_t)offset;
         uint32_t chunk   = write_end - write_start;
 
-        /* Read existing block content */
-        uint8_t data[BLOCK_SIZE];
-        memset(data, 0, BLOCK_SIZE);
+        uint8_t *data = blocks + (size_t)(blk - first_blk) * BLOCK_SIZE;
 
-        uint32_t phys_blk = 0;
-        if (blk < MAX_DIRECT_PTRS) {
-            phys_blk = inode.direct[blk];
-        } else {
-            phys_blk = indirect_ptrs[blk - MAX_DIRECT_PTRS];
+        /*
+         * Only a partial head/tail block needs its old contents; a
+         * block covered entirely by this write is simply replaced.
+         */
+        if (chunk < BLOCK_SIZE) {
+            memset(data, 0, BLOCK_SIZE);
+
+            uint32_t phys_blk = handle_ptr(h, blk);
+            if (phys_blk != 0 &&
+                log_read_data(&g_state, phys_blk, data) != 0) {
+                free(blocks); free(idx);
+                return -EIO;
+            }
         }
-        if (phys_blk != 0)
-            disk_read(phys_blk, data);
 
         memcpy(data + blk_off, buf + buf_off, chunk);
+        idx[blk - first_blk] = blk;
+    }
+
+    r = file_store(h, idx, blocks, nblk, (uint32_t)(offset + size));
+    free(blocks); free(idx);
+    return r < 0 ? r : (int)size;
+}
+
+/* ------------------------------------------------------------------ */
+/*  Write-back buffering                                                */
+/* ------------------------------------------------------------------ */
+
+/*
+ * Writes land in a per-file buffer of up to wb_file_blocks blocks
+ * instead of the log, so repeated small writes to one block cost one
+ * log block, and one inode, per flush rather than per call.  A file is
+ * flushed on close (flush/release), fsync, and when its buffer is
+ * full; every file is flushed when wb_max_blocks are held in
+ * total, at unmount and before a snapshot is taken.  Like the host
+ * page cache, unflushed data is lost in a crash, so LFS_SYNC_FULL
+ * writes through.
+ */
+static int wb_enabled(void)
+{
+    return opts.wb_file_blocks > 0 && g_state.sync_mode != LFS_SYNC_FULL;
+}
+
+/* Forget the buffered blocks of 'ino' */
+static void wb_drop(uint32_t ino)
+{
+    struct wb_file *wb = wb_files[ino];
+    if (!wb) return;
+    wb_blocks -= wb->n;
+    free(wb->idx);
+    free(wb->data);
+    free(wb);
+    wb_files[ino] = NULL;
+}
+
+/*
+ * Append the buffered blocks of 'ino', in logical order, and one new
+ * inode.  Does not checkpoint.  Returns 0 or -errno; on failure the
+ * data stays buffered.
+ */
+static int wb_flush(uint32_t ino)
+{
+    struct wb_file *wb = wb_files[ino];
+    if (!wb) return 0;
+
+    /* Order slots by logical block so the file lands contiguously */
+    uint32_t *order = malloc(wb->n * sizeof(uint32_t));
+    uint32_t *idx   = malloc(wb->n * sizeof(uint32_t));
+    struct lfs_handle *h = malloc(sizeof(*h));
+    if (!order || !idx || !h) {
+        free(order); free(idx); free(h);
+        return -ENOMEM;
+    }
+    int sorted = 1;
+    for (uint32_t i = 0; i < wb->n; i++) {
+        uint32_t j = i;
+        while (j > 0 && wb->idx[order[j - 1]] > wb->idx[i]) {
+            order[j] = order[j - 1];
+            j--;
+            sorted = 0;
+        }
+        order[j] = i;
+    }
+
+    const uint8_t *data = wb->data;
+    uint8_t *gather = NULL;
+    if (!sorted) {
+        gather = disk_alloc((size_t)wb->n * BLOCK_SIZE);
+        if (!gather) {
+            free(order); free(idx); free(h);
+            return -ENOMEM;
+        }
+        for (uint32_t i = 0; i < wb->n; i++)
+            memcpy(gather + (size_t)i * BLOCK_SIZE,
+                   wb->data + (size_t)order[i] * BLOCK_SIZE, BLOCK_SIZE);
+        data = gather;
+    }
+    for (uint32_t i = 0; i < wb->n; i++)
+        idx[i] = wb->idx[order[i]];
+
+    handle_init(h, g_state.inode_map, ino);
+    int r = file_store(h, idx, data, wb->n, wb->size);
+    free(order); free(idx); free(h); free(gather);
+
+    if (r == 0) wb_drop(ino);
+    return r;
+}
+
+static int wb_flush_all(void)
+{
+    int err = 0;
+    for (uint32_t ino = 0; ino < INODE_MAP_SIZE; ino++) {
+        int r = wb_flush(ino);
+        if (r != 0 && err == 0) err = r;
+    }
+    return err;
+}
+
+/*
+ * Write 'size' bytes at 'offset' into the file behind 'h' through its
+ * write-back buffer.  A write bigger than the buffer gains nothing from
+ * it and goes to file_write once the buffer is flushed.  Returns bytes
+ * written or -errno.
+ */
+static int wb_write(struct lfs_handle *h, const char *buf, size_t size,
+                    off_t offset)
+{
+    if (!wb_enabled()) return file_write(h, buf, size, offset);
+
+    int r = handle_inode(h);
+    if (r != 0) return r;
+    if (h->inode.type != INODE_TYPE_FILE)
+        return -EISDIR;
+
+    off_t max_size = (off_t)MAX_FILE_BLOCKS * BLOCK_SIZE;
+    if (size == 0) return 0;
+    if (offset >= max_size) return -EFBIG;
+    if (offset + (off_t)size > max_size)
+        size = (size_t)(max_size - offset);
+
+    uint32_t first_blk = (uint32_t)(offset / BLOCK_SIZE);
+    uint32_t last_blk  = (uint32_t)((offset + size - 1) / BLOCK_SIZE);
+
+    struct wb_file *wb = wb_files[h->ino];
+    uint32_t need = 0;
+    for (uint32_t blk = first_blk; blk <= last_blk; blk++)
+        if (!wb || wb_find(wb, blk) < 0) need++;
+
+    if (need > opts.wb_file_blocks) {
+        if ((r = wb_flush(h->ino)) != 0) return r;
+        return file_write(h, buf, size, offset);
+    }
+    if (wb && wb->n + need > opts.wb_file_blocks) {
+        if ((r = wb_flush(h->ino)) != 0) return r;
+        if ((r = handle_inode(h)) != 0) return r;
+        wb = NULL;
+    }
+    if (!wb) {
+        wb = calloc(1, sizeof(*wb));
+        if (wb) {
+            wb->idx  = malloc(opts.wb_file_blocks * sizeof(uint32_t));
+            wb->data = disk_alloc((size_t)opts.wb_file_blocks * BLOCK_SIZE);
+        }
+        if (!wb || !wb->idx || !wb->data) {
+            if (wb) { free(wb->idx); free(wb->data); free(wb); }
+            return -ENOMEM;
+        }
+        wb->size = h->inode.size;
+        wb_files[h->ino] = wb;
+    }
+
+    /* Partial blocks past the direct range need the indirect block */
+    if (last_blk >= MAX_DIRECT_PTRS && handle_indirect(h) != 0)
+        return -EIO;
+
+    for (uint32_t blk = first_blk; blk <= last_blk; blk++) {
+        uint32_t blk_start = blk * BLOCK_SIZE;
+        uint32_t blk_end   = blk_start + BLOCK_SIZE;
+
+        uint32_t write_start = (uint32_t)offset > blk_start
+                               ? (uint32_t)offset : blk_start;
+        uint32_t write_end   = (uint32_t)(offset + size) < blk_end
+                               ? (uint32_t)(offset + size) : blk_end;
+        uint32_t chunk = write_end - write_start;
+
+        int slot = wb_find(wb, blk);
+        if (slot < 0) {
+            slot = (int)wb->n++;
+            wb->idx[slot] = blk;
+            wb_blocks++;
+
+            /* A new partial block starts from its current contents */
+            uint8_t *data = wb->data + (size_t)slot * BLOCK_SIZE;
+            if (chunk < BLOCK_SIZE) {
+                memset(data, 0, BLOCK_SIZE);
+                uint32_t phys_blk = handle_ptr(h, blk);
+                if (phys_blk != 0 &&
+                    log_read_data(&g_state, phys_blk, data) != 0) {
+                    wb->n--;
+                    wb_blocks--;
+                    return -EIO;
+                }
+            }
+        }
+        memcpy(wb->data + (size_t)slot * BLOCK_SIZE
+                        + (write_start - blk_start),
+               buf + (write_start - (uint32_t)offset), chunk);
+    }
+
+    uint32_t new_end = (uint32_t)(offset + size);
+    if (new_end > wb->size) wb->size = new_end;
+
+    /* Memory pressure: push everything out */
+    if (wb_blocks > opts.wb_max_blocks && (r = wb_flush_all()) != 0)
+        return r;
+    return (int)size;
+}
+
+/*
+ * Flush 'ino' (every file when 'ino' is negative) and checkpoint if
+ * anything reached the log.  Returns 0 or -errno.
+ */
+static int wb_sync(int ino)
+{
+    uint64_t seq = g_state.append_seq;
+    int r = ino < 0 ? wb_flush_all() : wb_flush((uint32_t)ino);
+    if (r != 0) return r;
+    if (g_state.append_seq != seq) return commit_op();
+    return 0;
+}
+
+static int lfs_write(const char *path, const char *buf, size_t size,
+                     off_t offset, struct fuse_file_info *fi)
+{
+    if (is_readonly_path(path)) return -EROFS;
+
+    struct lfs_handle tmp, *h = handle_of(fi);
+    if (!h) {
+        int ino = path_to_inode(path);
+        if (ino < 0) return ino;
+        handle_init(&tmp, g_state.inode_map, (uint32_t)ino);
+        h = &tmp;
+    }
+
+    uint64_t seq = g_state.append_seq;
+    int r = wb_write(h, buf, size, offset);
+    if (r < 0) return r;
+    if (g_state.append_seq != seq && commit_op() != 0) return -EIO;
+
+    if (gc_should_run(&g_state))
+        gc_collect(&g_state);
+
+    return r;
+}
+
+/* ------------------------------------------------------------------ */
+/*  copy_file_range: block sharing                                      */
+/* ------------------------------------------------------------------ */
+
+#define COPY_CHUNK  (32 * BLOCK_SIZE)
 
-        int new_blk = log_append_ex(&g_state, data, (uint32_t)ino, blk);
-        if (new_blk < 0) return -ENOSPC;
+/*
+ * Point logical blocks [first, first + n) of file 'ino' at existing
+ * data pointers — nothing is copied, the blocks become shared.  The
+ * file grows to 'end' bytes if it is shorter.
+ */
+static int file_share(uint32_t ino, uint32_t first, const uint32_t *ptrs,
+                      uint32_t n, uint32_t end)
+{
+    struct lfs_inode inode;
+    if (inode_read(&g_state, ino, &inode) != 0)
+        return -EIO;
 
+    uint32_t indirect_ptrs[PTRS_PER_BLOCK];
+    int indirect_dirty = 0;
+
+    if (first + n > MAX_DIRECT_PTRS) {
+        memset(indirect_ptrs, 0, sizeof(indirect_ptrs));
+        if (inode.indirect != 0 &&
+            disk_read(inode.indirect, indirect_ptrs) != 0)
+            return -EIO;
+    }
+
+    for (uint32_t i = 0; i < n; i++) {
+        uint32_t blk = first + i;
         if (blk < MAX_DIRECT_PTRS) {
-            inode.direct[blk] = (uint32_t)new_blk;
+            inode.direct[blk] = ptrs[i];
         } else {
-            indirect_ptrs[blk - MAX_DIRECT_PTRS] = (uint32_t)new_blk;
+            indirect_ptrs[blk - MAX_DIRECT_PTRS] = ptrs[i];
             indirect_dirty = 1;
         }
     }
 
-    /* Write back the indirect block if it was modified */
-    if (indirect_loaded && indirect_dirty) {
+    /* The indirect block itself is never shared: append a new copy */
+    if (indirect_dirty) {
         int new_ind = log_append_ex(&g_state, indirect_ptrs,
-                                    (uint32_t)ino, MAX_DIRECT_PTRS);
+                                    ino, MAX_DIRECT_PTRS, LFS_BLK_INDIRECT);
         if (new_ind < 0) return -ENOSPC;
         inode.indirect = (uint32_t)new_ind;
     }
 
-    uint32_t new_end = (uint32_t)(offset + size);
-    if (new_end > inode.size) inode.size = new_end;
-
+    if (end > inode.size) inode.size = end;
     if (inode_write(&g_state, &inode) != 0) return -EIO;
-    if (log_checkpoint(&g_state) != 0) return -EIO;
+    return 0;
+}
 
-    if (gc_should_run(&g_state)) {
-        printf("lfs_write: GC triggered! free=%u\n",
-               g_state.sb.total_blocks - g_state.log_tail);
-        gc_collect(&g_state);
+/* Plain copy of 'len' bytes through a bounce buffer */
+static ssize_t copy_bytes(const uint32_t *imap, uint32_t src, off_t off_in,
+                          uint32_t dst, off_t off_out, size_t len)
+{
+    char *tmp = malloc(COPY_CHUNK);
+    struct lfs_handle *hs = malloc(sizeof(*hs));
+    struct lfs_handle *hd = malloc(sizeof(*hd));
+    if (!tmp || !hs || !hd) {
+        free(tmp); free(hs); free(hd);
+        return -ENOMEM;
+    }
+    handle_init(hs, imap, src);
+    handle_init(hd, g_state.inode_map, dst);
+
+    size_t done = 0;
+    while (done < len) {
+        size_t n = len - done;
+        if (n > COPY_CHUNK) n = COPY_CHUNK;
+
+        int r = file_read(hs, tmp, n, off_in + (off_t)done);
+        if (r <= 0) {
+            free(tmp); free(hs); free(hd);
+            return done ? (ssize_t)done : r;
+        }
+        int w = file_write(hd, tmp, (size_t)r, off_out + (off_t)done);
+        if (w < 0) {
+            free(tmp); free(hs); free(hd);
+            return done ? (ssize_t)done : w;
+        }
+        done += (size_t)w;
+        if (w < r) break;
     }
 
-    printf("lfs_write: done, new log_tail=%u\n", g_state.log_tail);
-    return (int)size;
+    free(tmp); free(hs); free(hd);
+    return (ssize_t)done;
+}
+
+/*
+ * lfs_copy_file_range — clone instead of copy.
+ *
+ * Whole blocks whose source and destination offsets line up are not
+ * copied at all: the destination points at the source's existing
+ * blocks, which GC then counts as shared.  The next write to either
+ * file appends new blocks as always, so copy-on-write falls out of
+ * the log structure.  Unaligned head/tail bytes (and copies within
+ * one file) take the normal read/write path.
+ *
+ * FICLONE cannot be offered: the kernel rejects it before it reaches
+ * a FUSE daemon (FUSE has no remap_file_range), so cp --reflink=auto
+ * ends up here via copy_file_range instead.
+ */
+static ssize_t lfs_copy_file_range(const char *path_in,
+                                   struct fuse_file_info *fi_in,
+                                   off_t off_in,
+                                   const char *path_out,
+                                   struct fuse_file_info *fi_out,
+                                   off_t off_out, size_t len, int flags)
+{
+    (void)fi_in; (void)fi_out; (void)flags;
+
+    if (is_readonly_path(path_out)) return -EROFS;
+
+    const uint32_t *imap;
+    int src = path_resolve(path_in, &imap);
+    if (src < 0) return src;
+    if (IS_CTL_FILE(src)) return -EOPNOTSUPP;
+    if (src == SNAPDIR_INO || src == CTLDIR_INO) return -EISDIR;
+
+    int dst = path_to_inode(path_out);
+    if (dst < 0) return dst;
+
+    /* Share and copy what is in the log, not stale blocks */
+    int fr = imap == g_state.inode_map ? wb_flush((uint32_t)src) : 0;
+    if (fr == 0) fr = wb_flush((uint32_t)dst);
+    if (fr != 0) return fr;
+
+    struct lfs_inode in, out;
+    if (inode_read_map(imap, (uint32_t)src, &in) != 0 ||
+        inode_read(&g_state, (uint32_t)dst, &out) != 0)
+        return -EIO;
+    if (in.type != INODE_TYPE_FILE || out.type != INODE_TYPE_FILE)
+        return -EISDIR;
+
+    if (off_in >= (off_t)in.size) return 0;
+    if (off_in + (off_t)len > (off_t)in.size)
+        len = (size_t)(in.size - off_in);
+
+    off_t max_size = (off_t)MAX_FILE_BLOCKS * BLOCK_SIZE;
+    if (off_out >= max_size) return -EFBIG;
+    if (off_out + (off_t)len > max_size)
+        len = (size_t)(max_size - off_out);
+
+    int same_file = (imap == g_state.inode_map && src == dst);
+    if (same_file && off_in < off_out + (off_t)len &&
+        off_out < off_in + (off_t)len)
+        return -EINVAL;               /* overlapping, as the syscall */
+
+    ssize_t done;
+    if (same_file || off_in % BLOCK_SIZE != off_out % BLOCK_SIZE) {
+        done = copy_bytes(imap, (uint32_t)src, off_in,
+                          (uint32_t)dst, off_out, len);
+    } else {
+        size_t head = (BLOCK_SIZE - off_in % BLOCK_SIZE) % BLOCK_SIZE;
+        if (head > len) head = len;
+        uint32_t nshare = (uint32_t)((len - head) / BLOCK_SIZE);
+        size_t   tail   = len - head - (size_t)nshare * BLOCK_SIZE;
+
+        /*
+         * A partial last block can be shared too when it ends the
+         * source (the rest of that block is zero) and nothing of the
+         * destination lies beyond the copied range.
+         */
+        if (tail > 0 && off_in + (off_t)len == (off_t)in.size &&
+            off_out + (off_t)len >= (off_t)out.size) {
+            nshare++;
+            tail = 0;
+        }
+
+        done = 0;
+        if (head > 0)
+            done = copy_bytes(imap, (uint32_t)src, off_in,
+                              (uint32_t)dst, off_out, head);
+
+        if (done == (ssize_t)head && nshare > 0) {
+            uint32_t *ptrs = malloc(nshare * sizeof(uint32_t));
+            if (!ptrs) return done ? done : -ENOMEM;
+
+            int r = file_block_ptrs(&in,
+                                    (uint32_t)((off_in + head) / BLOCK_SIZE),
+                                    nshare, ptrs);
+            if (r == 0)
+                r = file_share((uint32_t)dst,
+                               (uint32_t)((off_out + head) / BLOCK_SIZE),
+                               ptrs, nshare,
+                               (uint32_t)(off_out + len - tail));
+            free(ptrs);
+            if (r != 0) return done ? done : r;
+            done = (ssize_t)(len - tail);
+        }
+
+        if (done == (ssize_t)(len - tail) && tail > 0) {
+            ssize_t t = copy_bytes(imap, (uint32_t)src,
+                                   off_in + (off_t)done, (uint32_t)dst,
+                                   off_out + (off_t)done, tail);
+            if (t < 0) return done ? done : t;
+            done += t;
+        }
+    }
+    if (done < 0) return done;
+
+    if (commit_op() != 0) return -EIO;
+    if (gc_should_run(&g_state))
+        gc_collect(&g_state);
+    return done;
 }
 
 static int lfs_truncate(const char *path, off_t size,
                         struct fuse_file_info *fi)
 {
     (void)fi;
-    printf("lfs_truncate: path=%s size=%ld\n", path, size);
+    if (is_readonly_path(path)) return -EROFS;
     if (size != 0) return -EPERM;
 
     int ino = path_to_inode(path);
@@ -549,13 +1715,283 @@ static int lfs_truncate(const char *path, off_t size,
     if (inode_read(&g_state, (uint32_t)ino, &inode) != 0)
         return -EIO;
 
+    wb_drop((uint32_t)ino);
     inode.size     = 0;
     for (int i = 0; i < MAX_DIRECT_PTRS; i++)
         inode.direct[i] = 0;
     inode.indirect = 0;   /* Stage 9: drop indirect block too */
 
     if (inode_write(&g_state, &inode) != 0) return -EIO;
-    return log_checkpoint(&g_state);
+    return commit_op();
+}
+
+/* ------------------------------------------------------------------ */
+/*  write_buf: splice path                                              */
+/* ------------------------------------------------------------------ */
+
+/* Copy the next 'len' bytes of 'src' into memory */
+static int bufvec_to_mem(struct fuse_bufvec *src, char *mem, size_t len)
+{
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(len);
+    dst.buf[0].mem = mem;
+    ssize_t r = fuse_buf_copy(&dst, src, 0);
+    return r == (ssize_t)len ? 0 : -EIO;
+}
+
+/* Write the next 'len' bytes of 'src' at 'offset' via wb_write */
+static int write_from_bufvec(struct lfs_handle *h, struct fuse_bufvec *src,
+                             size_t len, off_t offset)
+{
+    char *mem = malloc(len);
+    if (!mem) return -ENOMEM;
+    int r = bufvec_to_mem(src, mem, len);
+    if (r == 0) r = wb_write(h, mem, len, offset);
+    free(mem);
+    return r;
+}
+
+/*
+ * Store the next 'n' whole blocks of 'src' as logical blocks
+ * [first, first + n) without touching the bytes: reserve log blocks,
+ * then let libfuse copy (splice, when the source is the FUSE pipe)
+ * straight into the image, one call per contiguous physical run.
+ */
+static int splice_blocks(uint32_t ino, struct fuse_bufvec *src,
+                         uint32_t first, uint32_t n, uint32_t end)
+{
+    uint32_t *idx  = malloc(n * sizeof(uint32_t));
+    uint32_t *ptrs = malloc(n * sizeof(uint32_t));
+    if (!idx || !ptrs) {
+        free(idx); free(ptrs);
+        return -ENOMEM;
+    }
+    for (uint32_t i = 0; i < n; i++)
+        idx[i] = first + i;
+
+    int r = 0;
+    if (log_reserve(&g_state, ino, idx, n, ptrs) != 0)
+        r = -ENOSPC;
+
+    for (uint32_t i = 0; r == 0 && i < n; ) {
+        uint32_t run = 1;
+        while (i + run < n && ptrs[i + run] == ptrs[i] + run) run++;
+
+        size_t len = (size_t)run * BLOCK_SIZE;
+        struct fuse_bufvec dst = FUSE_BUFVEC_INIT(len);
+        dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+        dst.buf[0].fd    = disk_get_fd();
+        dst.buf[0].pos   = (off_t)ptrs[i] * BLOCK_SIZE;
+
+        if (fuse_buf_copy(&dst, src, 0) != (ssize_t)len) r = -EIO;
+        disk_note_write(ptrs[i], run);
+        i += run;
+    }
+
+    if (r == 0) r = file_share(ino, first, ptrs, n, end);
+    free(idx); free(ptrs);
+    return r;
+}
+
+/*
+ * lfs_write_buf — write without copying whole blocks.
+ *
+ * Block-aligned full blocks go straight from the request buffer into
+ * freshly reserved log blocks; only a partial head or tail block takes
+ * the buffered path in wb_write.  Compression, dedup and
+ * data checksums have to look at the bytes, and O_DIRECT needs
+ * aligned buffers, so with any of them enabled (or a write past the
+ * maximum file size) the whole request goes through wb_write.
+ */
+static int lfs_write_buf(const char *path, struct fuse_bufvec *buf,
+                         off_t offset, struct fuse_file_info *fi)
+{
+    size_t size = fuse_buf_size(buf);
+
+    if (is_readonly_path(path)) return -EROFS;
+
+    struct lfs_handle tmp, *h = handle_of(fi);
+    if (!h) {
+        int ino = path_to_inode(path);
+        if (ino < 0) return ino;
+        handle_init(&tmp, g_state.inode_map, (uint32_t)ino);
+        h = &tmp;
+    }
+
+    /* A stale handle must not splice into whatever reused its number */
+    int r = handle_inode(h);
+    if (r != 0) return r;
+    if (h->inode.type != INODE_TYPE_FILE)
+        return -EISDIR;
+    uint32_t ino = h->ino;
+    if (size == 0) return 0;
+
+    off_t    max_size = (off_t)MAX_FILE_BLOCKS * BLOCK_SIZE;
+    uint32_t head  = (uint32_t)((BLOCK_SIZE - offset % BLOCK_SIZE)
+                                % BLOCK_SIZE);
+    if (head > size) head = (uint32_t)size;
+    uint32_t nfull = (uint32_t)((size - head) / BLOCK_SIZE);
+    size_t   tail  = size - head - (size_t)nfull * BLOCK_SIZE;
+
+    uint64_t seq = g_state.append_seq;
+    if (g_state.compress != LFS_CODEC_NONE || g_state.dedup ||
+        g_state.data_csum || disk_is_direct() || nfull == 0 ||
+        offset + (off_t)size > max_size) {
+        r = write_from_bufvec(h, buf, size, offset);
+    } else {
+        r = 0;
+        if (head > 0)
+            r = write_from_bufvec(h, buf, head, offset);
+        /* Spliced blocks bypass the buffer: it must not hold older data */
+        if (r >= 0) r = wb_flush(ino);
+        if (r >= 0) {
+            off_t full_off = offset + head;
+            r = splice_blocks(ino, buf,
+                              (uint32_t)(full_off / BLOCK_SIZE), nfull,
+                              (uint32_t)(full_off +
+                                         (off_t)nfull * BLOCK_SIZE));
+        }
+        if (r >= 0 && tail > 0)
+            r = write_from_bufvec(h, buf, tail,
+                                  offset + (off_t)(size - tail));
+        if (r >= 0) r = (int)size;
+    }
+    if (r < 0) return r;
+    if (g_state.append_seq != seq && commit_op() != 0) return -EIO;
+
+    if (gc_should_run(&g_state))
+        gc_collect(&g_state);
+    return r;
+}
+
+/* ------------------------------------------------------------------ */
+/*  fsync / flush                                                       */
+/* ------------------------------------------------------------------ */
+
+/*
+ * lfs_fsync — make one file durable.
+ *
+ * Once its buffered writes are appended, everything for the file is
+ * in the log; it only has to reach the disk.  Roll-forward recovery
+ * finds the inode through the segment summaries, so no checkpoint is
+ * written, and nothing at all is done if the inode has not changed
+ * since the last flush.  The image's own metadata never matters, so
+ * 'datasync' makes no difference.
+ */
+static int lfs_fsync(const char *path, int datasync,
+                     struct fuse_file_info *fi)
+{
+    (void)datasync;
+
+    /* An open file is synced through its handle, whatever its path
+     * has become since */
+    struct lfs_handle *h = handle_of(fi);
+    int ino;
+    if (h) {
+        if (h->ctl || h->imap != g_state.inode_map)
+            return 0;                       /* read-only, nothing dirty */
+        int r = handle_inode(h);
+        if (r == -ENOENT) return 0;         /* unlinked: nothing to keep */
+        if (r != 0) return r;
+        ino = (int)h->ino;
+    } else {
+        if (is_readonly_path(path)) return 0;
+        ino = path_to_inode(path);
+        if (ino < 0) return ino;
+    }
+
+    int r = wb_flush((uint32_t)ino);
+    if (r != 0) return r;
+    if (log_sync_inode(&g_state, (uint32_t)ino) != 0) return -EIO;
+    return 0;
+}
+
+static int lfs_fsyncdir(const char *path, int datasync,
+                        struct fuse_file_info *fi)
+{
+    return lfs_fsync(path, datasync, fi);
+}
+
+/*
+ * lfs_flush — called on every close().  Buffered writes are appended
+ * and checkpointed, so other openers and a later mount see them;
+ * close() does not promise durability, that is fsync's job.
+ */
+static int lfs_flush(const char *path, struct fuse_file_info *fi)
+{
+    if (is_readonly_path(path)) return 0;
+
+    struct lfs_handle *h = handle_of(fi);
+    int ino = h ? (int)h->ino : path_to_inode(path);
+    if (ino < 0) return ino;
+    return wb_sync(ino);
+}
+
+/*
+ * lfs_release — last close of an open file: flush what it buffered
+ * and drop its handle.
+ */
+static int lfs_release(const char *path, struct fuse_file_info *fi)
+{
+    struct lfs_handle *h = handle_of(fi);
+    int ino = h ? (int)h->ino : path_to_inode(path);
+    int r = 0;
+    if (ino >= 0 && (!h || h->imap == g_state.inode_map))
+        r = wb_sync(ino);
+
+    if (h) {
+        free(h->blk);
+        free(h->ctl);
+        free(h);
+        fi->fh = 0;
+    }
+    return r;
+}
+
+/* ------------------------------------------------------------------ */
+/*  Extended attributes                                                 */
+/* ------------------------------------------------------------------ */
+
+#define LFS_XATTR_WRITTEN  "user.lfs.blocks_written"
+#define LFS_XATTR_TRACE    "user.lfs.trace"
+
+/*
+ * lfs_getxattr — the root directory answers LFS_XATTR_WRITTEN with the
+ * number of image blocks written since mount (data, inodes, summaries,
+ * checkpoints and GC copies), in decimal.  Sampled around a workload
+ * it gives write amplification.  LFS_XATTR_TRACE is "1" while tracing
+ * is on.  No other attributes exist.
+ */
+static int lfs_getxattr(const char *path, const char *name, char *value,
+                        size_t size)
+{
+    if (strcmp(path, "/") != 0) return -ENODATA;
+
+    char tmp[32];
+    int len;
+    if (strcmp(name, LFS_XATTR_WRITTEN) == 0)
+        len = snprintf(tmp, sizeof(tmp), "%llu",
+                       (unsigned long long)disk_blocks_written());
+    else if (strcmp(name, LFS_XATTR_TRACE) == 0)
+        len = snprintf(tmp, sizeof(tmp), "%d", trace_on);
+    else
+        return -ENODATA;
+    if (size == 0) return len;
+    if (size < (size_t)len) return -ERANGE;
+    memcpy(value, tmp, (size_t)len);
+    return len;
+}
+
+/* Setting LFS_XATTR_TRACE on the root to "1" or "0" switches tracing */
+static int lfs_setxattr(const char *path, const char *name,
+                        const char *value, size_t size, int flags)
+{
+    (void)flags;
+    if (strcmp(path, "/") != 0 || strcmp(name, LFS_XATTR_TRACE) != 0)
+        return -ENOTSUP;
+    if (!LFS_TRACE) return -ENOTSUP;
+    if (size != 1 || (value[0] != '0' && value[0] != '1')) return -EINVAL;
+    trace_set(value[0] == '1');
+    return 0;
 }
 
 /* ------------------------------------------------------------------ */
@@ -564,7 +2000,7 @@ static int lfs_truncate(const char *path, off_t size,
 
 static int lfs_unlink(const char *path)
 {
-    printf("lfs_unlink: path=%s\n", path);
+    if (is_readonly_path(path)) return -EROFS;
 
     char parent_path[4096];
     char name[MAX_NAME_LEN];
@@ -588,13 +2024,11 @@ static int lfs_unlink(const char *path)
     if (r != 0) return r;
 
     g_state.inode_map[ino] = 0;
+    ino_gen[ino]++;
+    wb_drop((uint32_t)ino);
 
     if (log_checkpoint(&g_state) != 0) return -EIO;
 
-    printf("lfs_unlink: freed inode %d, log_tail=%u free=%u\n",
-           ino, g_state.log_tail,
-           g_state.sb.total_blocks - g_state.log_tail);
-
     if (gc_should_run(&g_state))
         gc_collect(&g_state);
 
@@ -608,7 +2042,25 @@ static int lfs_unlink(const char *path)
 static int lfs_mkdir(const char *path, mode_t mode)
 {
     (void)mode;
-    printf("lfs_mkdir: path=%s\n", path);
+
+    /* mkdir /.snapshots/<name> takes a snapshot */
+    char sname[MAX_NAME_LEN];
+    const char *rest;
+    switch (snap_parse(path, sname, &rest)) {
+    case SNAP_PATH_DIR:
+        return -EEXIST;
+    case SNAP_PATH_SNAP:
+        if (strcmp(rest, "/") != 0) return -EROFS;
+        if (sname[0] == '\0') return -ENAMETOOLONG;
+        if (snapshot_find(&g_state, sname) >= 0) return -EEXIST;
+        /* The snapshot must include buffered writes */
+        if (wb_sync(-1) != 0) return -EIO;
+        return snapshot_create(&g_state, sname) >= 0 ? 0 : -ENOSPC;
+    default:
+        break;
+    }
+    int ctl = ctl_parse(path);
+    if (ctl != 0) return ctl > 0 ? -EEXIST : -EROFS;
 
     char parent_path[4096];
     char name[MAX_NAME_LEN];
@@ -623,17 +2075,16 @@ static int lfs_mkdir(const char *path, mode_t mode)
     if (path_to_inode(path) != -ENOENT)
         return -EEXIST;
 
-    if (gc_should_run(&g_state)) {
-        printf("lfs_mkdir: GC triggered!\n");
+    if (gc_should_run(&g_state))
         gc_collect(&g_state);
-    }
 
     int ino = inode_alloc(&g_state);
     if (ino < 0) return -ENOSPC;
 
     uint8_t empty[BLOCK_SIZE];
     memset(empty, 0, BLOCK_SIZE);
-    int data_blk = log_append_ex(&g_state, empty, (uint32_t)ino, 0);
+    int data_blk = log_append_ex(&g_state, empty, (uint32_t)ino, 0,
+                                 LFS_BLK_DATA);
     if (data_blk < 0) return -ENOSPC;
 
     struct lfs_inode new_dir;
@@ -648,19 +2099,27 @@ static int lfs_mkdir(const char *path, mode_t mode)
     int r = dir_add_entry((uint32_t)parent_ino, (uint32_t)ino, name);
     if (r != 0) return r;
 
-    if (log_checkpoint(&g_state) != 0) return -EIO;
-
-    printf("lfs_mkdir: created dir ino=%d parent=%d log_tail=%u\n",
-           ino, parent_ino, g_state.log_tail);
-    return 0;
+    return commit_op();
 }
 
 static int lfs_rmdir(const char *path)
 {
-    printf("lfs_rmdir: path=%s\n", path);
-
     if (strcmp(path, "/") == 0) return -EPERM;
 
+    /* rmdir /.snapshots/<name> deletes a snapshot */
+    char sname[MAX_NAME_LEN];
+    const char *rest;
+    switch (snap_parse(path, sname, &rest)) {
+    case SNAP_PATH_DIR:
+        return -EPERM;
+    case SNAP_PATH_SNAP:
+        if (strcmp(rest, "/") != 0) return -EROFS;
+        if (snapshot_find(&g_state, sname) < 0) return -ENOENT;
+        return snapshot_delete(&g_state, sname) == 0 ? 0 : -EIO;
+    default:
+        break;
+    }
+
     char parent_path[4096];
     char name[MAX_NAME_LEN];
     if (path_split(path, parent_path, name) != 0)
@@ -686,19 +2145,167 @@ static int lfs_rmdir(const char *path)
     if (r != 0) return r;
 
     g_state.inode_map[ino] = 0;
+    ino_gen[ino]++;
+    wb_drop((uint32_t)ino);
 
     if (log_checkpoint(&g_state) != 0) return -EIO;
 
-    printf("lfs_rmdir: freed dir ino=%d log_tail=%u free=%u\n",
-           ino, g_state.log_tail,
-           g_state.sb.total_blocks - g_state.log_tail);
-
     if (gc_should_run(&g_state))
         gc_collect(&g_state);
 
     return 0;
 }
 
+/* ------------------------------------------------------------------ */
+/*  Timed entry points (/.lfs/stats, /.lfs/trace)                       */
+/* ------------------------------------------------------------------ */
+
+/*
+ * Run 'call', record its latency under 'op', trace it against inode
+ * 'ino' (0 if unknown) and return its result
+ */
+#define TIMED(op, ino, call)                                \
+    do {                                                    \
+        uint64_t t0_  = stats_now();                        \
+        uint32_t ino_ = (ino);                              \
+        int r_ = (call);                                    \
+        stats_record((op), t0_, r_ < 0);                    \
+        TRACE_SPAN((op), t0_, ino_, 0, r_);                 \
+        return r_;                                          \
+    } while (0)
+
+/* Inode of an open file, read before the call since release frees it */
+static uint32_t fi_ino(struct fuse_file_info *fi)
+{
+    struct lfs_handle *h = handle_of(fi);
+    return h ? h->ino : 0;
+}
+
+static int t_getattr(const char *path, struct stat *st,
+                     struct fuse_file_info *fi)
+{
+    TIMED(STAT_GETATTR, fi_ino(fi), lfs_getattr(path, st, fi));
+}
+
+static int t_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+                     off_t off, struct fuse_file_info *fi,
+                     enum fuse_readdir_flags flags)
+{
+    TIMED(STAT_READDIR, 0,
+          lfs_readdir(path, buf, filler, off, fi, flags));
+}
+
+static int t_open(const char *path, struct fuse_file_info *fi)
+{
+    TIMED(STAT_OPEN, fi_ino(fi), lfs_open(path, fi));
+}
+
+static int t_release(const char *path, struct fuse_file_info *fi)
+{
+    TIMED(STAT_RELEASE, fi_ino(fi), lfs_release(path, fi));
+}
+
+static int t_read(const char *path, char *buf, size_t size, off_t offset,
+                  struct fuse_file_info *fi)
+{
+    TIMED(STAT_READ, fi_ino(fi), lfs_read(path, buf, size, offset, fi));
+}
+
+static int t_read_buf(const char *path, struct fuse_bufvec **bufp,
+                      size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    TIMED(STAT_READ_BUF, fi_ino(fi),
+          lfs_read_buf(path, bufp, size, offset, fi));
+}
+
+/* The new inode is only known once lfs_create has attached its handle */
+static int t_create(const char *path, mode_t mode,
+                    struct fuse_file_info *fi)
+{
+    uint64_t t0 = stats_now();
+    int r = lfs_create(path, mode, fi);
+    stats_record(STAT_CREATE, t0, r < 0);
+    TRACE_SPAN(STAT_CREATE, t0, r == 0 ? fi_ino(fi) : 0, 0, r);
+    return r;
+}
+
+static int t_write(const char *path, const char *buf, size_t size,
+                   off_t offset, struct fuse_file_info *fi)
+{
+    TIMED(STAT_WRITE, fi_ino(fi), lfs_write(path, buf, size, offset, fi));
+}
+
+static int t_write_buf(const char *path, struct fuse_bufvec *buf,
+                       off_t offset, struct fuse_file_info *fi)
+{
+    TIMED(STAT_WRITE_BUF, fi_ino(fi), lfs_write_buf(path, buf, offset, fi));
+}
+
+static int t_truncate(const char *path, off_t size,
+                      struct fuse_file_info *fi)
+{
+    TIMED(STAT_TRUNCATE, fi_ino(fi), lfs_truncate(path, size, fi));
+}
+
+static int t_unlink(const char *path)
+{
+    TIMED(STAT_UNLINK, 0, lfs_unlink(path));
+}
+
+static int t_mkdir(const char *path, mode_t mode)
+{
+    TIMED(STAT_MKDIR, 0, lfs_mkdir(path, mode));
+}
+
+static int t_rmdir(const char *path)
+{
+    TIMED(STAT_RMDIR, 0, lfs_rmdir(path));
+}
+
+static ssize_t t_copy_file_range(const char *path_in,
+                                 struct fuse_file_info *fi_in,
+                                 off_t off_in, const char *path_out,
+                                 struct fuse_file_info *fi_out,
+                                 off_t off_out, size_t len, int flags)
+{
+    uint64_t t0 = stats_now();
+    uint32_t ino = fi_ino(fi_out);
+    ssize_t r = lfs_copy_file_range(path_in, fi_in, off_in, path_out,
+                                    fi_out, off_out, len, flags);
+    stats_record(STAT_COPY_FILE_RANGE, t0, r < 0);
+    TRACE_SPAN(STAT_COPY_FILE_RANGE, t0, ino, 0, r);
+    return r;
+}
+
+static int t_fsync(const char *path, int datasync,
+                   struct fuse_file_info *fi)
+{
+    TIMED(STAT_FSYNC, fi_ino(fi), lfs_fsync(path, datasync, fi));
+}
+
+static int t_fsyncdir(const char *path, int datasync,
+                      struct fuse_file_info *fi)
+{
+    TIMED(STAT_FSYNCDIR, fi_ino(fi), lfs_fsyncdir(path, datasync, fi));
+}
+
+static int t_flush(const char *path, struct fuse_file_info *fi)
+{
+    TIMED(STAT_FLUSH, fi_ino(fi), lfs_flush(path, fi));
+}
+
+static int t_getxattr(const char *path, const char *name, char *value,
+                      size_t size)
+{
+    TIMED(STAT_GETXATTR, 0, lfs_getxattr(path, name, value, size));
+}
+
+static int t_setxattr(const char *path, const char *name, const char *value,
+                      size_t size, int flags)
+{
+    TIMED(STAT_SETXATTR, 0, lfs_setxattr(path, name, value, size, flags));
+}
+
 /* ------------------------------------------------------------------ */
 /*  FUSE ops table + main                                               */
 /* ------------------------------------------------------------------ */
@@ -706,19 +2313,154 @@ static int lfs_rmdir(const char *path)
 static struct fuse_operations lfs_ops = {
     .init     = lfs_init,
     .destroy  = lfs_destroy,
-    .getattr  = lfs_getattr,
-    .readdir  = lfs_readdir,
-    .open     = lfs_open,
-    .read     = lfs_read,
-    .create   = lfs_create,
-    .write    = lfs_write,
-    .truncate = lfs_truncate,
-    .unlink   = lfs_unlink,   /* Stage 6 */
-    .mkdir    = lfs_mkdir,    /* Stage 7 */
-    .rmdir    = lfs_rmdir,    /* Stage 7 */
+    .getattr  = t_getattr,
+    .readdir  = t_readdir,
+    .open     = t_open,
+    .release  = t_release,
+    .read     = t_read,
+    .read_buf = t_read_buf,
+    .create   = t_create,
+    .write    = t_write,
+    .write_buf = t_write_buf,
+    .truncate = t_truncate,
+    .unlink   = t_unlink,     /* Stage 6 */
+    .mkdir    = t_mkdir,      /* Stage 7 */
+    .rmdir    = t_rmdir,      /* Stage 7 */
+    .copy_file_range = t_copy_file_range,
+    .fsync    = t_fsync,
+    .fsyncdir = t_fsyncdir,
+    .flush    = t_flush,
+    .getxattr = t_getxattr,
+    .setxattr = t_setxattr,
+};
+
+/* ------------------------------------------------------------------ */
+/*  Mount options                                                       */
+/* ------------------------------------------------------------------ */
+
+#define LFS_OPT(t, f, v) { t, offsetof(struct lfs_opts, f), v }
+
+static const struct fuse_opt lfs_opt_spec[] = {
+    LFS_OPT("image=%s",           image,           0),
+    LFS_OPT("io=%s",              io_name,         0),
+    LFS_OPT("sync=%s",            sync_name,       0),
+    LFS_OPT("compress=%s",        codec_name,      0),
+    LFS_OPT("dedup",              dedup,           1),
+    LFS_OPT("nodedup",            dedup,           0),
+    LFS_OPT("csum",               data_csum,       1),
+    LFS_OPT("nocsum",             data_csum,       0),
+    LFS_OPT("cache_blocks=%u",    cache_blocks,    0),
+    LFS_OPT("ra_max=%u",          ra_max,          0),
+    LFS_OPT("wb_file_blocks=%u",  wb_file_blocks,  0),
+    LFS_OPT("wb_max_blocks=%u",   wb_max_blocks,   0),
+    LFS_OPT("ckpt_interval=%u",   ckpt_interval,   0),
+    LFS_OPT("gc_threshold=%u",    gc_threshold,    0),
+    LFS_OPT("recover_threads=%u", recover_threads, 0),
+    LFS_OPT("-h",                 help,            1),
+    LFS_OPT("--help",             help,            1),
+    FUSE_OPT_END
 };
 
+static void lfs_usage(const char *prog)
+{
+    printf("usage: %s [options] <mountpoint>\n\n"
+           "LFS options:\n"
+           "    -o image=PATH          disk image (%s)\n"
+           "    -o io=BACKEND          buffered, direct (O_DIRECT) or mmap\n"
+           "    -o sync=MODE           none, ordered or full barriers\n"
+           "    -o compress=CODEC      none, lz4 or zstd for new data\n"
+           "    -o [no]dedup           share identical data blocks\n"
+           "    -o [no]csum            checksum and verify data blocks\n"
+           "    -o cache_blocks=N      block cache size, 0 = none (%u)\n"
+           "    -o ra_max=N            readahead window limit, 0..%u (%u)\n"
+           "    -o wb_file_blocks=N    dirty blocks buffered per file (%u)\n"
+           "    -o wb_max_blocks=N     dirty blocks buffered in all (%u)\n"
+           "    -o ckpt_interval=N     appending operations per checkpoint (%u)\n"
+           "    -o gc_threshold=N      run GC below N free blocks, scaled by\n"
+           "                           segment blocks / 32 (%u)\n"
+           "    -o recover_threads=N   crash recovery threads (%u)\n\n",
+           prog, LFS_IMAGE_DEFAULT, LFS_CACHE_BLOCKS, LFS_RA_MAX, LFS_RA_MAX,
+           LFS_WB_FILE_BLOCKS, LFS_WB_MAX_BLOCKS, LFS_CKPT_INTERVAL,
+           GC_THRESHOLD, LFS_RECOVER_THREADS);
+}
+
+/* Index of 'val' in 'names', or -1 with a message */
+static int opt_choice(const char *opt, const char *val,
+                      const char *const names[], int n)
+{
+    for (int i = 0; i < n; i++)
+        if (names[i] && strcmp(val, names[i]) == 0) return i;
+    fprintf(stderr, "lfs: bad value '%s' for -o %s\n", val, opt);
+    return -1;
+}
+
+/* Turn the string options into numbers and check ranges: 0 or -1 */
+static int opts_resolve(struct lfs_opts *o)
+{
+    static const char *const io_names[]   = { "buffered", "direct", "mmap" };
+    static const int         io_flags[]   = { 0, DISK_DIRECT, DISK_MMAP };
+    static const char *const sync_names[] = {
+        [LFS_SYNC_NONE] = "none", [LFS_SYNC_ORDERED] = "ordered",
+        [LFS_SYNC_FULL] = "full",
+    };
+    static const char *const codec_names[] = {
+        [LFS_CODEC_NONE] = "none", [LFS_CODEC_LZ4] = "lz4",
+#ifdef LFS_HAVE_ZSTD
+        [LFS_CODEC_ZSTD] = "zstd",
+#endif
+    };
+    int i;
+
+    if (o->io_name) {
+        if ((i = opt_choice("io", o->io_name, io_names, 3)) < 0) return -1;
+        o->disk_flags = io_flags[i];
+    }
+    if (o->sync_name) {
+        if ((i = opt_choice("sync", o->sync_name, sync_names, 3)) < 0)
+            return -1;
+        o->sync_mode = i;
+    }
+    if (o->codec_name) {
+        i = opt_choice("compress", o->codec_name, codec_names,
+                       (int)(sizeof(codec_names) / sizeof(codec_names[0])));
+        if (i < 0) return -1;
+        o->compress = i;
+    }
+    if (o->ra_max > LFS_RA_MAX) {
+        fprintf(stderr, "lfs: ra_max is at most %u\n", LFS_RA_MAX);
+        return -1;
+    }
+    if (o->ckpt_interval == 0 || o->recover_threads == 0) {
+        fprintf(stderr, "lfs: ckpt_interval and recover_threads "
+                        "must be at least 1\n");
+        return -1;
+    }
+    return 0;
+}
+
 int main(int argc, char *argv[])
 {
-    return fuse_main(argc, argv, &lfs_ops, NULL);
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    if (fuse_opt_parse(&args, &opts, lfs_opt_spec, NULL) != 0)
+        return 1;
+
+    if (opts.help) {
+        /* libfuse then lists its own options, without a usage line */
+        lfs_usage(argv[0]);
+        if (fuse_opt_add_arg(&args, "--help") != 0) return 1;
+        args.argv[0][0] = '\0';
+    } else if (opts_resolve(&opts) != 0) {
+        fuse_opt_free_args(&args);
+        return 1;
+    }
+
+    /* The operations share g_state, the inode maps, the write-back
+     * buffers and the log tail without a lock, so they run on one
+     * thread.  The readahead worker only uses the block cache, which
+     * has its own lock, and reads the image.                        */
+    if (fuse_opt_add_arg(&args, "-s") != 0) return 1;
+
+    int r = fuse_main(args.argc, args.argv, &lfs_ops, NULL);
+    fuse_opt_free_args(&args);
+    return r;
 }
@@ -1,6 +1,7 @@
 #ifndef LFS_H
 #define LFS_H
 
+#include <stddef.h>
 #include <stdint.h>
 #include <sys/stat.h>
 
@@ -9,29 +10,183 @@
    ================================================================ */
 
 #define LFS_MAGIC        0x4C465331
+
+/* Block size is fixed per build (the on-disk structures below are
+ * block-sized): make CFLAGS+=-DBLOCK_SIZE=16384 or 65536 for larger
+ * blocks.  Images record it and only mount on a matching build.     */
+#ifndef BLOCK_SIZE
 #define BLOCK_SIZE       4096
-#define TOTAL_BLOCKS     1024          /* 4 MB disk image            */
-#define INODE_MAP_BLOCK  1             /* block where inode map lives */
-#define INODE_MAP_SIZE   128           /* max inodes supported        */
+#endif
+#if BLOCK_SIZE != 4096 && BLOCK_SIZE != 16384 && BLOCK_SIZE != 65536
+#error "BLOCK_SIZE must be 4096, 16384 or 65536"
+#endif
+
+#define TOTAL_BLOCKS     1024          /* default image size (mkfs)  */
+#define CKPT_BLOCK_A     1             /* checkpoint regions, written */
+#define CKPT_BLOCK_B     2             /*   alternately (see below)   */
 #define LOG_START_BLOCK  7             /* first block usable for log  */
 
-/* Segment = 32 blocks = 128 KB                                      */
+/* Inodes a build supports; mkfs -i can give an image fewer.  The
+ * inode map has to fit in a checkpoint block after its 24-byte header
+ * and the 512-byte snapshot table.                                   */
+#ifndef INODE_MAP_SIZE
+#define INODE_MAP_SIZE   128
+#endif
+#if INODE_MAP_SIZE * 4 + 536 > BLOCK_SIZE
+#error "INODE_MAP_SIZE does not fit in a checkpoint block"
+#endif
+
+/*
+ * Segment size is chosen by mkfs and recorded in the superblock: a
+ * power of two from LFS_SEG_MIN_BLOCKS blocks up to LFS_SEG_MAX_BYTES,
+ * so segments line up with SSD erase blocks and RAID stripes.  The
+ * default is 32 blocks (128 KB with 4 KB blocks).
+ */
 #define BLOCKS_PER_SEGMENT  32
-#define SEGMENT_COUNT       (TOTAL_BLOCKS / BLOCKS_PER_SEGMENT)
+#define LFS_SEG_MIN_BLOCKS  8
+#define LFS_SEG_MAX_BYTES   (64u << 20)
 
-/* GC triggers when free blocks drop below this threshold            */
+/* GC triggers when free blocks drop below this threshold, scaled by
+ * the segment size relative to BLOCKS_PER_SEGMENT                    */
 #define GC_THRESHOLD        100
 
+/*
+ * Build-time defaults for the lfs mount options (lfs.c), e.g.
+ *   lfs -o image=/srv/lfs.img,cache_blocks=4096,ckpt_interval=16 mnt
+ */
+#define LFS_IMAGE_DEFAULT   "/home/kiit/lfs-fuse/lfs.img"
+
+/* Checkpoint after every LFS_CKPT_INTERVAL operations that append to
+ * the log; recovery rolls forward over the ones in between.  Unlink,
+ * rmdir and snapshots always checkpoint.                            */
+#ifndef LFS_CKPT_INTERVAL
+#define LFS_CKPT_INTERVAL   1
+#endif
+
+/* Codec used for new data blocks (LFS_CODEC_NONE = store raw).
+ * Override at build time, e.g. make CFLAGS+=-DLFS_COMPRESS_DEFAULT=1 */
+#ifndef LFS_COMPRESS_DEFAULT
+#define LFS_COMPRESS_DEFAULT  LFS_CODEC_NONE
+#endif
+
+/* Share identical data blocks instead of appending copies (0 = off)  */
+#ifndef LFS_DEDUP_DEFAULT
+#define LFS_DEDUP_DEFAULT     0
+#endif
+
+/* Record a CRC32C of every block in its segment summary and verify
+ * data blocks on read (0 = off).  Checkpoints and summaries are
+ * always checksummed.                                               */
+#ifndef LFS_DATA_CSUM_DEFAULT
+#define LFS_DATA_CSUM_DEFAULT 0
+#endif
+
+/*
+ * Durability barriers (LFS_SYNC_*):
+ *   NONE    — never flush; the host page cache decides when blocks
+ *             reach the disk
+ *   ORDERED — flush the log before each checkpoint is written, so a
+ *             checkpoint never reaches the disk ahead of the blocks
+ *             it refers to
+ *   FULL    — ORDERED, and flush each checkpoint too: an operation is
+ *             durable when it returns
+ * fsync(2) on a file is honoured in every mode.
+ */
+#define LFS_SYNC_NONE       0
+#define LFS_SYNC_ORDERED    1
+#define LFS_SYNC_FULL       2
+
+#ifndef LFS_SYNC_DEFAULT
+#define LFS_SYNC_DEFAULT    LFS_SYNC_ORDERED
+#endif
+
+/* Open the image with O_DIRECT (0 = use the host page cache).  All
+ * transfers then use LFS_DISK_ALIGN-aligned buffers; LFS_DISK_POOL
+ * of them are preallocated.                                         */
+#ifndef LFS_DIRECT_IO_DEFAULT
+#define LFS_DIRECT_IO_DEFAULT 0
+#endif
+#define LFS_DISK_ALIGN      4096
+#define LFS_DISK_POOL       32
+
+/* Serve reads from an mmap of the image (0 = pread per block).  Best
+ * for read-mostly mounts; ignored with O_DIRECT.                    */
+#ifndef LFS_MMAP_DEFAULT
+#define LFS_MMAP_DEFAULT    0
+#endif
+
+/* Block cache size in blocks (1 MB); not used with a mapped image   */
+#ifndef LFS_CACHE_BLOCKS
+#define LFS_CACHE_BLOCKS    256
+#endif
+
+/* Sequential readahead window, in blocks: starts at LFS_RA_MIN and
+ * doubles up to LFS_RA_MAX while prefetched blocks are being hit.
+ * LFS_RA_MAX = 0 disables readahead.                                */
+#ifndef LFS_RA_MIN
+#define LFS_RA_MIN          4
+#endif
+#ifndef LFS_RA_MAX
+#define LFS_RA_MAX          64
+#endif
+
+/* Write-back buffering: up to LFS_WB_FILE_BLOCKS dirty blocks per
+ * file, LFS_WB_MAX_BLOCKS in all, are held in memory until close,
+ * fsync or unmount (LFS_WB_FILE_BLOCKS = 0 writes through).  Never
+ * used with LFS_SYNC_FULL.                                          */
+#ifndef LFS_WB_FILE_BLOCKS
+#define LFS_WB_FILE_BLOCKS  64
+#endif
+#ifndef LFS_WB_MAX_BLOCKS
+#define LFS_WB_MAX_BLOCKS   256
+#endif
+
+/* Crash recovery scans the log after the checkpoint in ranges of
+ * LFS_RECOVER_CHUNK segments, on up to LFS_RECOVER_THREADS threads
+ * (1 = on the mounting thread only).                                */
+#ifndef LFS_RECOVER_THREADS
+#define LFS_RECOVER_THREADS 4
+#endif
+#ifndef LFS_RECOVER_CHUNK
+#define LFS_RECOVER_CHUNK   4
+#endif
+/* ... reading at most LFS_RECOVER_WINDOW bytes of a segment at once */
+#ifndef LFS_RECOVER_WINDOW
+#define LFS_RECOVER_WINDOW  (1u << 20)
+#endif
+
+/* Operation counters and latency histograms, read through
+ * /.lfs/stats; 0 compiles them out                                   */
+#ifndef LFS_STATS
+#define LFS_STATS           1
+#endif
+
+/* Event tracing into per-thread rings of LFS_TRACE_EVENTS, dumped
+ * through /.lfs/trace.  Off until switched on at run time (LFS_TRACE=1
+ * in the environment, or the user.lfs.trace attribute of the root);
+ * LFS_TRACE = 0 compiles the trace points out.                       */
+#ifndef LFS_TRACE
+#define LFS_TRACE           1
+#endif
+#ifndef LFS_TRACE_EVENTS
+#define LFS_TRACE_EVENTS    8192
+#endif
+
 #define INODE_TYPE_FILE  1
 #define INODE_TYPE_DIR   2
 
 #define MAX_DIRECT_PTRS  10
 #define MAX_NAME_LEN     28
 
-/* Number of block pointers that fit in one 4KB indirect block       */
+/* Named read-only snapshots, listed in the superblock               */
+#define LFS_MAX_SNAPSHOTS   16
+#define LFS_SNAPDIR_NAME    ".snapshots"
+#define LFS_CTLDIR_NAME     ".lfs"          /* virtual control files   */
+
+/* Number of block pointers that fit in one indirect block          */
 #define PTRS_PER_BLOCK   (BLOCK_SIZE / sizeof(uint32_t))   /* 1024   */
 
-/* Max file size:
+/* Max file size with 4 KB blocks (16 KB: 64 MB, 64 KB: 1 GB):
  *   10 direct blocks        =   40 KB
  *   1 indirect → 1024 ptrs = 4096 KB
  *   Total                  = 4136 KB                                 */
@@ -41,16 +196,32 @@
    On-disk structures  (all must fit inside BLOCK_SIZE)
    ================================================================ */
 
-/* Block 0 */
+/*
+ * Snapshot table entry.  A snapshot is a frozen copy of the inode map,
+ * appended to the log as one block; everything it references stays
+ * live for GC until the snapshot is deleted.
+ */
+struct lfs_snapshot {
+    char     name[MAX_NAME_LEN];
+    uint32_t imap_block;       /* frozen inode map, 0 = free slot   */
+} __attribute__((packed));
+
+/* Block 0 — written by mkfs; the mutable fields live in checkpoints */
 struct lfs_superblock {
     uint32_t magic;
     uint32_t block_size;
     uint32_t total_blocks;
-    uint32_t inode_map_block;  /* which block holds the inode map   */
+    uint32_t inode_map_block;  /* first checkpoint region           */
     uint32_t log_start;        /* first writable log block          */
     uint32_t log_tail;         /* next free block in the log        */
     uint32_t commit_seq;       /* sequence number of last commit    */
-    uint8_t  _pad[BLOCK_SIZE - 7*sizeof(uint32_t)];
+    struct lfs_snapshot snap[LFS_MAX_SNAPSHOTS];
+    uint32_t seg_blocks;       /* blocks per segment, 0 = pre-dates
+                                  the field (BLOCKS_PER_SEGMENT)    */
+    uint32_t fs_id;            /* random per mkfs, 0 on old images  */
+    uint32_t inode_count;      /* inode capacity, 0 = INODE_MAP_SIZE */
+    uint8_t  _pad[BLOCK_SIZE - 10*sizeof(uint32_t)
+                  - LFS_MAX_SNAPSHOTS*sizeof(struct lfs_snapshot)];
 } __attribute__((packed));
 
 /* One inode — stored inside a log block */
@@ -71,83 +242,429 @@ struct lfs_dirent {
 };
 
 /*
- * Segment summary — stored as the FIRST block of every segment.
+ * Segment summary — stored in the FIRST block(s) of every segment.
+ *
+ * One summary block describes LFS_SUM_ENTRIES consecutive blocks of
+ * its segment; a segment of S blocks starts with
+ * ceil(S / LFS_SUM_ENTRIES) of them (state->sum_blocks), and summary
+ * k holds the entries for offsets k * LFS_SUM_ENTRIES onwards, indexed
+ * by offset modulo LFS_SUM_ENTRIES.  Each is sealed and checksummed on
+ * its own, so an append rewrites one summary block whatever the
+ * segment size.  Summary blocks are reserved: the log never places
+ * data there, and their own entries stay unused.
+ * Segment 0 has no summary (block 0 is the superblock).
+ *
+ * 'length' is the number of bytes used in the block: BLOCK_SIZE for
+ * a raw block, the payload size for a packed block of compressed
+ * records ('nrec' > 0).  'type' tags what the block holds so
+ * roll-forward recovery never has to guess.
+ *
+ * ss_seq is the superblock's commit_seq when the summary was last
+ * written: a summary with ss_seq >= commit_seq has been written since
+ * the last checkpoint.  ss_fsid is the superblock's fs_id, so
+ * summaries an earlier filesystem left on the device (mkfs does not
+ * clear them) are never replayed.  ss_csum is the CRC32C of the
+ * whole block (computed with ss_csum = 0).
+ *
+ * 'csum' is the CRC32C of the block as written, with LFS_SUM_HAS_CSUM
+ * set in 'flags'.  Inode and indirect blocks always carry one (so
+ * roll-forward can tell a torn inode); data blocks only with data
+ * checksums on, and never when spliced by write_buf.
  */
+#define LFS_SUMMARY_MAGIC   0x53534653     /* "SFSS"                  */
+
+#define LFS_BLK_FREE        0              /* slot not written        */
+#define LFS_BLK_DATA        1              /* file or directory data  */
+#define LFS_BLK_INODE       2
+#define LFS_BLK_INDIRECT    3
+#define LFS_BLK_IMAP        4              /* snapshot inode map      */
+
+#define LFS_SUM_HAS_CSUM    0x01           /* entry flags             */
+
+#define LFS_SUM_ENTRIES     ((uint32_t)((BLOCK_SIZE - 4 * sizeof(uint32_t)) \
+                             / (5 * sizeof(uint32_t))))  /* 204 at 4 KB */
+
 struct lfs_segment_summary {
+    uint32_t ss_magic;         /* LFS_SUMMARY_MAGIC                 */
+    uint32_t ss_seq;
+    uint32_t ss_csum;
+    uint32_t ss_fsid;
     struct {
         uint32_t inode_no;
         uint32_t block_idx;
-    } entry[BLOCKS_PER_SEGMENT];
-    uint8_t _pad[BLOCK_SIZE
-                 - BLOCKS_PER_SEGMENT * 2 * sizeof(uint32_t)];
+        uint32_t length;
+        uint32_t csum;         /* CRC32C of the block contents      */
+        uint16_t nrec;
+        uint8_t  type;         /* LFS_BLK_*                         */
+        uint8_t  flags;        /* LFS_SUM_*                         */
+    } entry[LFS_SUM_ENTRIES];
+    uint8_t _pad[BLOCK_SIZE - 4 * sizeof(uint32_t)
+                 - LFS_SUM_ENTRIES * 5 * sizeof(uint32_t)];
 } __attribute__((packed));
 
+/* Is block 'b' one of the summary blocks at the start of a segment? */
+#define IS_SUMMARY_BLOCK(st, b) \
+    ((b) >= (st)->seg_blocks && (b) % (st)->seg_blocks < (st)->sum_blocks)
+
+/* The summary block describing block 'b' (0 in segment 0, which has
+ * none) and the index of b's entry in it                            */
+#define LFS_SUM_BLOCK(st, b)                                         \
+    ((b) < (st)->seg_blocks ? 0u                                     \
+     : (b) - (b) % (st)->seg_blocks                                  \
+           + (b) % (st)->seg_blocks / LFS_SUM_ENTRIES)
+#define LFS_SUM_INDEX(st, b) ((b) % (st)->seg_blocks % LFS_SUM_ENTRIES)
+
 /*
- * Commit block — Stage 8 crash recovery.
+ * Packed block — several compressed data blocks sharing one log block.
  *
- * Written as the LAST action of every log_checkpoint.
- * Stored at a fixed location: block 2 (just after inode map).
+ * A data pointer (direct[] or indirect entry) with LFS_PTR_PACKED set
+ * does not name a raw block: bits 0-27 give the packed block and
+ * bits 28-30 the record slot inside it.  Inode map entries and the
+ * indirect pointer itself are never packed.
  *
- * Recovery logic on mount:
- *   Read the commit block.  If commit_magic matches and
- *   commit_seq == superblock.commit_seq, the last checkpoint
- *   completed fully — trust the superblock's log_tail.
+ * GC relocates a packed block as a unit, so compressed data is moved
+ * without being decompressed; only the block bits of each pointer
+ * change.
+ */
+#define LFS_PACK_MAGIC      0x4B415046     /* "FPAK"                  */
+#define LFS_PACK_MAX        8              /* records per block       */
+
+#define LFS_PTR_PACKED      0x80000000u
+#define LFS_PTR_SLOT_SHIFT  28
+#define LFS_PTR_SLOT_MASK   0x7u
+#define LFS_PTR_BLOCK_MASK  0x0FFFFFFFu
+#define LFS_PTR_BLOCK(p)    ((p) & LFS_PTR_BLOCK_MASK)
+#define LFS_PTR_SLOT(p)     (((p) >> LFS_PTR_SLOT_SHIFT) & LFS_PTR_SLOT_MASK)
+
+#define LFS_CODEC_NONE      0
+#define LFS_CODEC_LZ4       1
+#define LFS_CODEC_ZSTD      2
+
+struct lfs_pack_hdr {
+    uint32_t pack_magic;       /* LFS_PACK_MAGIC                    */
+    uint16_t nrec;
+    uint16_t _rsvd;
+    struct {
+        uint16_t off;          /* byte offset of record in block    */
+        uint16_t len;          /* compressed length                 */
+        uint8_t  codec;        /* LFS_CODEC_*                       */
+        uint8_t  _rsvd[3];
+    } rec[LFS_PACK_MAX];
+} __attribute__((packed));
+
+/*
+ * Checkpoint region — Stage 8 crash recovery.
+ *
+ * A checkpoint is one self-contained block holding everything that
+ * changes between checkpoints: log_tail, the snapshot table and the
+ * inode map.  There are two regions, CKPT_BLOCK_A and CKPT_BLOCK_B;
+ * checkpoint N goes to A when N is odd and to B when it is even, so
+ * the previous checkpoint is never overwritten.
  *
- *   Otherwise the last checkpoint was interrupted mid-write.
- *   Scan forward from log_start to find the true end of the log
- *   and rewind log_tail to the last fully-written block.
+ * On mount both regions are read and the valid one (magic and
+ * checksum ok) with the highest ck_seq wins.  A torn write simply
+ * leaves that region invalid and the other one is used; roll-forward
+ * then replays whatever was appended after it.
  *
- * The checksum is a simple XOR of all inode_map[] entries so we
- * can detect a partially-written inode map block.
+ * The superblock at block 0 holds the static geometry and is written
+ * only by mkfs; its log_tail/commit_seq/snap[] fields are loaded from
+ * the newest checkpoint at mount.
  */
-#define LFS_COMMIT_MAGIC  0xC0FFEE42
-#define COMMIT_BLOCK      2            /* fixed location on disk     */
+#define LFS_CKPT_MAGIC    0xC0FFEE42
 
-struct lfs_commit {
-    uint32_t commit_magic;   /* LFS_COMMIT_MAGIC                    */
-    uint32_t commit_seq;     /* must match superblock.commit_seq    */
+struct lfs_checkpoint {
+    uint32_t ck_magic;       /* LFS_CKPT_MAGIC                      */
+    uint32_t ck_seq;         /* commit_seq of this checkpoint       */
+    uint64_t ck_time;        /* wall-clock time, seconds            */
+    uint32_t ck_csum;        /* CRC32C of the block, ck_csum = 0    */
     uint32_t log_tail;       /* log_tail at time of this checkpoint */
-    uint32_t imap_crc;       /* XOR checksum of inode_map[]         */
-    uint8_t  _pad[BLOCK_SIZE - 4*sizeof(uint32_t)];
+    struct lfs_snapshot snap[LFS_MAX_SNAPSHOTS];
+    uint32_t inode_map[INODE_MAP_SIZE];
+    uint8_t  _pad[BLOCK_SIZE - 6*sizeof(uint32_t)
+                  - LFS_MAX_SNAPSHOTS*sizeof(struct lfs_snapshot)
+                  - INODE_MAP_SIZE*sizeof(uint32_t)];
 } __attribute__((packed));
 
 /* ================================================================
    In-memory runtime state  (not written to disk as a unit)
    ================================================================ */
+struct dedup_index;            /* private to dedup.c                 */
+
 struct lfs_state {
     int      disk_fd;
     struct   lfs_superblock sb;
     uint32_t inode_map[INODE_MAP_SIZE];
     uint32_t log_tail;         /* mirrors sb.log_tail, updated live  */
+    uint32_t seg_blocks;       /* geometry from the superblock, see  */
+    uint32_t sum_blocks;       /*   log_geometry()                   */
+    uint32_t inode_count;      /* inodes inode_alloc() may hand out  */
+
+    /* Frozen inode map of each snapshot in sb.snap[], read from its
+     * map block on first use (bit s of snap_loaded)                  */
+    uint32_t snap_imap[LFS_MAX_SNAPSHOTS][INODE_MAP_SIZE];
+    uint32_t snap_loaded;
+
+    int      compress;         /* LFS_CODEC_* used for new data      */
+    int      dedup;            /* share identical data blocks        */
+    int      data_csum;        /* checksum data blocks, verify reads */
+    int      sync_mode;        /* LFS_SYNC_*                         */
+    uint32_t gc_threshold;     /* free blocks below which GC runs    */
+    uint32_t ckpt_interval;    /* appending ops per checkpoint       */
+    uint32_t ckpt_pending;     /* ... since the last checkpoint      */
+    uint32_t ckpt_tail;        /* log_tail of the last checkpoint    */
+    uint32_t recover_threads;  /* 0 = LFS_RECOVER_THREADS            */
+
+    /*
+     * Durability tracking for fsync: append_seq counts appended
+     * blocks, synced_seq is its value at the last flush and ino_seq[]
+     * its value when each inode was last written.  gc_unsynced is set
+     * while relocations are not yet known to be on disk.
+     */
+    uint64_t append_seq;
+    uint64_t synced_seq;
+    uint64_t ino_seq[INODE_MAP_SIZE];
+    int      gc_unsynced;
+    uint32_t gc_epoch;         /* bumped by every GC pass            */
+    struct   dedup_index *dedup_idx;   /* fingerprint -> data ptr   */
+
+    /* Summary block covering the log tail (0 = not loaded) */
+    uint32_t seg_sum_blk;
+    struct   lfs_segment_summary seg_sum;
+
+    /* Last summary block read to verify a data block (0 = none) */
+    uint32_t vsum_blk;
+    struct   lfs_segment_summary vsum;
 };
 
 /* ================================================================
    Disk layer API  (disk.c)
    ================================================================ */
 int  disk_open (const char *path);
+#define DISK_DIRECT  0x1             /* disk_open_ex() flags          */
+#define DISK_MMAP    0x2
+int  disk_open_ex(const char *path, int flags);
+int  disk_is_direct(void);
 int  disk_read (uint32_t block, void *buf);
+int  disk_read_uncached(uint32_t block, void *buf);
+int  disk_read_range(uint32_t block, uint32_t n, void *buf);
 int  disk_write(uint32_t block, const void *buf);
+int  disk_get_fd(void);
+void disk_note_write(uint32_t block, uint32_t n);
+uint64_t disk_blocks_written(void);
+int  disk_sync (int datasync);
+void *disk_buf_get(void);
+void  disk_buf_put(void *buf);
+void *disk_alloc  (size_t len);
+const void *disk_map_block(uint32_t block);
+void disk_prefetch(uint32_t block, uint32_t n);
 void disk_close(void);
 
+/* ================================================================
+   Block cache  (cache.c)
+   ================================================================ */
+struct cache_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t prefetched;       /* blocks inserted by readahead      */
+    uint64_t ra_hits;          /* ... and later hit                 */
+};
+
+int      cache_init      (uint32_t nblocks);
+int      cache_lookup    (uint32_t block, void *buf);
+int      cache_contains  (uint32_t block);
+uint64_t cache_gen       (void);
+void     cache_insert    (uint32_t block, const void *buf,
+                          uint64_t read_gen, int prefetched);
+void     cache_update    (uint32_t block, const void *buf);
+int      cache_verified  (uint32_t block);
+void     cache_set_verified(uint32_t block);
+void     cache_invalidate(uint32_t block, uint32_t n);
+uint64_t cache_ra_hits   (void);
+void     cache_get_stats (struct cache_stats *out);
+void     cache_free      (void);
+
+/* ================================================================
+   Readahead  (readahead.c)
+   ================================================================ */
+
+/* Per-stream sequential detection state; zero-initialise */
+struct lfs_ra {
+    uint32_t next;             /* logical block expected next       */
+    uint32_t window;           /* current window, blocks            */
+    uint32_t ra_end;           /* prefetch issued up to here        */
+};
+
+int  ra_start (uint32_t max);
+void ra_stop  (void);
+int  ra_window(struct lfs_ra *ra, uint32_t first, uint32_t nblocks,
+               uint32_t hits, uint32_t *from);
+void ra_submit(const uint32_t *blocks, uint32_t n);
+
 /* ================================================================
    Log layer API  (log.c)
    ================================================================ */
 int  log_append    (struct lfs_state *state, const void *buf);
+int  log_append_ex (struct lfs_state *state, const void *buf,
+                    uint32_t inode_no, uint32_t block_idx, int type);
+int  log_append_data(struct lfs_state *state, uint32_t inode_no,
+                     const uint32_t *block_idx, const uint8_t *data,
+                     uint32_t nblocks, uint32_t *ptrs_out);
+int  log_read_data (struct lfs_state *state, uint32_t ptr, void *buf);
+int  log_reserve   (struct lfs_state *state, uint32_t inode_no,
+                    const uint32_t *block_idx, uint32_t nblocks,
+                    uint32_t *ptrs_out);
+void log_seal_summary(const struct lfs_state *state,
+                      struct lfs_segment_summary *ss);
+int  log_geometry  (struct lfs_state *state);
 int  log_checkpoint(struct lfs_state *state);
+int  log_load_checkpoint(struct lfs_state *state);
+int  log_sync      (struct lfs_state *state);
+int  log_sync_inode(struct lfs_state *state, uint32_t ino);
 int  log_recover   (struct lfs_state *state);   /* Stage 8 */
 
+/* ================================================================
+   Checksums  (crc32c.c)
+   ================================================================ */
+uint32_t crc32c   (uint32_t crc, const void *buf, size_t len);
+uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len);
+int      crc32c_hw_available(void);
+
+/* ================================================================
+   Block codecs  (compress.c)
+   ================================================================ */
+int  lfs_compress  (int codec, const void *src, void *dst, size_t cap);
+int  lfs_decompress(int codec, const void *src, size_t len, void *dst);
+int  lfs_codec_available(int codec);
+
+/* ================================================================
+   Deduplication  (dedup.c)
+   ================================================================ */
+uint64_t dedup_hash  (const void *block);
+int      dedup_lookup(struct lfs_state *state, uint64_t hash,
+                      const void *block, uint32_t *ptr_out);
+void     dedup_insert(struct lfs_state *state, uint64_t hash, uint32_t ptr);
+struct gc_table;
+void     dedup_prune (struct lfs_state *state, const struct gc_table *t);
+void     dedup_relocate(struct lfs_state *state, const struct gc_table *t);
+void     dedup_free  (struct lfs_state *state);
+
 /* ================================================================
    Inode helpers  (inode.c)
    ================================================================ */
 int  inode_read (struct lfs_state *state, uint32_t ino,
                  struct lfs_inode *out);
+int  inode_read_map(const uint32_t *imap, uint32_t ino,
+                    struct lfs_inode *out);
 int  inode_write(struct lfs_state *state, const struct lfs_inode *in);
 int  inode_alloc(struct lfs_state *state);
 
+/* ================================================================
+   Snapshots  (snapshot.c)
+   ================================================================ */
+int  snapshot_load     (struct lfs_state *state);
+uint32_t *snapshot_map (struct lfs_state *state, int slot);
+int  snapshot_find     (struct lfs_state *state, const char *name);
+int  snapshot_create   (struct lfs_state *state, const char *name);
+int  snapshot_delete   (struct lfs_state *state, const char *name);
+int  snapshot_write_map(struct lfs_state *state, int slot);
+
 /* ================================================================
    Garbage collector  (gc.c)
    ================================================================ */
+
+/* A block one GC pass found referenced.  The pass keeps them in a
+ * table sorted by 'blk', sized by what the roots reach rather than
+ * by the disk; dedup_prune() and dedup_relocate() look blocks up in
+ * it with gc_find().                                               */
+struct gc_block {
+    uint32_t blk;              /* location before the pass           */
+    uint32_t to;               /* location after it, 0 = not moved   */
+    uint16_t refs;             /* references, saturating             */
+    uint8_t  fixed;            /* pointers inside already relocated  */
+};
+struct gc_table {
+    struct gc_block *b;
+    size_t           n;
+};
+
 int  gc_should_run(struct lfs_state *state);
 int  gc_collect   (struct lfs_state *state);
+struct gc_block *gc_find(const struct gc_table *t, uint32_t blk);
+
+/* ================================================================
+   Statistics  (stats.c)
+   ================================================================ */
+
+/* Timed operations: a count, an error count and a latency histogram */
+enum lfs_stat_op {
+    STAT_GETATTR, STAT_READDIR, STAT_OPEN, STAT_RELEASE, STAT_READ,
+    STAT_READ_BUF, STAT_CREATE, STAT_WRITE, STAT_WRITE_BUF,
+    STAT_TRUNCATE, STAT_UNLINK, STAT_MKDIR, STAT_RMDIR,
+    STAT_COPY_FILE_RANGE, STAT_FSYNC, STAT_FSYNCDIR, STAT_FLUSH,
+    STAT_GETXATTR, STAT_SETXATTR,
+    STAT_DISK_READ, STAT_DISK_WRITE, STAT_DISK_SYNC,
+    STAT_LOG_APPEND, STAT_CHECKPOINT, STAT_GC,
+    STAT_NOPS
+};
+
+/* Plain counters */
+enum lfs_stat_ctr {
+    CTR_LOG_BLOCKS,            /* blocks appended, incl. reserved   */
+    CTR_GC_MOVED,              /* blocks copied by GC               */
+    CTR_GC_RECLAIMED,          /* blocks the log tail moved back    */
+    STAT_NCTRS
+};
+
+uint64_t stats_now   (void);
+void     stats_record(enum lfs_stat_op op, uint64_t start, int failed);
+void     stats_add   (enum lfs_stat_ctr ctr, uint64_t n);
+char    *stats_text  (const struct lfs_state *state, size_t *len);
+const char *stats_op_name(enum lfs_stat_op op);
+
+/* ================================================================
+   Tracing  (trace.c)
+   ================================================================ */
+
+/*
+ * A trace dump (/.lfs/trace) is a struct lfs_trace_hdr, then 'nops'
+ * operation names of LFS_TRACE_NAME bytes indexed by lfs_stat_op, then
+ * 'nevents' events.  trace2json converts it for chrome://tracing.
+ */
+#define LFS_TRACE_MAGIC     0x4352544C     /* "LTRC"                  */
+#define LFS_TRACE_VERSION   1
+#define LFS_TRACE_NAME      32
+
+struct lfs_trace_hdr {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t nops;
+    uint32_t nevents;
+};
+
+struct lfs_trace_event {
+    uint64_t start;            /* ns, CLOCK_MONOTONIC               */
+    uint32_t dur;              /* ns, saturating                    */
+    uint16_t op;               /* enum lfs_stat_op                  */
+    uint16_t tid;              /* ring (thread) number              */
+    uint32_t ino;              /* 0 if none                         */
+    uint32_t block;            /* physical block, 0 if none         */
+    int64_t  arg;              /* result, log index, seq, ...       */
+};
+
+extern int trace_on;
+
+void  trace_set (int on);
+void  trace_span(enum lfs_stat_op op, uint64_t start, uint32_t ino,
+                 uint32_t block, int64_t arg);
+char *trace_dump(size_t *len);
+void  trace_free(void);
+
+/* One finished operation that began at 'start' (stats_now) */
+#define TRACE_SPAN(op, start, ino, block, arg)                       \
+    do {                                                             \
+        if (LFS_TRACE && __builtin_expect(trace_on, 0))              \
+            trace_span((op), (start), (ino), (block), (arg));        \
+    } while (0)
 
 #endif /* LFS_H */
@@ -1,284 +1,942 @@
 /*
  * log.c — Log-Structured Filesystem write path
  *
- *   log_append()     — write one block to the next free log position
- *   log_checkpoint() — persist inode map + superblock + commit block
- *   log_recover()    — Stage 8: verify or repair log tail on mount
+ *   log_append()      — write one block to the next free log position
+ *   log_append_data() — append file data, packing compressed blocks
+ *   log_reserve()     — allocate data blocks the caller fills itself
+ *   log_read_data()   — read a data block through its (packed) pointer
+ *   log_checkpoint()  — persist state to the older checkpoint region
+ *   log_recover()     — Stage 8: roll forward from the last checkpoint
  */
 
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
 #include "lfs.h"
 
 /* ------------------------------------------------------------------ */
 /*  Internal helpers                                                    */
 /* ------------------------------------------------------------------ */
 
-static uint32_t get_summary_block(uint32_t block)
+/* Set the magic, owner and checksum of a summary about to be written */
+void log_seal_summary(const struct lfs_state *state,
+                      struct lfs_segment_summary *ss)
 {
-    uint32_t seg = block / BLOCKS_PER_SEGMENT;
-    return seg * BLOCKS_PER_SEGMENT;
+    ss->ss_magic = LFS_SUMMARY_MAGIC;
+    ss->ss_fsid  = state->sb.fs_id;
+    ss->ss_csum  = 0;
+    ss->ss_csum  = crc32c(0, ss, sizeof(*ss));
+}
+
+static int summary_valid(struct lfs_segment_summary *ss, uint32_t fs_id)
+{
+    if (ss->ss_magic != LFS_SUMMARY_MAGIC || ss->ss_fsid != fs_id)
+        return 0;
+    uint32_t csum = ss->ss_csum;
+    ss->ss_csum = 0;
+    int ok = crc32c(0, ss, sizeof(*ss)) == csum;
+    ss->ss_csum = csum;
+    return ok;
 }
 
 /*
- * imap_crc
+ * log_geometry — called at mount, after the superblock is read.
  *
- * Simple XOR checksum over all inode_map[] entries.
- * Cheap to compute and enough to detect a torn/partial write of the
- * inode map block.
+ * Checks that this build can use the geometry mkfs chose and derives
+ * the segment layout (state->seg_blocks, state->sum_blocks) every
+ * other log function relies on, and the inode capacity.  Returns 0
+ * or -1.
  */
-static uint32_t imap_crc(const uint32_t *imap)
+int log_geometry(struct lfs_state *state)
 {
-    uint32_t crc = 0;
-    for (int i = 0; i < INODE_MAP_SIZE; i++)
-        crc ^= imap[i];
-    return crc;
+    if (!state) return -1;
+
+    const struct lfs_superblock *sb = &state->sb;
+    uint32_t seg = sb->seg_blocks ? sb->seg_blocks : BLOCKS_PER_SEGMENT;
+
+    if (sb->block_size != BLOCK_SIZE || seg < LFS_SEG_MIN_BLOCKS ||
+        (seg & (seg - 1)) != 0 ||
+        (uint64_t)seg * BLOCK_SIZE > LFS_SEG_MAX_BYTES ||
+        sb->total_blocks < 2 * seg || sb->total_blocks % seg != 0 ||
+        sb->total_blocks > LFS_PTR_BLOCK_MASK) {
+        fprintf(stderr, "log_geometry: unsupported geometry (block %u, "
+                        "segment %u blocks, %u blocks)\n",
+                sb->block_size, seg, sb->total_blocks);
+        return -1;
+    }
+
+    uint32_t inodes = sb->inode_count ? sb->inode_count : INODE_MAP_SIZE;
+    if (inodes < 2 || inodes > INODE_MAP_SIZE) {
+        fprintf(stderr, "log_geometry: %u inodes, this build supports "
+                        "%d\n", inodes, INODE_MAP_SIZE);
+        return -1;
+    }
+
+    state->seg_blocks  = seg;
+    state->sum_blocks  = (seg + LFS_SUM_ENTRIES - 1) / LFS_SUM_ENTRIES;
+    state->inode_count = inodes;
+    return 0;
 }
 
 /* ------------------------------------------------------------------ */
 /*  log_append_ex                                                       */
 /* ------------------------------------------------------------------ */
 
-int log_append_ex(struct lfs_state *state, const void *buf,
-                  uint32_t inode_no, uint32_t block_idx)
+/*
+ * Make state->seg_sum the summary block that describes 'block'.  The
+ * first data block it covers starts a fresh summary; a partially
+ * filled one (e.g. after remount) is read back.
+ */
+static void load_summary(struct lfs_state *state, uint32_t block)
 {
-    if (!state || !buf) return -1;
+    uint32_t sum_block = LFS_SUM_BLOCK(state, block);
+    if (state->seg_sum_blk == sum_block) return;
+
+    uint32_t first = block - LFS_SUM_INDEX(state, block);
+    uint32_t data  = block - block % state->seg_blocks + state->sum_blocks;
+    if (first < data) first = data;
+
+    memset(&state->seg_sum, 0, sizeof(state->seg_sum));
+    if (block > first)
+        disk_read(sum_block, &state->seg_sum);
+    state->seg_sum_blk = sum_block;
+}
+
+/*
+ * Return the block the next append will use, skipping the summary
+ * blocks at the start of a segment.  -1 if the disk is full.
+ */
+static int log_next_block(struct lfs_state *state)
+{
+    /* The first blocks of every segment are reserved for its summary */
+    if (IS_SUMMARY_BLOCK(state, state->log_tail))
+        state->log_tail += state->sum_blocks
+                         - state->log_tail % state->seg_blocks;
 
     if (state->log_tail >= state->sb.total_blocks) {
         fprintf(stderr, "log_append: disk full (tail=%u, total=%u)\n",
                 state->log_tail, state->sb.total_blocks);
         return -1;
     }
+    return (int)state->log_tail;
+}
 
-    uint32_t block = state->log_tail;
+/*
+ * Record 'block' in the in-memory segment summary and advance the
+ * tail past it.  The caller writes the summary out.
+ */
+static void log_record(struct lfs_state *state, uint32_t block,
+                       uint32_t inode_no, uint32_t block_idx,
+                       uint32_t length, uint16_t nrec, int type,
+                       const void *buf)
+{
+    uint32_t sum_block = LFS_SUM_BLOCK(state, block);
+    uint32_t offset    = LFS_SUM_INDEX(state, block);
+
+    /* Segment 0 has no summary */
+    if (sum_block != 0) {
+        load_summary(state, block);
+        state->seg_sum.entry[offset].inode_no  = inode_no;
+        state->seg_sum.entry[offset].block_idx = block_idx;
+        state->seg_sum.entry[offset].length    = length;
+        state->seg_sum.entry[offset].nrec      = nrec;
+        state->seg_sum.entry[offset].type      = (uint8_t)type;
+        state->seg_sum.entry[offset].csum      = 0;
+        state->seg_sum.entry[offset].flags     = 0;
+        if (buf && (state->data_csum || type != LFS_BLK_DATA)) {
+            state->seg_sum.entry[offset].csum  = crc32c(0, buf, BLOCK_SIZE);
+            state->seg_sum.entry[offset].flags = LFS_SUM_HAS_CSUM;
+        }
+    }
 
-    if (disk_write(block, buf) != 0) {
-        fprintf(stderr, "log_append: disk_write failed at block %u\n",
-                block);
+    state->log_tail    = block + 1;
+    state->sb.log_tail = state->log_tail;
+    state->append_seq++;
+    stats_add(CTR_LOG_BLOCKS, 1);
+}
+
+static void log_write_summary(struct lfs_state *state)
+{
+    if (state->seg_sum_blk == 0) return;
+    state->seg_sum.ss_seq = state->sb.commit_seq;
+    log_seal_summary(state, &state->seg_sum);
+    disk_write(state->seg_sum_blk, &state->seg_sum);
+
+    /* The verify cache must not keep an older copy of this summary */
+    if (state->vsum_blk == state->seg_sum_blk)
+        state->vsum_blk = 0;
+}
+
+/*
+ * Write one block at log_tail and record it in the segment summary.
+ * 'length' and 'nrec' describe packed blocks (see lfs.h).
+ */
+static int log_write_block(struct lfs_state *state, const void *buf,
+                           uint32_t inode_no, uint32_t block_idx,
+                           uint32_t length, uint16_t nrec, int type)
+{
+    if (!state || !buf) return -1;
+
+    uint64_t t0 = stats_now();
+    int block = log_next_block(state);
+    if (block < 0) {
+        stats_record(STAT_LOG_APPEND, t0, 1);
         return -1;
     }
 
-    /* Update segment summary */
-    uint32_t sum_block = get_summary_block(block);
-    uint32_t offset    = block - sum_block;
-
-    if (offset != 0) {
-        struct lfs_segment_summary sum;
-        memset(&sum, 0, sizeof(sum));
-        disk_read(sum_block, &sum);
-        sum.entry[offset].inode_no  = inode_no;
-        sum.entry[offset].block_idx = block_idx;
-        disk_write(sum_block, &sum);
+    if (disk_write((uint32_t)block, buf) != 0) {
+        fprintf(stderr, "log_append: disk_write failed at block %d\n",
+                block);
+        stats_record(STAT_LOG_APPEND, t0, 1);
+        return -1;
     }
 
-    state->log_tail++;
-    state->sb.log_tail = state->log_tail;
+    log_record(state, (uint32_t)block, inode_no, block_idx, length, nrec,
+               type, buf);
+    log_write_summary(state);
+    stats_record(STAT_LOG_APPEND, t0, 0);
+    TRACE_SPAN(STAT_LOG_APPEND, t0, inode_no, (uint32_t)block, block_idx);
+    return block;
+}
 
-    return (int)block;
+int log_append_ex(struct lfs_state *state, const void *buf,
+                  uint32_t inode_no, uint32_t block_idx, int type)
+{
+    return log_write_block(state, buf, inode_no, block_idx,
+                           BLOCK_SIZE, 0, type);
 }
 
 int log_append(struct lfs_state *state, const void *buf)
 {
-    return log_append_ex(state, buf, 0, 0);
+    return log_append_ex(state, buf, 0, 0, LFS_BLK_DATA);
+}
+
+/*
+ * log_reserve
+ *
+ * Allocates 'nblocks' raw data blocks for logical blocks block_idx[]
+ * of inode 'inode_no' and records them in the segment summaries, but
+ * writes no data: the caller fills the blocks itself (the FUSE
+ * write_buf path splices straight into the image).  Consecutive
+ * pointers in ptrs_out are physically contiguous except across a
+ * segment's summary blocks.
+ */
+int log_reserve(struct lfs_state *state, uint32_t inode_no,
+                const uint32_t *block_idx, uint32_t nblocks,
+                uint32_t *ptrs_out)
+{
+    if (!state || !block_idx || !ptrs_out) return -1;
+
+    for (uint32_t i = 0; i < nblocks; i++) {
+        int block = log_next_block(state);
+        if (block < 0) {
+            if (i > 0) log_write_summary(state);
+            return -1;
+        }
+        log_record(state, (uint32_t)block, inode_no, block_idx[i],
+                   BLOCK_SIZE, 0, LFS_BLK_DATA, NULL);
+        ptrs_out[i] = (uint32_t)block;
+
+        /* Flush each summary block once rather than per block */
+        if (i == nblocks - 1 ||
+            LFS_SUM_BLOCK(state, state->log_tail) != state->seg_sum_blk)
+            log_write_summary(state);
+    }
+    return 0;
 }
 
 /* ------------------------------------------------------------------ */
-/*  log_checkpoint                                                      */
+/*  Compressed data blocks                                              */
 /* ------------------------------------------------------------------ */
 
 /*
- * log_checkpoint — make the current state fully durable.
+ * A pack under construction: header + payload in one block buffer,
+ * plus which input block each record came from.
+ */
+struct pack_buf {
+    uint8_t  block[BLOCK_SIZE]        /* aligned for O_DIRECT        */
+             __attribute__((aligned(LFS_DISK_ALIGN)));
+    uint32_t used;                    /* bytes of block in use       */
+    uint32_t src[LFS_PACK_MAX];       /* input index of each record  */
+};
+
+static void pack_reset(struct pack_buf *pk)
+{
+    memset(pk->block, 0, BLOCK_SIZE);
+    ((struct lfs_pack_hdr *)pk->block)->pack_magic = LFS_PACK_MAGIC;
+    pk->used = sizeof(struct lfs_pack_hdr);
+}
+
+/*
+ * Append the pending pack.  A pack holding a single record saves no
+ * space, so that block is written raw instead.
+ */
+static int pack_flush(struct lfs_state *state, struct pack_buf *pk,
+                      uint32_t inode_no, const uint32_t *block_idx,
+                      const uint8_t *data, uint32_t *ptrs_out)
+{
+    struct lfs_pack_hdr *hdr = (struct lfs_pack_hdr *)pk->block;
+    int blk;
+
+    if (hdr->nrec == 0) return 0;
+
+    if (hdr->nrec == 1) {
+        uint32_t i = pk->src[0];
+        blk = log_append_ex(state, data + (size_t)i * BLOCK_SIZE,
+                            inode_no, block_idx[i], LFS_BLK_DATA);
+        if (blk < 0) return -1;
+        ptrs_out[i] = (uint32_t)blk;
+    } else {
+        blk = log_write_block(state, pk->block, inode_no,
+                              block_idx[pk->src[0]], pk->used, hdr->nrec,
+                              LFS_BLK_DATA);
+        if (blk < 0) return -1;
+        for (uint32_t r = 0; r < hdr->nrec; r++)
+            ptrs_out[pk->src[r]] = LFS_PTR_PACKED
+                                 | (r << LFS_PTR_SLOT_SHIFT)
+                                 | (uint32_t)blk;
+    }
+
+    pack_reset(pk);
+    return 0;
+}
+
+/*
+ * Store the blocks of a batch that are not marked in 'skip', packing
+ * compressed ones when compression is enabled.
+ */
+static int store_blocks(struct lfs_state *state, uint32_t inode_no,
+                        const uint32_t *block_idx, const uint8_t *data,
+                        uint32_t nblocks, const uint8_t *skip,
+                        uint32_t *ptrs_out)
+{
+    if (state->compress == LFS_CODEC_NONE) {
+        for (uint32_t i = 0; i < nblocks; i++) {
+            if (skip[i]) continue;
+            int blk = log_append_ex(state, data + (size_t)i * BLOCK_SIZE,
+                                    inode_no, block_idx[i], LFS_BLK_DATA);
+            if (blk < 0) return -1;
+            ptrs_out[i] = (uint32_t)blk;
+        }
+        return 0;
+    }
+
+    struct pack_buf pk;
+    uint8_t cbuf[BLOCK_SIZE];
+    pack_reset(&pk);
+
+    for (uint32_t i = 0; i < nblocks; i++) {
+        if (skip[i]) continue;
+
+        const uint8_t *src = data + (size_t)i * BLOCK_SIZE;
+        size_t room = BLOCK_SIZE - sizeof(struct lfs_pack_hdr);
+
+        /* Only worth packing if at least two records fit per block */
+        int clen = lfs_compress(state->compress, src, cbuf, room / 2);
+        if (clen <= 0) {
+            int blk = log_append_ex(state, src, inode_no, block_idx[i],
+                                    LFS_BLK_DATA);
+            if (blk < 0) return -1;
+            ptrs_out[i] = (uint32_t)blk;
+            continue;
+        }
+
+        struct lfs_pack_hdr *hdr = (struct lfs_pack_hdr *)pk.block;
+        if (hdr->nrec == LFS_PACK_MAX ||
+            pk.used + (uint32_t)clen > BLOCK_SIZE) {
+            if (pack_flush(state, &pk, inode_no, block_idx,
+                           data, ptrs_out) != 0)
+                return -1;
+        }
+
+        uint16_t r = hdr->nrec++;
+        hdr->rec[r].off   = (uint16_t)pk.used;
+        hdr->rec[r].len   = (uint16_t)clen;
+        hdr->rec[r].codec = (uint8_t)state->compress;
+        memcpy(pk.block + pk.used, cbuf, (size_t)clen);
+        pk.used  += (uint32_t)clen;
+        pk.src[r] = i;
+    }
+
+    return pack_flush(state, &pk, inode_no, block_idx, data, ptrs_out);
+}
+
+/*
+ * log_append_data
+ *
+ * Appends 'nblocks' file data blocks for inode 'inode_no'.  Block i
+ * is logical block block_idx[i] and its contents are at
+ * data + i * BLOCK_SIZE.  On success ptrs_out[i] holds the pointer to
+ * store in direct[] / the indirect block.
  *
- * Write order (each step must complete before the next):
- *   1. Inode map   → INODE_MAP_BLOCK  (block 1)
- *   2. Superblock  → block 0          (with incremented commit_seq)
- *   3. Commit block→ COMMIT_BLOCK     (block 2)
+ * With compression enabled, blocks that compress are packed several
+ * per log block; the rest are stored raw.
  *
- * The commit block is written LAST.  On recovery, if the commit
- * block's seq matches the superblock's seq, we know all three writes
- * completed and the checkpoint is valid.  If they don't match (or the
- * commit magic is wrong), recovery discards the partial checkpoint.
+ * With dedup enabled, a block identical to one already in the log
+ * (or to an earlier block of the same batch) reuses that block's
+ * pointer and costs no log space.
  */
-int log_checkpoint(struct lfs_state *state)
+int log_append_data(struct lfs_state *state, uint32_t inode_no,
+                    const uint32_t *block_idx, const uint8_t *data,
+                    uint32_t nblocks, uint32_t *ptrs_out)
 {
-    if (!state) return -1;
+    if (!state || !block_idx || !data || !ptrs_out) return -1;
+
+    uint8_t  *skip    = calloc(nblocks, 1);
+    uint64_t *hash    = NULL;
+    int32_t  *same_as = NULL;   /* earlier identical block in batch */
+    if (!skip) return -1;
+
+    if (state->dedup) {
+        hash    = malloc(nblocks * sizeof(uint64_t));
+        same_as = malloc(nblocks * sizeof(int32_t));
+        if (!hash || !same_as) {
+            free(skip); free(hash); free(same_as);
+            return -1;
+        }
 
-    /* Step 1 — inode map */
-    uint8_t imap_block[BLOCK_SIZE];
-    memset(imap_block, 0, BLOCK_SIZE);
-    memcpy(imap_block, state->inode_map,
-           INODE_MAP_SIZE * sizeof(uint32_t));
+        for (uint32_t i = 0; i < nblocks; i++) {
+            const uint8_t *blk = data + (size_t)i * BLOCK_SIZE;
+            hash[i]    = dedup_hash(blk);
+            same_as[i] = -1;
+
+            if (dedup_lookup(state, hash[i], blk, &ptrs_out[i])) {
+                skip[i] = 1;
+                continue;
+            }
+            for (uint32_t j = 0; j < i; j++) {
+                if (same_as[j] == -1 && !skip[j] && hash[j] == hash[i] &&
+                    memcmp(data + (size_t)j * BLOCK_SIZE, blk,
+                           BLOCK_SIZE) == 0) {
+                    same_as[i] = (int32_t)j;
+                    skip[i]    = 1;
+                    break;
+                }
+            }
+        }
+    }
 
-    if (disk_write(INODE_MAP_BLOCK, imap_block) != 0) {
-        fprintf(stderr, "log_checkpoint: failed to write inode map\n");
-        return -1;
+    int r = store_blocks(state, inode_no, block_idx, data, nblocks,
+                         skip, ptrs_out);
+
+    if (r == 0 && state->dedup) {
+        for (uint32_t i = 0; i < nblocks; i++) {
+            if (same_as[i] >= 0)
+                ptrs_out[i] = ptrs_out[same_as[i]];
+            else if (!skip[i])
+                dedup_insert(state, hash[i], ptrs_out[i]);
+        }
     }
 
-    /* Step 2 — superblock with incremented sequence number */
-    state->sb.commit_seq++;
-    state->sb.log_tail = state->log_tail;
+    free(skip); free(hash); free(same_as);
+    return r;
+}
+
+/*
+ * Check a block just read against the CRC32C recorded in its segment
+ * summary.  Blocks without a recorded checksum (segment 0, spliced
+ * writes, written with checksums off) pass.  The last summary used is
+ * cached, so a sequential read costs one summary read per
+ * LFS_SUM_ENTRIES blocks.  A block cache copy that passed once is
+ * marked, so reads served from it skip the CRC; 'buf' came from that
+ * copy, since only a readahead insert (never marked) can replace it
+ * behind disk_read.
+ */
+static int verify_block(struct lfs_state *state, uint32_t block,
+                        const void *buf)
+{
+    if (!state->data_csum) return 0;
+
+    uint32_t sum_block = LFS_SUM_BLOCK(state, block);
+    if (sum_block == 0 || cache_verified(block)) return 0;
+
+    const struct lfs_segment_summary *ss;
+    if (sum_block == state->seg_sum_blk) {
+        ss = &state->seg_sum;
+    } else {
+        if (state->vsum_blk != sum_block) {
+            if (disk_read(sum_block, &state->vsum) != 0) return -1;
+            state->vsum_blk = sum_block;
+        }
+        ss = &state->vsum;
+    }
 
-    uint8_t sb_block[BLOCK_SIZE];
-    memset(sb_block, 0, BLOCK_SIZE);
-    memcpy(sb_block, &state->sb, sizeof(state->sb));
+    uint32_t off = LFS_SUM_INDEX(state, block);
+    if (!(ss->entry[off].flags & LFS_SUM_HAS_CSUM)) return 0;
+    if (crc32c(0, buf, BLOCK_SIZE) == ss->entry[off].csum) {
+        cache_set_verified(block);
+        return 0;
+    }
 
-    if (disk_write(0, sb_block) != 0) {
-        fprintf(stderr, "log_checkpoint: failed to write superblock\n");
+    fprintf(stderr, "log_read_data: checksum mismatch in block %u\n",
+            block);
+    return -1;
+}
+
+/*
+ * log_read_data
+ *
+ * Reads the data block named by 'ptr' into 'buf' (BLOCK_SIZE bytes),
+ * decompressing it if the pointer refers to a packed record.
+ */
+int log_read_data(struct lfs_state *state, uint32_t ptr, void *buf)
+{
+    if (!(ptr & LFS_PTR_PACKED)) {
+        if (disk_read(ptr, buf) != 0) return -1;
+        return verify_block(state, ptr, buf);
+    }
+
+    uint8_t *pack = disk_buf_get();
+    if (!pack) return -1;
+    if (disk_read(LFS_PTR_BLOCK(ptr), pack) != 0 ||
+        verify_block(state, LFS_PTR_BLOCK(ptr), pack) != 0) {
+        disk_buf_put(pack);
         return -1;
     }
 
-    /* Step 3 — commit block (written last — this is the "seal") */
-    struct lfs_commit commit;
-    memset(&commit, 0, sizeof(commit));
-    commit.commit_magic = LFS_COMMIT_MAGIC;
-    commit.commit_seq   = state->sb.commit_seq;
-    commit.log_tail     = state->log_tail;
-    commit.imap_crc     = imap_crc(state->inode_map);
+    struct lfs_pack_hdr *hdr = (struct lfs_pack_hdr *)pack;
+    uint32_t slot = LFS_PTR_SLOT(ptr);
 
-    if (disk_write(COMMIT_BLOCK, &commit) != 0) {
-        fprintf(stderr, "log_checkpoint: failed to write commit block\n");
+    if (hdr->pack_magic != LFS_PACK_MAGIC || slot >= hdr->nrec ||
+        (uint32_t)hdr->rec[slot].off + hdr->rec[slot].len > BLOCK_SIZE) {
+        fprintf(stderr, "log_read_data: bad packed block %u (slot %u)\n",
+                LFS_PTR_BLOCK(ptr), slot);
+        disk_buf_put(pack);
         return -1;
     }
 
-    return 0;
+    int r = lfs_decompress(hdr->rec[slot].codec,
+                           pack + hdr->rec[slot].off,
+                           hdr->rec[slot].len, buf);
+    disk_buf_put(pack);
+    return r;
 }
 
 /* ------------------------------------------------------------------ */
-/*  log_recover  (Stage 8)                                              */
+/*  log_checkpoint                                                      */
 /* ------------------------------------------------------------------ */
 
 /*
- * log_recover — called once at mount time, before normal operation.
+ * log_checkpoint — record the current state in a checkpoint region.
  *
- * Checks whether the last checkpoint completed fully by comparing
- * the commit block against the superblock.  Three possible outcomes:
+ * The whole checkpoint (log_tail, snapshot table, inode map) is one
+ * checksummed block written to the region the previous checkpoint did
+ * not use.  A torn write therefore never destroys the last good
+ * checkpoint, and no ordering between several blocks is needed.
  *
- * A) Commit is valid (magic ok, seq matches, CRC matches):
- *    The last checkpoint was clean.  Trust superblock.log_tail as-is.
- *
- * B) Commit seq or CRC mismatches (crash between sb write and commit):
- *    The inode map or commit block may be from an earlier checkpoint.
- *    Rewind log_tail by scanning from log_start for the last non-zero
- *    block, then rebuild the inode map from inode blocks found in log.
- *
- * C) Commit magic is wrong (very early crash, before any checkpoint):
- *    Treat as case B.
+ * Barriers follow state->sync_mode: with LFS_SYNC_ORDERED the log is
+ * flushed first, so the checkpoint can never be on disk before the
+ * blocks it names; LFS_SYNC_FULL also flushes the checkpoint itself.
+ */
+static int checkpoint_write(struct lfs_state *state)
+{
+    if (state->sync_mode >= LFS_SYNC_ORDERED) {
+        if (disk_sync(1) != 0) return -1;
+        state->synced_seq = state->append_seq;
+    }
+
+    state->sb.commit_seq++;
+    state->sb.log_tail = state->log_tail;
+    state->ckpt_pending = 0;
+    state->ckpt_tail    = state->log_tail;
+
+    struct lfs_checkpoint ck;
+    memset(&ck, 0, sizeof(ck));
+    ck.ck_magic = LFS_CKPT_MAGIC;
+    ck.ck_seq   = state->sb.commit_seq;
+    ck.ck_time  = (uint64_t)time(NULL);
+    ck.log_tail = state->log_tail;
+    memcpy(ck.snap, state->sb.snap, sizeof(ck.snap));
+    memcpy(ck.inode_map, state->inode_map, sizeof(ck.inode_map));
+    ck.ck_csum  = crc32c(0, &ck, sizeof(ck));
+
+    uint32_t blk = (ck.ck_seq & 1) ? CKPT_BLOCK_A : CKPT_BLOCK_B;
+    if (disk_write(blk, &ck) != 0) {
+        fprintf(stderr, "log_checkpoint: failed to write checkpoint "
+                        "region %u\n", blk);
+        return -1;
+    }
+
+    if (state->sync_mode == LFS_SYNC_FULL) {
+        if (disk_sync(1) != 0) return -1;
+        state->gc_unsynced = 0;
+    }
+
+    return 0;
+}
+
+int log_checkpoint(struct lfs_state *state)
+{
+    if (!state) return -1;
+
+    uint64_t t0 = stats_now();
+    int r = checkpoint_write(state);
+    stats_record(STAT_CHECKPOINT, t0, r != 0);
+    TRACE_SPAN(STAT_CHECKPOINT, t0, 0, 0, state->sb.commit_seq);
+    return r;
+}
+
+/*
+ * log_sync — make everything appended so far durable.
  *
- * After recovery the in-memory state is consistent and a fresh
- * checkpoint is written to seal the recovered state.
+ * Recovery rolls forward from the last checkpoint through the segment
+ * summaries, so no new checkpoint is needed: one flush of the image
+ * covers data, inodes, summaries and the latest checkpoint region.
  */
-int log_recover(struct lfs_state *state)
+int log_sync(struct lfs_state *state)
 {
     if (!state) return -1;
+    if (disk_sync(1) != 0) return -1;
+    state->synced_seq  = state->append_seq;
+    state->gc_unsynced = 0;
+    return 0;
+}
 
-    printf("log_recover: checking commit block...\n");
+/*
+ * log_sync_inode — fsync for one inode: flush only if something
+ * written for it (or a GC relocation) may not be on disk yet.
+ */
+int log_sync_inode(struct lfs_state *state, uint32_t ino)
+{
+    if (!state || ino >= INODE_MAP_SIZE) return -1;
+    if (!state->gc_unsynced && state->ino_seq[ino] <= state->synced_seq)
+        return 0;
+    return log_sync(state);
+}
 
-    /* Read the commit block */
-    struct lfs_commit commit;
-    memset(&commit, 0, sizeof(commit));
-    disk_read(COMMIT_BLOCK, &commit);
+/* Read one checkpoint region; 0 if it is intact */
+static int read_checkpoint(uint32_t blk, struct lfs_checkpoint *ck)
+{
+    if (disk_read(blk, ck) != 0) return -1;
+    if (ck->ck_magic != LFS_CKPT_MAGIC) return -1;
+
+    uint32_t csum = ck->ck_csum;
+    ck->ck_csum = 0;
+    int ok = crc32c(0, ck, sizeof(*ck)) == csum;
+    ck->ck_csum = csum;
+    return ok ? 0 : -1;
+}
 
-    /* Compute expected CRC from the inode map we loaded at mount */
-    uint32_t expected_crc = imap_crc(state->inode_map);
+/*
+ * log_load_checkpoint — called at mount, after the superblock is read.
+ *
+ * Loads the newest intact checkpoint region into state: log_tail,
+ * commit_seq, the snapshot table and the inode map.
+ */
+int log_load_checkpoint(struct lfs_state *state)
+{
+    if (!state) return -1;
 
-    int commit_ok = (commit.commit_magic == LFS_COMMIT_MAGIC)
-                 && (commit.commit_seq   == state->sb.commit_seq)
-                 && (commit.imap_crc     == expected_crc)
-                 && (commit.log_tail     == state->sb.log_tail);
+    struct lfs_checkpoint ck[2];
+    int ok_a = read_checkpoint(CKPT_BLOCK_A, &ck[0]) == 0;
+    int ok_b = read_checkpoint(CKPT_BLOCK_B, &ck[1]) == 0;
 
-    if (commit_ok) {
-        printf("log_recover: commit valid (seq=%u, tail=%u) — no recovery needed\n",
-               commit.commit_seq, commit.log_tail);
-        return 0;
+    if (!ok_a && !ok_b) {
+        fprintf(stderr, "log_load_checkpoint: no valid checkpoint\n");
+        return -1;
     }
 
-    /*
-     * Something doesn't match — the last checkpoint was interrupted.
-     * Log what we found to help with debugging.
-     */
-    printf("log_recover: INCOMPLETE CHECKPOINT DETECTED\n");
-    printf("  superblock: seq=%u tail=%u\n",
-           state->sb.commit_seq, state->sb.log_tail);
-    printf("  commit blk: magic=0x%x seq=%u tail=%u crc=0x%x\n",
-           commit.commit_magic, commit.commit_seq,
-           commit.log_tail, commit.imap_crc);
-    printf("  imap  crc : expected=0x%x\n", expected_crc);
+    int use = ok_a ? 0 : 1;
+    if (ok_a && ok_b && ck[1].ck_seq > ck[0].ck_seq) use = 1;
+    if (!ok_a || !ok_b)
+        printf("log_load_checkpoint: region %c is unused or invalid\n",
+               ok_a ? 'B' : 'A');
+
+    state->sb.commit_seq = ck[use].ck_seq;
+    state->sb.log_tail   = ck[use].log_tail;
+    state->log_tail      = ck[use].log_tail;
+    state->ckpt_tail     = ck[use].log_tail;
+    memcpy(state->sb.snap, ck[use].snap, sizeof(state->sb.snap));
+    memcpy(state->inode_map, ck[use].inode_map, sizeof(state->inode_map));
+
+    printf("log_load_checkpoint: region %c (seq=%u, tail=%u, time=%llu)\n",
+           use ? 'B' : 'A', ck[use].ck_seq, ck[use].log_tail,
+           (unsigned long long)ck[use].ck_time);
+    return 0;
+}
 
-    /*
-     * Step 1: Find the true end of the log.
-     *
-     * Scan backwards from superblock.log_tail - 1 toward log_start.
-     * The first non-zero block we find is the last block that was
-     * actually written.  Set log_tail = that block + 1.
-     *
-     * We use "any non-zero byte" as the test because a block that was
-     * never written will be all zeros from mkfs's ftruncate.
-     */
-    uint8_t buf[BLOCK_SIZE];
-    uint32_t scan_end = state->sb.log_tail;
-    if (scan_end > state->sb.total_blocks)
-        scan_end = state->sb.total_blocks;
-
-    uint32_t true_tail = LOG_START_BLOCK;  /* fallback: empty log */
-
-    for (uint32_t b = scan_end; b > LOG_START_BLOCK; b--) {
-        memset(buf, 0, BLOCK_SIZE);
-        disk_read(b - 1, buf);
-        int nonzero = 0;
-        for (int i = 0; i < BLOCK_SIZE; i++) {
-            if (buf[i] != 0) { nonzero = 1; break; }
+/* ------------------------------------------------------------------ */
+/*  log_recover  (Stage 8)                                              */
+/* ------------------------------------------------------------------ */
+
+/*
+ * Recovery scans the log in chunks of LFS_RECOVER_CHUNK segments.
+ * Worker threads (state->recover_threads in all) claim chunks in log
+ * order; each chunk gets its own map of the newest inode block per
+ * inode seen in it.  A chunk that contains the end of the log stops
+ * the scan there: chunks after it are not claimed any more, and those
+ * already in flight are ignored.
+ */
+struct rec_chunk {
+    uint32_t *map;             /* newest block per inode, 0 = none   */
+    uint32_t  end;             /* after the last block replayed      */
+    int       nseg;
+    int       ninodes;
+};
+
+struct rec_scan {
+    uint32_t          commit_seq;
+    uint32_t          fs_id;
+    uint32_t          tail;    /* first block to replay              */
+    uint32_t          seg_blocks;
+    uint32_t          sum_blocks;
+    uint32_t          window;  /* blocks read at a time              */
+    uint32_t          seg0;    /* first segment to scan              */
+    uint32_t          nsegs;   /* segments on the disk               */
+    uint32_t          nchunks;
+    uint32_t          next;    /* next chunk to claim                */
+    uint32_t          stop;    /* first chunk where the log ended    */
+    uint32_t          threads; /* including the mounting thread      */
+    struct rec_chunk *chunk;
+};
+
+/* The log ended in chunk 'i': nothing after it is claimed */
+static void rec_stop_at(struct rec_scan *sc, uint32_t i)
+{
+    uint32_t cur = __atomic_load_n(&sc->stop, __ATOMIC_RELAXED);
+    while (i < cur &&
+           !__atomic_compare_exchange_n(&sc->stop, &cur, i, 0,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+/*
+ * Replay one segment into chunk 'c'.  'buf' holds one summary block,
+ * then a window of sc->window blocks: each summary block is read when
+ * the scan reaches its entries, and the log itself only where an
+ * inode block has to be checked, a window at a time.
+ * Returns 1 if the log ends in the segment, else 0.
+ */
+static int rec_segment(const struct rec_scan *sc, struct rec_chunk *c,
+                       uint32_t seg, uint8_t *buf)
+{
+    struct lfs_segment_summary *ss = (struct lfs_segment_summary *)buf;
+    uint8_t *win   = buf + BLOCK_SIZE;
+    uint32_t start = seg * sc->seg_blocks;
+    uint32_t off   = sc->sum_blocks;
+    uint32_t sum   = UINT32_MAX;             /* summary held in 'ss'  */
+    uint32_t wbeg  = 0, wend = 0;            /* offsets held in 'win' */
+
+    if (sc->tail > start + off)
+        off = sc->tail - start;              /* before the checkpoint */
+
+    for (; off < sc->seg_blocks; off++) {
+        uint32_t b = start + off;
+        uint32_t e = off % LFS_SUM_ENTRIES;
+
+        if (off / LFS_SUM_ENTRIES != sum) {
+            if (disk_read_range(start + off / LFS_SUM_ENTRIES, 1, ss) != 0 ||
+                !summary_valid(ss, sc->fs_id) ||
+                ss->ss_seq < sc->commit_seq)
+                return 1;
+            if (sum == UINT32_MAX) c->nseg++;
+            sum = off / LFS_SUM_ENTRIES;
         }
-        if (nonzero) {
-            true_tail = b;   /* b-1 is the last written block */
+
+        if (ss->entry[e].type == LFS_BLK_FREE) return 1;
+
+        if (ss->entry[e].type == LFS_BLK_INODE) {
+            if (off < wbeg || off >= wend) {
+                wbeg = off;
+                wend = off + sc->window;
+                if (wend > sc->seg_blocks) wend = sc->seg_blocks;
+                if (disk_read_range(b, wend - wbeg, win) != 0) return 1;
+            }
+
+            /* A torn inode ends the log: it never fully reached disk */
+            const uint8_t *blk = win + (size_t)(off - wbeg) * BLOCK_SIZE;
+            const struct lfs_inode *in = (const struct lfs_inode *)blk;
+            uint32_t ino = ss->entry[e].inode_no;
+            if (ino >= INODE_MAP_SIZE || in->inode_no != ino ||
+                ((ss->entry[e].flags & LFS_SUM_HAS_CSUM) &&
+                 crc32c(0, blk, BLOCK_SIZE) != ss->entry[e].csum))
+                return 1;
+            c->map[ino] = b;
+            c->ninodes++;
+        }
+        c->end = b + 1;
+    }
+    return 0;
+}
+
+/* Claim and scan the next chunk; 0 once there is nothing left to do */
+static int rec_claim(struct rec_scan *sc, uint8_t *buf)
+{
+    uint32_t i = __atomic_fetch_add(&sc->next, 1, __ATOMIC_RELAXED);
+    if (i >= sc->nchunks || i > __atomic_load_n(&sc->stop, __ATOMIC_RELAXED))
+        return 0;
+
+    struct rec_chunk *c = &sc->chunk[i];
+    c->map = calloc(INODE_MAP_SIZE, sizeof(uint32_t));
+    if (!c->map) {
+        rec_stop_at(sc, i);
+        return 0;
+    }
+
+    uint32_t seg = sc->seg0 + i * LFS_RECOVER_CHUNK;
+    uint32_t end = seg + LFS_RECOVER_CHUNK;
+    if (end > sc->nsegs) end = sc->nsegs;
+    for (; seg < end; seg++) {
+        if (rec_segment(sc, c, seg, buf)) {
+            rec_stop_at(sc, i);
             break;
         }
     }
+    return 1;
+}
 
-    printf("log_recover: rewinding log_tail %u -> %u\n",
-           state->sb.log_tail, true_tail);
+static uint8_t *rec_buf(const struct rec_scan *sc)
+{
+    return disk_alloc((size_t)(1 + sc->window) * BLOCK_SIZE);
+}
 
-    state->log_tail     = true_tail;
-    state->sb.log_tail  = true_tail;
+static void *rec_worker(void *arg)
+{
+    struct rec_scan *sc = arg;
+    uint8_t *buf = rec_buf(sc);
+    if (!buf) return NULL;       /* the other workers claim the chunks */
+    while (rec_claim(sc, buf))
+        ;
+    free(buf);
+    return NULL;
+}
 
-    /*
-     * Step 2: Rebuild the inode map from scratch.
-     *
-     * Scan every block in the live log range.  For each block that
-     * looks like a valid inode (inode_no < INODE_MAP_SIZE, type is
-     * FILE or DIR), update inode_map[inode_no] to point to this block
-     * if it's newer (higher block number = more recent in the log).
-     *
-     * This gives us the most recent version of every inode.
-     */
-    printf("log_recover: rebuilding inode map from log blocks [%u, %u)\n",
-           LOG_START_BLOCK, true_tail);
+/*
+ * Scan every chunk, on up to sc->threads threads including the
+ * caller.  The first chunk is scanned alone: after a clean
+ * unmount the log ends there and no thread is worth starting.
+ * Threads that cannot be started leave more chunks to the others.
+ */
+static void rec_run(struct rec_scan *sc)
+{
+    uint8_t *buf = rec_buf(sc);
+    if (!buf) return;
+    if (!rec_claim(sc, buf) ||
+        __atomic_load_n(&sc->stop, __ATOMIC_RELAXED) != UINT32_MAX) {
+        free(buf);
+        return;
+    }
+
+    pthread_t *tid = calloc(sc->threads, sizeof(*tid));
+    uint32_t   nthreads = 0;
+    while (tid && nthreads + 1 < sc->threads &&
+           nthreads + 2 < sc->nchunks &&
+           pthread_create(&tid[nthreads], NULL, rec_worker, sc) == 0)
+        nthreads++;
+
+    while (rec_claim(sc, buf))
+        ;
+    free(buf);
+    while (nthreads > 0)
+        pthread_join(tid[--nthreads], NULL);
+    free(tid);
+}
 
-    memset(state->inode_map, 0, sizeof(state->inode_map));
+/*
+ * log_recover — called once at mount time, after log_load_checkpoint.
+ *
+ * The loaded checkpoint's log_tail is where the log stood when it was
+ * taken (commit_seq).  Everything appended after it lives in segments
+ * whose summary carries ss_seq >= commit_seq, so recovery walks only
+ * those summaries, in log order, and re-points inode_map[] at every
+ * inode block they tag.  Data and indirect blocks need no replay —
+ * they are reached through the inodes.  The walk stops at the first
+ * summary that is missing, torn (bad checksum), stale (older ss_seq)
+ * or another filesystem's, at the first unused slot, or at an inode
+ * block that fails its checksum, so its cost is proportional to the
+ * un-checkpointed tail rather than the disk.
+ *
+ * The walk runs in parallel (see struct rec_scan) and reads the log
+ * in windows of up to LFS_RECOVER_WINDOW bytes.  The chunk maps are
+ * merged in log order up to the chunk where the log ended; blocks
+ * only grow along the log, so the newest block of an inode is the
+ * largest one seen.
+ *
+ * If the newest checkpoint region was torn, the older one is loaded
+ * and the same walk replays what the torn checkpoint would have
+ * recorded.
+ *
+ * Segment 0 has no summary, so blocks appended there after the last
+ * checkpoint cannot be replayed; the checkpoint itself stays valid.
+ */
+int log_recover(struct lfs_state *state)
+{
+    if (!state) return -1;
 
-    for (uint32_t b = LOG_START_BLOCK; b < true_tail; b++) {
-        memset(buf, 0, BLOCK_SIZE);
-        if (disk_read(b, buf) != 0) continue;
+    printf("log_recover: rolling forward from seq=%u tail=%u\n",
+           state->sb.commit_seq, state->sb.log_tail);
 
-        struct lfs_inode *candidate = (struct lfs_inode *)buf;
+    uint32_t tail = state->sb.log_tail;
+    if (tail < LOG_START_BLOCK) tail = LOG_START_BLOCK;
+    if (tail > state->sb.total_blocks) tail = state->sb.total_blocks;
+
+    struct rec_scan sc;
+    memset(&sc, 0, sizeof(sc));
+    sc.commit_seq = state->sb.commit_seq;
+    sc.fs_id      = state->sb.fs_id;
+    sc.tail       = tail;
+    sc.seg_blocks = state->seg_blocks;
+    sc.sum_blocks = state->sum_blocks;
+    sc.window     = LFS_RECOVER_WINDOW / BLOCK_SIZE;
+    if (sc.window > sc.seg_blocks) sc.window = sc.seg_blocks;
+    sc.seg0       = tail / sc.seg_blocks;
+    if (sc.seg0 == 0) sc.seg0 = 1;
+    sc.nsegs      = state->sb.total_blocks / sc.seg_blocks;
+    if (sc.seg0 < sc.nsegs)
+        sc.nchunks = (sc.nsegs - sc.seg0 + LFS_RECOVER_CHUNK - 1)
+                   / LFS_RECOVER_CHUNK;
+    sc.stop       = UINT32_MAX;
+    sc.threads    = state->recover_threads ? state->recover_threads
+                                           : LFS_RECOVER_THREADS;
+    sc.chunk      = calloc(sc.nchunks ? sc.nchunks : 1, sizeof(*sc.chunk));
+    if (!sc.chunk) return -1;
+
+    rec_run(&sc);
+
+    /* Merge the chunks before the end of the log (max-reduction) */
+    uint32_t newest[INODE_MAP_SIZE];
+    uint32_t new_tail = tail;
+    int nseg = 0, ninodes = 0, failed = 0;
+    memset(newest, 0, sizeof(newest));
+
+    for (uint32_t i = 0; i < sc.nchunks && i <= sc.stop; i++) {
+        const struct rec_chunk *c = &sc.chunk[i];
+        if (!c->map) {                       /* out of memory */
+            failed = 1;
+            break;
+        }
+        for (uint32_t ino = 0; ino < INODE_MAP_SIZE; ino++)
+            if (c->map[ino] > newest[ino]) newest[ino] = c->map[ino];
+        if (c->end > new_tail) new_tail = c->end;
+        nseg    += c->nseg;
+        ninodes += c->ninodes;
+    }
 
-        /* Heuristic: valid inode has sane inode_no and known type */
-        if (candidate->inode_no == 0 &&
-            candidate->type != INODE_TYPE_DIR)
-            continue;   /* inode_no 0 is root — only DIR is valid   */
+    for (uint32_t i = 0; i < sc.nchunks; i++)
+        free(sc.chunk[i].map);
+    free(sc.chunk);
 
-        if (candidate->inode_no >= INODE_MAP_SIZE)
-            continue;
+    if (failed) {
+        fprintf(stderr, "log_recover: out of memory\n");
+        return -1;
+    }
 
-        if (candidate->type != INODE_TYPE_FILE &&
-            candidate->type != INODE_TYPE_DIR)
-            continue;
+    for (uint32_t ino = 0; ino < INODE_MAP_SIZE; ino++)
+        if (newest[ino]) state->inode_map[ino] = newest[ino];
 
-        /* Later block = more recent version — always prefer it */
-        uint32_t ino = candidate->inode_no;
-        if (b > state->inode_map[ino] || state->inode_map[ino] == 0)
-            state->inode_map[ino] = b;
+    if (new_tail == tail) {
+        printf("log_recover: nothing to roll forward\n");
+        return 0;
     }
 
+    printf("log_recover: rolled forward %d segment(s), %d inode(s), "
+           "log_tail %u -> %u\n", nseg, ninodes, tail, new_tail);
+
+    state->log_tail    = new_tail;
+    state->sb.log_tail = new_tail;
+
     /* Root inode (0) must always be present */
     if (state->inode_map[0] == 0) {
         fprintf(stderr, "log_recover: ERROR — root inode not found "
@@ -286,13 +944,9 @@ int log_recover(struct lfs_state *state)
         return -1;
     }
 
-    printf("log_recover: inode map rebuilt, %d inodes found\n",
-           (int)(sizeof(state->inode_map) / sizeof(state->inode_map[0])));
-
     /*
-     * Step 3: Seal the recovered state with a fresh checkpoint.
-     * This overwrites the bad superblock/commit so future mounts
-     * see a clean state immediately.
+     * Seal the recovered state with a fresh checkpoint so future
+     * mounts see it immediately.
      */
     printf("log_recover: writing recovery checkpoint...\n");
     if (log_checkpoint(state) != 0) {
@@ -1,90 +1,266 @@
 /*
- * mkfs_lfs.c — Format a blank file as an LFS disk image
+ * mkfs_lfs.c — Format a file or block device as an LFS disk image
  *
  * Layout after mkfs:
  *   Block 0  : Superblock
- *   Block 1  : Inode map  (128 × uint32_t)
- *   Block 2  : Commit block  (Stage 8 crash recovery seal)
+ *   Block 1  : Checkpoint region A  (seq 1: inode map, log tail)
+ *   Block 2  : Checkpoint region B  (empty until the first checkpoint)
  *   Block 3  : Root inode (inode 0)
  *   Block 4  : Root directory data
  *   Block 5  : hello.txt data
  *   Block 6  : hello.txt inode (inode 1)
  *   Block 7+ : Free log space  ← log_tail starts here
+ *
+ * Segment 0 holds the fixed layout and has no summary; every later
+ * segment starts with its summary block(s).
+ *
+ *   usage: mkfs_lfs [-b BLOCK_SIZE] [-s SEGMENT_SIZE] [-i INODES]
+ *                   [-P] [-K] [PATH [SIZE]]
+ *
+ * PATH defaults to ../lfs.img.  Sizes take a K, M, G or T suffix.
+ * SIZE defaults to the whole device for a block device, otherwise
+ * TOTAL_BLOCKS blocks (or MKFS_MIN_SEGMENTS segments if that is
+ * more), and is rounded down to whole segments.  Block pointers
+ * address at most LFS_PTR_BLOCK_MASK blocks (about 1 TB with 4 KB
+ * blocks); anything larger is capped there, with a warning.
+ *
+ *   -b  block size; must be the one this build was made for
+ *   -s  segment size: a power of two of at least LFS_SEG_MIN_BLOCKS
+ *       blocks and at most 64 MB.  Match it to the erase block or
+ *       stripe size of the device.
+ *   -i  inode capacity, at most INODE_MAP_SIZE
+ *   -P  preallocate a regular file with fallocate(2) instead of
+ *       leaving it sparse
+ *   -K  do not discard a block device (BLKDISCARD) before formatting
+ *
+ * Only the seven blocks above are written, with one vectored write.
+ * Nothing else needs clearing: the log is only read through them, and
+ * the summaries an earlier filesystem left behind carry another fs_id,
+ * which recovery ignores.  Formatting therefore takes the same time
+ * at any size.
  */
 
+#define _GNU_SOURCE             /* fallocate */
 #include <stdio.h>
 #include <string.h>
+#include <ctype.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include "lfs.h"
 
-static void write_block(int fd, uint32_t block, const void *data)
+/* From <linux/fs.h>, which cannot be included: it defines BLOCK_SIZE */
+#ifndef BLKGETSIZE64
+#define BLKGETSIZE64       _IOR(0x12, 114, size_t)
+#endif
+#ifndef BLKDISCARD
+#define BLKDISCARD         _IO(0x12, 119)
+#endif
+
+#define MKFS_IMAGE         "../lfs.img"
+#define MKFS_MIN_SEGMENTS  8
+
+/* The fixed layout: one iovec per block, written with one pwritev */
+static struct iovec  layout[LOG_START_BLOCK];
+static const uint8_t zero_block[BLOCK_SIZE];
+
+/* Block 'block' of the layout holds 'data' (BLOCK_SIZE bytes) */
+static void set_block(uint32_t block, const void *data)
+{
+    layout[block].iov_base = (void *)data;
+    layout[block].iov_len  = BLOCK_SIZE;
+}
+
+/* Parse a byte count with an optional K, M, G or T suffix; 0 if invalid */
+static uint64_t parse_size(const char *arg)
 {
-    uint8_t buf[BLOCK_SIZE];
-    memset(buf, 0, BLOCK_SIZE);
-    if (data) memcpy(buf, data, BLOCK_SIZE);
-    if (pwrite(fd, buf, BLOCK_SIZE, (off_t)block * BLOCK_SIZE)
-            != BLOCK_SIZE) {
-        perror("write_block");
-        exit(1);
+    char *end;
+    unsigned long long v = strtoull(arg, &end, 10);
+    if (end == arg) return 0;
+
+    static const char units[] = "KMGT";
+    for (int i = 0; units[i]; i++) {
+        if (toupper((unsigned char)*end) == units[i]) {
+            v <<= 10 * (i + 1);
+            end++;
+            break;
+        }
     }
+    return *end == '\0' ? v : 0;
+}
+
+/* A random, non-zero filesystem id (0 marks images that predate it) */
+static uint32_t new_fs_id(void)
+{
+    uint32_t id = 0;
+    while (id == 0)
+        if (getrandom(&id, sizeof(id), 0) != sizeof(id))
+            id = (uint32_t)time(NULL) ^ ((uint32_t)getpid() << 16);
+    return id;
 }
 
-/* XOR checksum over inode map — must match imap_crc() in log.c */
-static uint32_t imap_crc(const uint32_t *imap)
+static int usage(const char *prog)
 {
-    uint32_t crc = 0;
-    for (int i = 0; i < INODE_MAP_SIZE; i++)
-        crc ^= imap[i];
-    return crc;
+    fprintf(stderr, "usage: %s [-b BLOCK_SIZE] [-s SEGMENT_SIZE] "
+                    "[-i INODES] [-P] [-K] [PATH [SIZE]]\n", prog);
+    return 2;
 }
 
-int main(void)
+int main(int argc, char *argv[])
 {
-    int fd = open("../lfs.img", O_CREAT | O_RDWR | O_TRUNC, 0666);
-    if (fd < 0) { perror("open"); return 1; }
-    if (ftruncate(fd, (off_t)BLOCK_SIZE * TOTAL_BLOCKS) != 0) {
+    uint32_t seg_blocks = BLOCKS_PER_SEGMENT;
+    uint32_t inodes     = INODE_MAP_SIZE;
+    int      prealloc   = 0, discard = 1;
+    int      opt;
+
+    while ((opt = getopt(argc, argv, "b:s:i:PK")) != -1) {
+        uint64_t bytes, n;
+        switch (opt) {
+        case 'b':
+            if (parse_size(optarg) != BLOCK_SIZE) {
+                fprintf(stderr, "mkfs_lfs: this build uses %d-byte blocks "
+                                "(make CFLAGS+=-DBLOCK_SIZE=N for others)\n",
+                        BLOCK_SIZE);
+                return 2;
+            }
+            break;
+        case 's':
+            bytes = parse_size(optarg);
+            n     = bytes / BLOCK_SIZE;
+            if (bytes % BLOCK_SIZE != 0 || n < LFS_SEG_MIN_BLOCKS ||
+                (n & (n - 1)) != 0 || bytes > LFS_SEG_MAX_BYTES) {
+                fprintf(stderr, "mkfs_lfs: segment size must be a power of "
+                                "two from %u to %u bytes\n",
+                        LFS_SEG_MIN_BLOCKS * BLOCK_SIZE, LFS_SEG_MAX_BYTES);
+                return 2;
+            }
+            seg_blocks = (uint32_t)n;
+            break;
+        case 'i':
+            n = strtoull(optarg, NULL, 10);
+            if (n < 2 || n > INODE_MAP_SIZE) {
+                fprintf(stderr, "mkfs_lfs: inode capacity must be 2 to %d "
+                                "(INODE_MAP_SIZE)\n", INODE_MAP_SIZE);
+                return 2;
+            }
+            inodes = (uint32_t)n;
+            break;
+        case 'P': prealloc = 1; break;
+        case 'K': discard  = 0; break;
+        default:  return usage(argv[0]);
+        }
+    }
+    if (argc - optind > 2) return usage(argv[0]);
+
+    const char *path = optind < argc ? argv[optind] : MKFS_IMAGE;
+    uint64_t    size = 0;
+    if (optind + 1 < argc && (size = parse_size(argv[optind + 1])) == 0)
+        return usage(argv[0]);
+
+    /* A block device is formatted in place, never truncated */
+    struct stat st;
+    int is_dev = stat(path, &st) == 0 && S_ISBLK(st.st_mode);
+    int fd = is_dev ? open(path, O_RDWR | O_EXCL)
+                    : open(path, O_CREAT | O_RDWR | O_TRUNC, 0666);
+    if (fd < 0) { perror(path); return 1; }
+
+    if (is_dev) {
+        uint64_t dev_size;
+        if (ioctl(fd, BLKGETSIZE64, &dev_size) != 0) {
+            perror("BLKGETSIZE64"); return 1;
+        }
+        if (size > dev_size) {
+            fprintf(stderr, "mkfs_lfs: %s holds only %llu bytes\n", path,
+                    (unsigned long long)dev_size);
+            return 1;
+        }
+        if (size == 0) size = dev_size;
+    }
+
+    /* Whole segments only: the log never ends part-way into one */
+    uint64_t blocks = size / BLOCK_SIZE;
+    if (size == 0) {
+        blocks = (TOTAL_BLOCKS + seg_blocks - 1) / seg_blocks * seg_blocks;
+        if (blocks < MKFS_MIN_SEGMENTS * seg_blocks)
+            blocks = MKFS_MIN_SEGMENTS * seg_blocks;
+    }
+    if (blocks > LFS_PTR_BLOCK_MASK) {
+        blocks = LFS_PTR_BLOCK_MASK;
+        fprintf(stderr, "mkfs_lfs: warning: %s capped at %llu bytes, "
+                        "the most %d-byte blocks can address\n", path,
+                (unsigned long long)blocks / seg_blocks * seg_blocks
+                    * BLOCK_SIZE, BLOCK_SIZE);
+    }
+    uint32_t total_blocks = (uint32_t)(blocks / seg_blocks * seg_blocks);
+    if (total_blocks < MKFS_MIN_SEGMENTS * seg_blocks) {
+        fprintf(stderr, "mkfs_lfs: %s is too small for %d segments of "
+                        "%u bytes\n", path, MKFS_MIN_SEGMENTS,
+                seg_blocks * BLOCK_SIZE);
+        return 1;
+    }
+    off_t len = (off_t)total_blocks * BLOCK_SIZE;
+
+    if (is_dev) {
+        /* Tell the device the old contents are garbage; optional */
+        uint64_t range[2] = { 0, (uint64_t)len };
+        if (discard && ioctl(fd, BLKDISCARD, range) != 0)
+            perror("mkfs_lfs: BLKDISCARD (continuing)");
+    } else if (prealloc) {
+        if (fallocate(fd, 0, 0, len) != 0) {
+            perror("fallocate"); return 1;
+        }
+    } else if (ftruncate(fd, len) != 0) {
         perror("ftruncate"); return 1;
     }
 
     uint32_t log_tail = 7;   /* first free block after fixed layout */
 
-    /* ---- Inode map (block 1) ---- */
+    /* ---- Inode map ---- */
     uint32_t imap[INODE_MAP_SIZE];
     memset(imap, 0, sizeof(imap));
     imap[0] = 3;   /* root inode at block 3 */
     imap[1] = 6;   /* hello.txt inode at block 6 */
-    write_block(fd, 1, imap);
 
     /* ---- Superblock (block 0) ---- */
     struct lfs_superblock sb;
     memset(&sb, 0, sizeof(sb));
     sb.magic           = LFS_MAGIC;
     sb.block_size      = BLOCK_SIZE;
-    sb.total_blocks    = TOTAL_BLOCKS;
-    sb.inode_map_block = INODE_MAP_BLOCK;
+    sb.total_blocks    = total_blocks;
+    sb.inode_map_block = CKPT_BLOCK_A;
     sb.log_start       = LOG_START_BLOCK;
+    sb.seg_blocks      = seg_blocks;
+    sb.fs_id           = new_fs_id();
+    sb.inode_count     = inodes;
     sb.log_tail        = log_tail;
     sb.commit_seq      = 1;            /* first valid sequence number */
-    write_block(fd, 0, &sb);
+    set_block(0, &sb);
 
-    /* ---- Commit block (block 2) ---- */
-    struct lfs_commit commit;
-    memset(&commit, 0, sizeof(commit));
-    commit.commit_magic = LFS_COMMIT_MAGIC;
-    commit.commit_seq   = 1;           /* matches superblock          */
-    commit.log_tail     = log_tail;
-    commit.imap_crc     = imap_crc(imap);
-    write_block(fd, COMMIT_BLOCK, &commit);
+    /* ---- Checkpoint regions A (block 1) and B (block 2, zeroed) ---- */
+    struct lfs_checkpoint ck;
+    memset(&ck, 0, sizeof(ck));
+    ck.ck_magic = LFS_CKPT_MAGIC;
+    ck.ck_seq   = 1;                   /* odd sequence -> region A    */
+    ck.ck_time  = (uint64_t)time(NULL);
+    ck.log_tail = log_tail;
+    memcpy(ck.inode_map, imap, sizeof(imap));
+    ck.ck_csum  = crc32c(0, &ck, sizeof(ck));
+    set_block(CKPT_BLOCK_A, &ck);
+    set_block(CKPT_BLOCK_B, zero_block);
 
     /* ---- Root directory data (block 4) ---- */
-    struct lfs_dirent dir_entries[3];
-    memset(dir_entries, 0, sizeof(dir_entries));
+    uint8_t dir_block[BLOCK_SIZE];
+    memset(dir_block, 0, BLOCK_SIZE);
+    struct lfs_dirent *dir_entries = (struct lfs_dirent *)dir_block;
     dir_entries[0].inode_no = 0; strcpy(dir_entries[0].name, ".");
     dir_entries[1].inode_no = 0; strcpy(dir_entries[1].name, "..");
     dir_entries[2].inode_no = 1; strcpy(dir_entries[2].name, "hello.txt");
-    write_block(fd, 4, dir_entries);
+    set_block(4, dir_block);
 
     /* ---- Root inode (block 3) ---- */
     struct lfs_inode root;
@@ -94,14 +270,14 @@ int main(void)
     root.nlinks    = 2;
     root.size      = 3 * sizeof(struct lfs_dirent);
     root.direct[0] = 4;   /* root dir data at block 4 */
-    write_block(fd, 3, &root);
+    set_block(3, &root);
 
     /* ---- hello.txt data (block 5) ---- */
     const char *msg = "Hello from LFS!\n";
     char data[BLOCK_SIZE];
     memset(data, 0, BLOCK_SIZE);
     strcpy(data, msg);
-    write_block(fd, 5, data);
+    set_block(5, data);
 
     /* ---- hello.txt inode (block 6) ---- */
     struct lfs_inode hello;
@@ -111,12 +287,22 @@ int main(void)
     hello.size      = (uint32_t)strlen(msg);
     hello.nlinks    = 1;
     hello.direct[0] = 5;
-    write_block(fd, 6, &hello);
+    set_block(6, &hello);
 
+    if (pwritev(fd, layout, LOG_START_BLOCK, 0) !=
+            (ssize_t)LOG_START_BLOCK * BLOCK_SIZE || fsync(fd) != 0) {
+        perror("mkfs_lfs: writing the layout");
+        return 1;
+    }
     close(fd);
-    printf("mkfs_lfs: created lfs.img (%d blocks, %d bytes)\n",
-           TOTAL_BLOCKS, BLOCK_SIZE * TOTAL_BLOCKS);
-    printf("  commit block written (seq=1, tail=%u)\n", log_tail);
+
+    printf("mkfs_lfs: formatted %s (%u blocks of %d bytes, %llu bytes)\n",
+           path, total_blocks, BLOCK_SIZE, (unsigned long long)len);
+    printf("  %u-block segments (%u KB), %u summary block(s) each\n",
+           seg_blocks, seg_blocks * (BLOCK_SIZE / 1024),
+           (seg_blocks + LFS_SUM_ENTRIES - 1) / LFS_SUM_ENTRIES);
+    printf("  %u inodes, fs_id %08x\n", inodes, sb.fs_id);
+    printf("  checkpoint written (seq=1, tail=%u)\n", log_tail);
     printf("  log tail starts at block %u\n", log_tail);
     return 0;
 }
@@ -0,0 +1,157 @@
+/*
+ * readahead.c — Sequential readahead
+ *
+ * ra_window() watches one stream of reads (one file) and decides what
+ * to prefetch: a read that starts where the previous one ended is
+ * sequential and opens a window past it.  The window starts at
+ * LFS_RA_MIN blocks and doubles, up to the maximum given to
+ * ra_start() (at most LFS_RA_MAX), while the reads
+ * keep hitting blocks that were prefetched for them; when prefetched
+ * blocks go unused (evicted first) it halves again.  A random read
+ * resets the stream.
+ *
+ * The caller maps the window to physical blocks and hands them to
+ * ra_submit(); a worker thread reads them into the block cache, so the
+ * FUSE thread never waits for a prefetch.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include "lfs.h"
+
+#define RA_QUEUE  256                  /* pending blocks             */
+
+static pthread_mutex_t ra_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  ra_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t       ra_thread;
+static int             ra_running;
+static int             ra_quit;
+static uint32_t        ra_max = LFS_RA_MAX;     /* window limit     */
+
+/* Ring of physical blocks waiting to be prefetched */
+static uint32_t queue[RA_QUEUE];
+static uint32_t q_head, q_len;
+
+static void *ra_worker(void *arg)
+{
+    (void)arg;
+    void *buf = disk_buf_get();
+    if (!buf) return NULL;
+
+    pthread_mutex_lock(&ra_lock);
+    for (;;) {
+        while (q_len == 0 && !ra_quit)
+            pthread_cond_wait(&ra_cond, &ra_lock);
+        if (ra_quit) break;
+
+        uint32_t block = queue[q_head];
+        q_head = (q_head + 1) % RA_QUEUE;
+        q_len--;
+        pthread_mutex_unlock(&ra_lock);
+
+        if (!cache_contains(block)) {
+            uint64_t gen = cache_gen();
+            if (disk_read_uncached(block, buf) == 0)
+                cache_insert(block, buf, gen, 1);
+        }
+
+        pthread_mutex_lock(&ra_lock);
+    }
+    pthread_mutex_unlock(&ra_lock);
+
+    disk_buf_put(buf);
+    return NULL;
+}
+
+/* Start the worker; windows grow to 'max' blocks (0 = no readahead) */
+int ra_start(uint32_t max)
+{
+    ra_max = max < LFS_RA_MAX ? max : LFS_RA_MAX;
+    if (ra_max == 0 || ra_running) return 0;
+
+    q_head = q_len = 0;
+    ra_quit = 0;
+    if (pthread_create(&ra_thread, NULL, ra_worker, NULL) != 0) {
+        fprintf(stderr, "ra_start: cannot start readahead thread\n");
+        return -1;
+    }
+    ra_running = 1;
+    return 0;
+}
+
+void ra_stop(void)
+{
+    if (!ra_running) return;
+
+    pthread_mutex_lock(&ra_lock);
+    ra_quit = 1;
+    pthread_cond_signal(&ra_cond);
+    pthread_mutex_unlock(&ra_lock);
+
+    pthread_join(ra_thread, NULL);
+    ra_running = 0;
+}
+
+/*
+ * ra_window
+ *
+ * Records a read of logical blocks [first, first + nblocks), of which
+ * 'hits' were served from prefetched cache blocks.  Returns how many
+ * blocks to prefetch starting at *from (0 = none).
+ */
+int ra_window(struct lfs_ra *ra, uint32_t first, uint32_t nblocks,
+              uint32_t hits, uint32_t *from)
+{
+    if (ra_max == 0 || nblocks == 0) return 0;
+
+    uint32_t end = first + nblocks;
+    if (first != ra->next) {
+        /* Random access: forget the stream */
+        ra->next   = end;
+        ra->window = 0;
+        ra->ra_end = 0;
+        return 0;
+    }
+    ra->next = end;
+
+    if (ra->window == 0) {
+        ra->window = LFS_RA_MIN;
+    } else if (first < ra->ra_end) {
+        /* This read fell inside the last window: was it there? */
+        if (hits * 2 >= nblocks)
+            ra->window *= 2;
+        else if (ra->window > LFS_RA_MIN)
+            ra->window /= 2;
+    }
+    if (ra->window > ra_max) ra->window = ra_max;
+
+    /* Keep one window ahead of the reader; refill once half consumed */
+    uint32_t start = ra->ra_end > end ? ra->ra_end : end;
+    uint32_t stop  = end + ra->window;
+    if (stop > MAX_FILE_BLOCKS) stop = MAX_FILE_BLOCKS;
+    if (start >= stop || start - end > ra->window / 2) return 0;
+
+    ra->ra_end = stop;
+    *from = start;
+    return (int)(stop - start);
+}
+
+/*
+ * ra_submit
+ *
+ * Queues physical blocks for the worker.  Blocks that do not fit are
+ * dropped: readahead is only a hint.
+ */
+void ra_submit(const uint32_t *blocks, uint32_t n)
+{
+    if (!ra_running || n == 0) return;
+
+    pthread_mutex_lock(&ra_lock);
+    for (uint32_t i = 0; i < n && q_len < RA_QUEUE; i++) {
+        queue[(q_head + q_len) % RA_QUEUE] = blocks[i];
+        q_len++;
+    }
+    pthread_cond_signal(&ra_cond);
+    pthread_mutex_unlock(&ra_lock);
+}
@@ -0,0 +1,175 @@
+/*
+ * snapshot.c — Named read-only snapshots
+ *
+ *   snapshot_load()      — check the snapshot table at mount
+ *   snapshot_map()       — a snapshot's inode map, read on first use
+ *   snapshot_find()      — look up a snapshot slot by name
+ *   snapshot_create()    — freeze the current inode map under a name
+ *   snapshot_delete()    — drop a snapshot; its blocks become GC-able
+ *   snapshot_write_map() — rewrite a snapshot's map block (GC only)
+ *
+ * Blocks are never overwritten in an LFS, so a point-in-time image is
+ * just a retained inode map: creating a snapshot appends one block
+ * holding a copy of inode_map[] and records it in the superblock.
+ * No data is copied.  GC treats the snapshot map as another root.
+ */
+
+#include <string.h>
+#include <stdio.h>
+#include "lfs.h"
+
+/* Pack a snapshot's inode map into a full block (rest is zeroed) */
+static void map_to_block(const uint32_t *imap, uint8_t *buf)
+{
+    memset(buf, 0, BLOCK_SIZE);
+    memcpy(buf, imap, INODE_MAP_SIZE * sizeof(uint32_t));
+}
+
+/*
+ * snapshot_load
+ *
+ * Checks that every snapshot's map block lies on the disk.  The maps
+ * themselves are read by snapshot_map() when a snapshot is first
+ * browsed or GC runs, so mounting costs no I/O per snapshot.
+ */
+int snapshot_load(struct lfs_state *state)
+{
+    if (!state) return -1;
+
+    state->snap_loaded = 0;
+    for (int s = 0; s < LFS_MAX_SNAPSHOTS; s++) {
+        uint32_t blk = state->sb.snap[s].imap_block;
+        if (blk >= state->sb.total_blocks) {
+            fprintf(stderr, "snapshot_load: map of '%s' at bad block %u\n",
+                    state->sb.snap[s].name, blk);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * snapshot_map
+ *
+ * Returns the inode map of the snapshot in 'slot', reading it from its
+ * map block the first time.  NULL if the slot is empty or the read
+ * fails.
+ */
+uint32_t *snapshot_map(struct lfs_state *state, int slot)
+{
+    if (!state || slot < 0 || slot >= LFS_MAX_SNAPSHOTS) return NULL;
+
+    uint32_t blk = state->sb.snap[slot].imap_block;
+    if (blk == 0) return NULL;
+    if (state->snap_loaded & (1u << slot)) return state->snap_imap[slot];
+
+    uint8_t buf[BLOCK_SIZE];
+    if (disk_read(blk, buf) != 0) {
+        fprintf(stderr, "snapshot_map: cannot read map of '%s' "
+                        "(block %u)\n", state->sb.snap[slot].name, blk);
+        return NULL;
+    }
+    memcpy(state->snap_imap[slot], buf, INODE_MAP_SIZE * sizeof(uint32_t));
+    state->snap_loaded |= 1u << slot;
+    return state->snap_imap[slot];
+}
+
+/* Returns the slot of snapshot 'name', or -1 if there is none */
+int snapshot_find(struct lfs_state *state, const char *name)
+{
+    if (!state || !name) return -1;
+
+    for (int s = 0; s < LFS_MAX_SNAPSHOTS; s++) {
+        if (state->sb.snap[s].imap_block != 0 &&
+            strncmp(state->sb.snap[s].name, name, MAX_NAME_LEN) == 0)
+            return s;
+    }
+    return -1;
+}
+
+/*
+ * snapshot_create
+ *
+ * Checkpoints, then appends a copy of the inode map and records it in
+ * a free superblock slot.  Cost is one block append plus the
+ * checkpoint, independent of how much data the snapshot covers.
+ * Returns the slot on success, -1 on error (no free slot, name taken,
+ * log full).
+ */
+int snapshot_create(struct lfs_state *state, const char *name)
+{
+    if (!state || !name || name[0] == '\0') return -1;
+    if (strlen(name) >= MAX_NAME_LEN) return -1;
+
+    if (snapshot_find(state, name) >= 0) {
+        fprintf(stderr, "snapshot_create: '%s' already exists\n", name);
+        return -1;
+    }
+
+    int slot = -1;
+    for (int s = 0; s < LFS_MAX_SNAPSHOTS; s++) {
+        if (state->sb.snap[s].imap_block == 0) { slot = s; break; }
+    }
+    if (slot < 0) {
+        fprintf(stderr, "snapshot_create: snapshot table is full\n");
+        return -1;
+    }
+
+    /* Everything the map references must be durable first */
+    if (log_checkpoint(state) != 0) return -1;
+
+    uint8_t buf[BLOCK_SIZE];
+    map_to_block(state->inode_map, buf);
+    int blk = log_append_ex(state, buf, 0, (uint32_t)slot, LFS_BLK_IMAP);
+    if (blk < 0) return -1;
+
+    memcpy(state->snap_imap[slot], state->inode_map,
+           sizeof(state->snap_imap[slot]));
+    state->snap_loaded |= 1u << slot;
+    memset(&state->sb.snap[slot], 0, sizeof(state->sb.snap[slot]));
+    strncpy(state->sb.snap[slot].name, name, MAX_NAME_LEN - 1);
+    state->sb.snap[slot].imap_block = (uint32_t)blk;
+
+    if (log_checkpoint(state) != 0) return -1;
+
+    printf("snapshot_create: '%s' in slot %d, map at block %u\n",
+           name, slot, (uint32_t)blk);
+    return slot;
+}
+
+/*
+ * snapshot_delete
+ *
+ * Frees the superblock slot.  The map block and every block only the
+ * snapshot referenced become dead and are reclaimed by the next GC.
+ */
+int snapshot_delete(struct lfs_state *state, const char *name)
+{
+    int slot = snapshot_find(state, name);
+    if (slot < 0) return -1;
+
+    memset(&state->sb.snap[slot], 0, sizeof(state->sb.snap[slot]));
+    memset(state->snap_imap[slot], 0, sizeof(state->snap_imap[slot]));
+    state->snap_loaded &= ~(1u << slot);
+
+    printf("snapshot_delete: '%s' (slot %d)\n", name, slot);
+    return log_checkpoint(state);
+}
+
+/*
+ * snapshot_write_map
+ *
+ * Writes snap_imap[slot] to the snapshot's map block in place.  Only
+ * GC does this, after relocating blocks the snapshot references.
+ */
+int snapshot_write_map(struct lfs_state *state, int slot)
+{
+    if (!state || slot < 0 || slot >= LFS_MAX_SNAPSHOTS) return -1;
+
+    uint32_t blk = state->sb.snap[slot].imap_block;
+    if (blk == 0 || !(state->snap_loaded & (1u << slot))) return -1;
+
+    uint8_t buf[BLOCK_SIZE];
+    map_to_block(state->snap_imap[slot], buf);
+    return disk_write(blk, buf);
+}
@@ -0,0 +1,204 @@
+/*
+ * stats.c — Runtime statistics
+ *
+ * Every timed operation (FUSE ops, disk I/O, log appends, checkpoints,
+ * GC passes) keeps a count, an error count, a latency sum and a
+ * histogram with power-of-two nanosecond buckets.  Updates are relaxed
+ * atomic adds, so recording never takes a lock; a reader may see the
+ * fields of one operation a few events apart, which monitoring does
+ * not mind.
+ *
+ * stats_text() renders everything in the Prometheus text format; the
+ * FUSE layer serves it as /.lfs/stats.
+ */
+
+#define _GNU_SOURCE             /* open_memstream */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "lfs.h"
+
+#define HIST_BUCKETS  32        /* bucket i: [2^i, 2^(i+1)) ns; the
+                                   last one also takes anything longer */
+#define HIST_FIRST    10        /* buckets below ~1 us are folded in  */
+
+struct op_stat {
+    uint64_t count;
+    uint64_t errors;
+    uint64_t sum_ns;
+    uint64_t hist[HIST_BUCKETS];
+};
+
+static struct op_stat ops[STAT_NOPS];
+static uint64_t       ctrs[STAT_NCTRS];
+
+static const char *const op_names[STAT_NOPS] = {
+    [STAT_GETATTR]         = "getattr",
+    [STAT_READDIR]         = "readdir",
+    [STAT_OPEN]            = "open",
+    [STAT_RELEASE]         = "release",
+    [STAT_READ]            = "read",
+    [STAT_READ_BUF]        = "read_buf",
+    [STAT_CREATE]          = "create",
+    [STAT_WRITE]           = "write",
+    [STAT_WRITE_BUF]       = "write_buf",
+    [STAT_TRUNCATE]        = "truncate",
+    [STAT_UNLINK]          = "unlink",
+    [STAT_MKDIR]           = "mkdir",
+    [STAT_RMDIR]           = "rmdir",
+    [STAT_COPY_FILE_RANGE] = "copy_file_range",
+    [STAT_FSYNC]           = "fsync",
+    [STAT_FSYNCDIR]        = "fsyncdir",
+    [STAT_FLUSH]           = "flush",
+    [STAT_GETXATTR]        = "getxattr",
+    [STAT_SETXATTR]        = "setxattr",
+    [STAT_DISK_READ]       = "disk_read",
+    [STAT_DISK_WRITE]      = "disk_write",
+    [STAT_DISK_SYNC]       = "disk_sync",
+    [STAT_LOG_APPEND]      = "log_append",
+    [STAT_CHECKPOINT]      = "checkpoint",
+    [STAT_GC]              = "gc",
+};
+
+/*
+ * Monotonic nanoseconds; pass the result to stats_record() and
+ * TRACE_SPAN().  0 when neither statistics nor tracing need it.
+ */
+uint64_t stats_now(void)
+{
+    if (!LFS_STATS && !(LFS_TRACE && trace_on)) return 0;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/* One 'op' that started at 'start' (stats_now) has finished */
+void stats_record(enum lfs_stat_op op, uint64_t start, int failed)
+{
+    if (!LFS_STATS) return;
+
+    uint64_t ns = stats_now() - start;
+    int b = 63 - __builtin_clzll(ns | 1);
+    if (b >= HIST_BUCKETS) b = HIST_BUCKETS - 1;
+
+    struct op_stat *s = &ops[op];
+    __atomic_fetch_add(&s->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&s->sum_ns, ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&s->hist[b], 1, __ATOMIC_RELAXED);
+    if (failed) __atomic_fetch_add(&s->errors, 1, __ATOMIC_RELAXED);
+}
+
+const char *stats_op_name(enum lfs_stat_op op)
+{
+    return op < STAT_NOPS ? op_names[op] : "?";
+}
+
+void stats_add(enum lfs_stat_ctr ctr, uint64_t n)
+{
+    if (!LFS_STATS) return;
+    __atomic_fetch_add(&ctrs[ctr], n, __ATOMIC_RELAXED);
+}
+
+static uint64_t load(const uint64_t *p)
+{
+    return __atomic_load_n(p, __ATOMIC_RELAXED);
+}
+
+static void counter(FILE *f, const char *name, const char *help,
+                    uint64_t v)
+{
+    fprintf(f, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n",
+            name, help, name, name, (unsigned long long)v);
+}
+
+static void gauge(FILE *f, const char *name, const char *help, double v)
+{
+    fprintf(f, "# HELP %s %s\n# TYPE %s gauge\n%s %.10g\n",
+            name, help, name, name, v);
+}
+
+/*
+ * stats_text
+ *
+ * Returns a malloc()ed, NUL-terminated snapshot of all statistics and
+ * its length (without the NUL) in *len, or NULL if out of memory.
+ * Operations that never ran are left out.
+ */
+char *stats_text(const struct lfs_state *state, size_t *len)
+{
+    char  *text = NULL;
+    FILE  *f    = open_memstream(&text, len);
+    if (!f) return NULL;
+
+    fprintf(f, "# HELP lfs_op_seconds Latency of filesystem operations.\n"
+               "# TYPE lfs_op_seconds histogram\n");
+    for (int op = 0; op < STAT_NOPS; op++) {
+        const struct op_stat *s = &ops[op];
+        uint64_t count = load(&s->count);
+        if (count == 0) continue;
+
+        uint64_t cum = 0;
+        for (int b = 0; b < HIST_BUCKETS; b++) {
+            cum += load(&s->hist[b]);
+            if (b < HIST_FIRST - 1 || b == HIST_BUCKETS - 1) continue;
+            fprintf(f, "lfs_op_seconds_bucket{op=\"%s\",le=\"%.10g\"} %llu\n",
+                    op_names[op], (double)(1ull << (b + 1)) / 1e9,
+                    (unsigned long long)cum);
+        }
+        fprintf(f, "lfs_op_seconds_bucket{op=\"%s\",le=\"+Inf\"} %llu\n"
+                   "lfs_op_seconds_sum{op=\"%s\"} %.9g\n"
+                   "lfs_op_seconds_count{op=\"%s\"} %llu\n",
+                op_names[op], (unsigned long long)cum,
+                op_names[op], (double)load(&s->sum_ns) / 1e9,
+                op_names[op], (unsigned long long)cum);
+    }
+
+    fprintf(f, "# HELP lfs_op_errors_total Operations that failed.\n"
+               "# TYPE lfs_op_errors_total counter\n");
+    for (int op = 0; op < STAT_NOPS; op++) {
+        if (load(&ops[op].count) == 0) continue;
+        fprintf(f, "lfs_op_errors_total{op=\"%s\"} %llu\n", op_names[op],
+                (unsigned long long)load(&ops[op].errors));
+    }
+
+    counter(f, "lfs_log_blocks_total", "Blocks appended to the log.",
+            load(&ctrs[CTR_LOG_BLOCKS]));
+    counter(f, "lfs_disk_blocks_written_total",
+            "Image blocks written, including summaries and checkpoints.",
+            disk_blocks_written());
+    counter(f, "lfs_gc_blocks_moved_total", "Live blocks copied by GC.",
+            load(&ctrs[CTR_GC_MOVED]));
+    counter(f, "lfs_gc_blocks_reclaimed_total",
+            "Blocks freed by GC rewinding the log tail.",
+            load(&ctrs[CTR_GC_RECLAIMED]));
+
+    struct cache_stats cs;
+    cache_get_stats(&cs);
+    counter(f, "lfs_cache_hits_total", "Block cache hits.", cs.hits);
+    counter(f, "lfs_cache_misses_total", "Block cache misses.", cs.misses);
+    counter(f, "lfs_cache_evictions_total", "Block cache evictions.",
+            cs.evictions);
+    counter(f, "lfs_cache_prefetched_total",
+            "Blocks read into the cache by readahead.", cs.prefetched);
+    counter(f, "lfs_cache_readahead_hits_total",
+            "Prefetched blocks later read.", cs.ra_hits);
+    gauge(f, "lfs_cache_hit_ratio", "Cache hits per lookup since mount.",
+          cs.hits + cs.misses ? (double)cs.hits / (double)(cs.hits + cs.misses)
+                              : 0.0);
+
+    if (state) {
+        gauge(f, "lfs_log_tail_block", "Next log block to be written.",
+              state->log_tail);
+        gauge(f, "lfs_free_blocks", "Blocks after the log tail.",
+              state->sb.total_blocks - state->log_tail);
+        gauge(f, "lfs_commit_seq", "Sequence number of the last checkpoint.",
+              state->sb.commit_seq);
+    }
+
+    if (fclose(f) != 0) {
+        free(text);
+        return NULL;
+    }
+    return text;
+}
@@ -0,0 +1,159 @@
+/*
+ * trace.c — Event tracing
+ *
+ * Each thread that records an event gets its own ring of
+ * LFS_TRACE_EVENTS fixed-size binary events, so recording is a copy
+ * into thread-local memory and one release store: no lock, no
+ * formatting, no syscall.  When a ring is full the oldest events are
+ * overwritten.
+ *
+ * trace_dump() snapshots all rings into one buffer (see lfs.h for the
+ * layout); the FUSE layer serves it as /.lfs/trace.  Events a writer
+ * overwrote while the dump was copying its ring are dropped.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "lfs.h"
+
+struct trace_ring {
+    struct lfs_trace_event ev[LFS_TRACE_EVENTS];
+    uint64_t           head;          /* events ever recorded        */
+    uint16_t           tid;
+    struct trace_ring *next;
+};
+
+int trace_on;
+
+static pthread_mutex_t    rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct trace_ring *rings;
+static uint16_t           nrings;
+static __thread struct trace_ring *my_ring;
+static __thread int       no_ring;    /* allocation failed: give up  */
+
+void trace_set(int on)
+{
+    __atomic_store_n(&trace_on, LFS_TRACE && on, __ATOMIC_RELAXED);
+}
+
+static struct trace_ring *ring_get(void)
+{
+    if (my_ring || no_ring) return my_ring;
+
+    struct trace_ring *r = malloc(sizeof(*r));
+    if (!r) {
+        no_ring = 1;
+        return NULL;
+    }
+    r->head = 0;
+
+    pthread_mutex_lock(&rings_lock);
+    r->tid  = nrings++;
+    r->next = rings;
+    rings   = r;
+    pthread_mutex_unlock(&rings_lock);
+
+    my_ring = r;
+    return r;
+}
+
+/* Use TRACE_SPAN(), which skips the call while tracing is off */
+void trace_span(enum lfs_stat_op op, uint64_t start, uint32_t ino,
+                uint32_t block, int64_t arg)
+{
+    struct trace_ring *r = ring_get();
+    if (!r || start == 0) return;     /* began before tracing was on */
+
+    uint64_t now = stats_now();
+    uint64_t dur = now > start ? now - start : 0;
+
+    uint64_t h = r->head;
+    struct lfs_trace_event *e = &r->ev[h % LFS_TRACE_EVENTS];
+    e->start = start;
+    e->dur   = dur > UINT32_MAX ? UINT32_MAX : (uint32_t)dur;
+    e->op    = (uint16_t)op;
+    e->tid   = r->tid;
+    e->ino   = ino;
+    e->block = block;
+    e->arg   = arg;
+    __atomic_store_n(&r->head, h + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * trace_dump
+ *
+ * Returns a malloc()ed dump of every ring and its size in *len, or
+ * NULL if out of memory.
+ */
+char *trace_dump(size_t *len)
+{
+    pthread_mutex_lock(&rings_lock);
+
+    size_t max = 0;
+    for (struct trace_ring *r = rings; r; r = r->next) max++;
+    max *= LFS_TRACE_EVENTS;
+
+    size_t names = (size_t)STAT_NOPS * LFS_TRACE_NAME;
+    size_t size  = sizeof(struct lfs_trace_hdr) + names +
+                   max * sizeof(struct lfs_trace_event);
+    char *buf = calloc(1, size);
+    if (!buf) {
+        pthread_mutex_unlock(&rings_lock);
+        return NULL;
+    }
+
+    struct lfs_trace_hdr *hdr = (struct lfs_trace_hdr *)buf;
+    hdr->magic   = LFS_TRACE_MAGIC;
+    hdr->version = LFS_TRACE_VERSION;
+    hdr->nops    = STAT_NOPS;
+    for (int op = 0; op < STAT_NOPS; op++)
+        strncpy(buf + sizeof(*hdr) + (size_t)op * LFS_TRACE_NAME,
+                stats_op_name(op), LFS_TRACE_NAME - 1);
+
+    struct lfs_trace_event *out =
+        (struct lfs_trace_event *)(buf + sizeof(*hdr) + names);
+    uint32_t n = 0;
+
+    for (struct trace_ring *r = rings; r; r = r->next) {
+        uint64_t end   = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        uint64_t first = end > LFS_TRACE_EVENTS ? end - LFS_TRACE_EVENTS : 0;
+        uint32_t base  = n;
+        for (uint64_t i = first; i < end; i++)
+            out[n++] = r->ev[i % LFS_TRACE_EVENTS];
+
+        /* Drop what the owner overwrote while we copied, and the
+         * slot it may be writing right now */
+        uint64_t now  = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) + 1;
+        uint64_t lost = now > first + LFS_TRACE_EVENTS
+                      ? now - first - LFS_TRACE_EVENTS : 0;
+        if (lost >= end - first) {
+            n = base;
+        } else if (lost) {
+            memmove(&out[base], &out[base + lost],
+                    (n - base - lost) * sizeof(*out));
+            n -= (uint32_t)lost;
+        }
+    }
+    pthread_mutex_unlock(&rings_lock);
+
+    hdr->nevents = n;
+    *len = sizeof(*hdr) + names + (size_t)n * sizeof(*out);
+    return buf;
+}
+
+/* Release every ring at unmount, once no other thread records */
+void trace_free(void)
+{
+    trace_set(0);
+    pthread_mutex_lock(&rings_lock);
+    while (rings) {
+        struct trace_ring *r = rings;
+        rings = r->next;
+        free(r);
+    }
+    nrings = 0;
+    pthread_mutex_unlock(&rings_lock);
+    my_ring = NULL;
+}
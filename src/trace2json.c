@@ -0,0 +1,103 @@
+/*
+ * trace2json.c — Convert a trace dump to Chrome trace JSON
+ *
+ * Reads a dump copied out of /.lfs/trace (format in lfs.h) and writes
+ * the Trace Event format that chrome://tracing and Perfetto load: one
+ * complete ("X") event per span, one timeline row per lfs thread.
+ * FUSE operations are in category "fuse", everything below them
+ * (disk I/O, log appends, checkpoints, GC) in "lfs".
+ *
+ *   usage: lfs_trace2json DUMP > trace.json
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lfs.h"
+
+static char *read_file(const char *path, size_t *len)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        perror(path);
+        return NULL;
+    }
+
+    size_t cap = 1 << 20, n = 0, got;
+    char *buf = malloc(cap);
+    while (buf && (got = fread(buf + n, 1, cap - n, f)) > 0) {
+        n += got;
+        if (n == cap) {
+            char *nb = realloc(buf, cap *= 2);
+            if (!nb) free(buf);
+            buf = nb;
+        }
+    }
+    if (!buf) fprintf(stderr, "%s: out of memory\n", path);
+    fclose(f);
+    *len = n;
+    return buf;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s DUMP > trace.json\n", argv[0]);
+        return 2;
+    }
+
+    size_t len;
+    char *buf = read_file(argv[1], &len);
+    if (!buf) return 1;
+
+    const struct lfs_trace_hdr *hdr = (const struct lfs_trace_hdr *)buf;
+    if (len < sizeof(*hdr) || hdr->magic != LFS_TRACE_MAGIC) {
+        fprintf(stderr, "%s: not an lfs trace\n", argv[1]);
+        return 1;
+    }
+    if (hdr->version != LFS_TRACE_VERSION) {
+        fprintf(stderr, "%s: trace version %u, expected %u\n",
+                argv[1], hdr->version, LFS_TRACE_VERSION);
+        return 1;
+    }
+
+    /* Names come from the dump, so a converter built against another
+     * revision still labels every operation the way lfs did */
+    size_t names = (size_t)hdr->nops * LFS_TRACE_NAME;
+    if (len < sizeof(*hdr) + names +
+              (size_t)hdr->nevents * sizeof(struct lfs_trace_event)) {
+        fprintf(stderr, "%s: truncated\n", argv[1]);
+        return 1;
+    }
+    const char *name = buf + sizeof(*hdr);
+    const struct lfs_trace_event *ev =
+        (const struct lfs_trace_event *)(buf + sizeof(*hdr) + names);
+
+    /* Timestamps are relative to the first event */
+    uint64_t base = UINT64_MAX;
+    for (uint32_t i = 0; i < hdr->nevents; i++)
+        if (ev[i].start < base) base = ev[i].start;
+
+    printf("{\"traceEvents\":[\n");
+    for (uint32_t i = 0; i < hdr->nevents; i++) {
+        const struct lfs_trace_event *e = &ev[i];
+        char op[LFS_TRACE_NAME];
+        if (e->op < hdr->nops)
+            snprintf(op, sizeof(op), "%.*s", LFS_TRACE_NAME - 1,
+                     name + (size_t)e->op * LFS_TRACE_NAME);
+        else
+            snprintf(op, sizeof(op), "op%u", e->op);
+
+        printf("%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\","
+               "\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%u,"
+               "\"args\":{\"ino\":%u,\"block\":%u,\"arg\":%lld}}\n",
+               i ? "," : "", op,
+               e->op < STAT_DISK_READ ? "fuse" : "lfs",
+               (double)(e->start - base) / 1e3, (double)e->dur / 1e3,
+               e->tid, e->ino, e->block, (long long)e->arg);
+    }
+    printf("],\"displayTimeUnit\":\"ns\"}\n");
+
+    free(buf);
+    return 0;
+}
@@ -0,0 +1,589 @@
+/*
+ * workload.c — End-to-end workload driver
+ *
+ * Formats a scratch image with mkfs_lfs, mounts lfs on it and runs
+ * representative workloads through the kernel, so the numbers include
+ * FUSE and the mount options under test:
+ *
+ *   seq      — sequential write, then read after a remount, at several
+ *              request sizes
+ *   rand     — random 4 KB overwrites of a preallocated file
+ *   small    — small-file create / stat / unlink storms
+ *   deep     — stat of a path 16 directories deep
+ *   dir      — listing a directory of 100 entries
+ *   churn    — rewriting files until the log wraps and GC runs
+ *
+ * Every workload starts on a freshly formatted image.  Each result has
+ * throughput, p50/p99/p999 latency of the individual operations and
+ * the image blocks lfs wrote (read from the root's
+ * "user.lfs.blocks_written" attribute); where the workload writes
+ * data, write_amp is image bytes written per user byte.
+ *
+ * Run from src/, like "make format": mkfs_lfs creates ../lfs.img.
+ * Arguments after "--" are passed to lfs, e.g.
+ *
+ *   ../lfs_workload -o base.json
+ *   ../lfs_workload -o noattr.json -- -o attr_timeout=0
+ *
+ * With -n the workloads run in MNT as it is (already mounted, or any
+ * other filesystem for comparison) and nothing is formatted.
+ *
+ *   usage: lfs_workload [-m MNT] [-l LFS] [-k MKFS] [-o FILE]
+ *                       [-w LIST] [-n] [-- LFS-ARGS...]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <dirent.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/xattr.h>
+
+#define WL_BLOCK        4096
+#define WL_XATTR        "user.lfs.blocks_written"
+
+/* Sizes fit the 4 MB image: ~1000 log blocks and 128 inodes */
+#define SEQ_BYTES       (2u << 20)
+#define RAND_FILE       (1u << 20)
+#define RAND_OPS        2000
+#define SMALL_FILES     96
+#define SMALL_ROUNDS    5
+#define SMALL_SIZE      1024
+#define DEEP_DEPTH      16
+#define DEEP_OPS        20000
+#define DIR_FILES       100
+#define DIR_LISTS       1000
+#define CHURN_LIVE      6
+#define CHURN_FILE      (256u << 10)
+#define CHURN_WRITES    48
+
+static const char *mnt      = "mount";
+static const char *lfs_bin  = "../lfs";
+static const char *mkfs_bin = "../mkfs_lfs";
+static const char *only;               /* -w: workloads to run        */
+static char      **lfs_args;           /* after "--"                  */
+static int         nlfs_args;
+static int         no_mount;
+static pid_t       daemon_pid;
+static char        work[4096];         /* scratch directory in mnt    */
+
+static FILE *out;
+static int   first_result = 1;
+static char  buf[128u << 10];
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void fs_unmount(void);
+
+static void die(const char *what)
+{
+    fprintf(stderr, "lfs_workload: %s: %s\n", what, strerror(errno));
+    fs_unmount();
+    exit(1);
+}
+
+/* ------------------------------------------------------------------ */
+/*  Latency samples                                                     */
+/* ------------------------------------------------------------------ */
+
+struct lat {
+    double *v;                 /* microseconds                      */
+    size_t  n, cap;
+};
+
+static void lat_add(struct lat *l, double us)
+{
+    if (l->n == l->cap) {
+        l->cap = l->cap ? l->cap * 2 : 1024;
+        l->v   = realloc(l->v, l->cap * sizeof(double));
+        if (!l->v) die("realloc");
+    }
+    l->v[l->n++] = us;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* Percentile 'p' (0-100) of sorted samples */
+static double pct(const struct lat *l, double p)
+{
+    size_t i = (size_t)(p / 100.0 * (double)(l->n - 1) + 0.5);
+    return l->v[i];
+}
+
+/* ------------------------------------------------------------------ */
+/*  Mounting                                                            */
+/* ------------------------------------------------------------------ */
+
+/* Run a program with stdout discarded; returns its exit status */
+static int run(char *const argv[])
+{
+    pid_t pid = fork();
+    if (pid < 0) die("fork");
+    if (pid == 0) {
+        int fd = open("/dev/null", O_WRONLY);
+        if (fd >= 0) dup2(fd, STDOUT_FILENO);
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+    int status;
+    if (waitpid(pid, &status, 0) < 0) die("waitpid");
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+static int is_mounted(void)
+{
+    char parent[4096];
+    struct stat a, b;
+    snprintf(parent, sizeof(parent), "%s/..", mnt);
+    if (stat(mnt, &a) != 0 || stat(parent, &b) != 0) return 0;
+    return a.st_dev != b.st_dev;
+}
+
+/* Start lfs in the foreground and wait until the mount appears */
+static void fs_mount(void)
+{
+    daemon_pid = fork();
+    if (daemon_pid < 0) die("fork");
+    if (daemon_pid == 0) {
+        char **argv = calloc((size_t)nlfs_args + 4, sizeof(char *));
+        if (!argv) _exit(127);
+        int n = 0;
+        argv[n++] = (char *)lfs_bin;
+        argv[n++] = "-f";
+        for (int i = 0; i < nlfs_args; i++) argv[n++] = lfs_args[i];
+        argv[n++] = (char *)mnt;
+        int fd = open("/dev/null", O_WRONLY);
+        if (fd >= 0) dup2(fd, STDOUT_FILENO);
+        execv(lfs_bin, argv);
+        _exit(127);
+    }
+
+    for (int i = 0; i < 500; i++) {
+        if (is_mounted()) return;
+        if (waitpid(daemon_pid, NULL, WNOHANG) == daemon_pid) break;
+        usleep(10000);
+    }
+    daemon_pid = 0;
+    errno = EIO;
+    die("mount");
+}
+
+static void fs_unmount(void)
+{
+    if (daemon_pid <= 0) return;
+    char *argv[] = { "fusermount3", "-u", (char *)mnt, NULL };
+    if (run(argv) != 0) kill(daemon_pid, SIGTERM);
+    waitpid(daemon_pid, NULL, 0);
+    daemon_pid = 0;
+}
+
+/* Fresh image, fresh mount and an empty scratch directory */
+static void fs_setup(void)
+{
+    if (!no_mount) {
+        char *argv[] = { (char *)mkfs_bin, NULL };
+        if (run(argv) != 0) {
+            errno = EIO;
+            die(mkfs_bin);
+        }
+        fs_mount();
+    }
+    snprintf(work, sizeof(work), "%s/wl", mnt);
+    if (mkdir(work, 0755) != 0) die(work);
+}
+
+static void fs_teardown(void)
+{
+    if (no_mount) {
+        char *argv[] = { "rm", "-rf", work, NULL };
+        run(argv);
+        return;
+    }
+    fs_unmount();
+}
+
+/* Cold caches: remount (nothing to do with -n) */
+static void fs_remount(void)
+{
+    if (no_mount) return;
+    fs_unmount();
+    fs_mount();
+}
+
+/* Image blocks lfs has written since mount, -1 if not available */
+static int64_t blocks_written(void)
+{
+    char v[32];
+    ssize_t n = getxattr(mnt, WL_XATTR, v, sizeof(v) - 1);
+    if (n <= 0) return -1;
+    v[n] = '\0';
+    return strtoll(v, NULL, 10);
+}
+
+/* ------------------------------------------------------------------ */
+/*  JSON output                                                         */
+/* ------------------------------------------------------------------ */
+
+static void field(const char *key, double v)
+{
+    fprintf(out, ", \"%s\": %.10g", key, v);
+}
+
+/*
+ * One result: 'l' holds per-operation latencies, 'bytes' the user data
+ * moved ('written' if it was written), 'secs' the wall time of the
+ * whole run and 'w0' the blocks_written sample taken before it.
+ */
+static void report(const char *name, struct lat *l, uint64_t bytes,
+                   int written, double secs, int64_t w0)
+{
+    int64_t w1 = blocks_written();
+
+    fprintf(out, "%s\n    {\"name\": \"%s\"", first_result ? "" : ",", name);
+    first_result = 0;
+    field("ops", (double)l->n);
+    field("seconds", secs);
+    field("ops_per_s", (double)l->n / secs);
+    if (bytes) field("mb_per_s", (double)bytes / secs / 1e6);
+    if (l->n) {
+        qsort(l->v, l->n, sizeof(double), cmp_double);
+        field("p50_us", pct(l, 50));
+        field("p99_us", pct(l, 99));
+        field("p999_us", pct(l, 99.9));
+    }
+    if (w0 >= 0 && w1 >= w0) {
+        field("blocks_written", (double)(w1 - w0));
+        if (bytes && written)
+            field("write_amp", (double)(w1 - w0) * WL_BLOCK / (double)bytes);
+    }
+    fprintf(out, "}");
+    fflush(out);
+
+    free(l->v);
+    memset(l, 0, sizeof(*l));
+}
+
+/* ------------------------------------------------------------------ */
+/*  Workloads                                                           */
+/* ------------------------------------------------------------------ */
+
+static void fill(uint32_t seed)
+{
+    for (size_t i = 0; i < sizeof(buf); i++)
+        buf[i] = (char)(seed + i * 31);
+}
+
+/* Write 'size' bytes to 'path' in 'bs'-sized requests, timing each */
+static void write_file(const char *path, uint32_t size, uint32_t bs,
+                       struct lat *l)
+{
+    int fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+    if (fd < 0) die(path);
+    for (uint32_t off = 0; off < size; off += bs) {
+        double t0 = now();
+        if (write(fd, buf, bs) != (ssize_t)bs) die("write");
+        if (l) lat_add(l, (now() - t0) * 1e6);
+    }
+    if (close(fd) != 0) die("close");
+}
+
+static void wl_seq(void)
+{
+    static const uint32_t sizes[] = { 4096, 16384, 65536, 131072 };
+    char path[4200], name[64];
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        uint32_t bs = sizes[s];
+        struct lat l = { 0 };
+
+        fs_setup();
+        snprintf(path, sizeof(path), "%s/seq", work);
+        fill(bs);
+
+        int64_t w0 = blocks_written();
+        double t0 = now();
+        int fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+        if (fd < 0) die(path);
+        for (uint32_t off = 0; off < SEQ_BYTES; off += bs) {
+            double t1 = now();
+            if (write(fd, buf, bs) != (ssize_t)bs) die("write");
+            lat_add(&l, (now() - t1) * 1e6);
+        }
+        if (fsync(fd) != 0 || close(fd) != 0) die("fsync");
+        double secs = now() - t0;
+        snprintf(name, sizeof(name), "seq_write_%uk", bs >> 10);
+        report(name, &l, SEQ_BYTES, 1, secs, w0);
+
+        fs_remount();
+        w0 = blocks_written();
+        t0 = now();
+        fd = open(path, O_RDONLY);
+        if (fd < 0) die(path);
+        for (uint32_t off = 0; off < SEQ_BYTES; off += bs) {
+            double t1 = now();
+            if (read(fd, buf, bs) != (ssize_t)bs) die("read");
+            lat_add(&l, (now() - t1) * 1e6);
+        }
+        close(fd);
+        secs = now() - t0;
+        snprintf(name, sizeof(name), "seq_read_%uk", bs >> 10);
+        report(name, &l, SEQ_BYTES, 0, secs, w0);
+        fs_teardown();
+    }
+}
+
+/* xorshift32: the same offsets on every run */
+static uint32_t rng = 2463534242u;
+static uint32_t next_rand(void)
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng;
+}
+
+static void wl_rand(void)
+{
+    char path[4200];
+    struct lat l = { 0 };
+
+    fs_setup();
+    snprintf(path, sizeof(path), "%s/rand", work);
+    fill(7);
+    write_file(path, RAND_FILE, sizeof(buf), NULL);
+
+    int fd = open(path, O_WRONLY);
+    if (fd < 0) die(path);
+    int64_t w0 = blocks_written();
+    double t0 = now();
+    for (int i = 0; i < RAND_OPS; i++) {
+        off_t off = (off_t)(next_rand() % (RAND_FILE / WL_BLOCK)) * WL_BLOCK;
+        double t1 = now();
+        if (pwrite(fd, buf + (i % 16) * WL_BLOCK, WL_BLOCK, off) != WL_BLOCK)
+            die("pwrite");
+        lat_add(&l, (now() - t1) * 1e6);
+    }
+    if (fsync(fd) != 0 || close(fd) != 0) die("fsync");
+    double secs = now() - t0;
+    report("rand_overwrite_4k", &l, (uint64_t)RAND_OPS * WL_BLOCK, 1,
+           secs, w0);
+    fs_teardown();
+}
+
+static void wl_small(void)
+{
+    char path[4200];
+    struct lat lc = { 0 }, ls = { 0 }, lu = { 0 };
+    double sc = 0, ss = 0, su = 0;
+    int64_t wc = 0, wu = 0;
+    struct stat st;
+
+    fs_setup();
+    fill(3);
+    for (int r = 0; r < SMALL_ROUNDS; r++) {
+        int64_t w0 = blocks_written();
+        double t0 = now();
+        for (int i = 0; i < SMALL_FILES; i++) {
+            snprintf(path, sizeof(path), "%s/f%03d", work, i);
+            double t1 = now();
+            write_file(path, SMALL_SIZE, SMALL_SIZE, NULL);
+            lat_add(&lc, (now() - t1) * 1e6);
+        }
+        sc += now() - t0;
+        wc += blocks_written() - w0;
+
+        t0 = now();
+        for (int i = 0; i < SMALL_FILES; i++) {
+            snprintf(path, sizeof(path), "%s/f%03d", work, i);
+            double t1 = now();
+            if (stat(path, &st) != 0) die(path);
+            lat_add(&ls, (now() - t1) * 1e6);
+        }
+        ss += now() - t0;
+
+        w0 = blocks_written();
+        t0 = now();
+        for (int i = 0; i < SMALL_FILES; i++) {
+            snprintf(path, sizeof(path), "%s/f%03d", work, i);
+            double t1 = now();
+            if (unlink(path) != 0) die(path);
+            lat_add(&lu, (now() - t1) * 1e6);
+        }
+        su += now() - t0;
+        wu += blocks_written() - w0;
+    }
+
+    /* report() takes a "before" sample; hand it one that yields the sum */
+    int64_t w = blocks_written();
+    report("small_create", &lc,
+           (uint64_t)SMALL_ROUNDS * SMALL_FILES * SMALL_SIZE, 1, sc,
+           w >= 0 ? w - wc : -1);
+    report("small_stat", &ls, 0, 0, ss, -1);
+    w = blocks_written();
+    report("small_unlink", &lu, 0, 0, su, w >= 0 ? w - wu : -1);
+    fs_teardown();
+}
+
+static void wl_deep(void)
+{
+    char path[4200];
+    struct lat l = { 0 };
+    struct stat st;
+
+    fs_setup();
+    size_t len = (size_t)snprintf(path, sizeof(path), "%s", work);
+    for (int d = 0; d < DEEP_DEPTH; d++) {
+        len += (size_t)snprintf(path + len, sizeof(path) - len, "/d%02d", d);
+        if (mkdir(path, 0755) != 0) die(path);
+    }
+
+    double t0 = now();
+    for (int i = 0; i < DEEP_OPS; i++) {
+        double t1 = now();
+        if (stat(path, &st) != 0) die(path);
+        lat_add(&l, (now() - t1) * 1e6);
+    }
+    double secs = now() - t0;
+    report("deep_stat", &l, 0, 0, secs, -1);
+    fs_teardown();
+}
+
+static void wl_dir(void)
+{
+    char path[4200];
+    struct lat l = { 0 };
+
+    fs_setup();
+    for (int i = 0; i < DIR_FILES; i++) {
+        snprintf(path, sizeof(path), "%s/entry%03d", work, i);
+        int fd = open(path, O_CREAT | O_WRONLY, 0644);
+        if (fd < 0) die(path);
+        close(fd);
+    }
+
+    double t0 = now();
+    for (int i = 0; i < DIR_LISTS; i++) {
+        double t1 = now();
+        DIR *d = opendir(work);
+        if (!d) die(work);
+        int n = 0;
+        while (readdir(d)) n++;
+        closedir(d);
+        if (n < DIR_FILES) {
+            errno = ENOENT;
+            die("readdir");
+        }
+        lat_add(&l, (now() - t1) * 1e6);
+    }
+    double secs = now() - t0;
+    report("dir_list_100", &l, 0, 0, secs, -1);
+    fs_teardown();
+}
+
+/*
+ * Keep CHURN_LIVE files alive and keep replacing the oldest one: the
+ * log fills with dead blocks and every write past the first lap needs
+ * the cleaner.
+ */
+static void wl_churn(void)
+{
+    char path[4200];
+    struct lat l = { 0 };
+
+    fs_setup();
+    fill(11);
+    int64_t w0 = blocks_written();
+    double t0 = now();
+    for (int i = 0; i < CHURN_WRITES; i++) {
+        snprintf(path, sizeof(path), "%s/c%d", work, i % CHURN_LIVE);
+        double t1 = now();
+        if (i >= CHURN_LIVE && unlink(path) != 0) die(path);
+        write_file(path, CHURN_FILE, 64u << 10, NULL);
+        lat_add(&l, (now() - t1) * 1e6);
+    }
+    double secs = now() - t0;
+    report("gc_churn", &l, (uint64_t)CHURN_WRITES * CHURN_FILE, 1, secs, w0);
+    fs_teardown();
+}
+
+/* ------------------------------------------------------------------ */
+
+static int wanted(const char *name)
+{
+    return !only || strstr(only, name) != NULL;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-m MNT] [-l LFS] [-k MKFS] [-o FILE] "
+                    "[-w LIST] [-n] [-- LFS-ARGS...]\n"
+                    "  LIST: comma-separated subset of "
+                    "seq,rand,small,deep,dir,churn\n", prog);
+    exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *out_path = NULL;
+    int i;
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--") == 0) { i++; break; }
+        if (strcmp(argv[i], "-n") == 0) { no_mount = 1; continue; }
+        if (argv[i][0] != '-' || argv[i][2] || i + 1 >= argc) usage(argv[0]);
+        const char *v = argv[++i];
+        switch (argv[i - 1][1]) {
+        case 'm': mnt      = v; break;
+        case 'l': lfs_bin  = v; break;
+        case 'k': mkfs_bin = v; break;
+        case 'o': out_path = v; break;
+        case 'w': only     = v; break;
+        default:  usage(argv[0]);
+        }
+    }
+    lfs_args  = argv + i;
+    nlfs_args = argc - i;
+
+    out = out_path ? fopen(out_path, "w") : stdout;
+    if (!out) die(out_path);
+    if (!no_mount) {
+        mkdir(mnt, 0755);
+        if (is_mounted()) {
+            errno = EBUSY;
+            die(mnt);
+        }
+    }
+
+    fprintf(out, "{\n  \"mount\": \"%s\",\n  \"formatted\": %d,\n"
+                 "  \"lfs_args\": \"", mnt, !no_mount);
+    for (int a = 0; a < nlfs_args; a++)
+        fprintf(out, "%s%s", a ? " " : "", lfs_args[a]);
+    fprintf(out, "\",\n  \"results\": [");
+
+    if (wanted("seq"))   wl_seq();
+    if (wanted("rand"))  wl_rand();
+    if (wanted("small")) wl_small();
+    if (wanted("deep"))  wl_deep();
+    if (wanted("dir"))   wl_dir();
+    if (wanted("churn")) wl_churn();
+
+    fprintf(out, "\n  ]\n}\n");
+    if (out != stdout) fclose(out);
+    return 0;
+}